@@ -33,6 +33,44 @@ typedef unordered_map<string, string> PDATA;
 
 const H5std_string  DATASET_NAME( "data");
 const H5std_string  DATASET_ROWNAME( "rownames");
+const H5std_string  ATTR_LAYOUT( "layout");
+
+/**
+ * storage layout of the event data in h5
+ * column: each chunk holds a run of events of a single channel
+ * tile: each chunk holds a block of events across several adjacent channels
+ */
+enum class H5Layout {column, tile};
+/**
+ * the chunking and filters used for the event data in h5
+ * It is recorded in the file (as the layout attribute of the data set along with its chunk dims and filters)
+ * so that the reader can pick the matching access pattern
+ * The default is the legacy layout that chunks each channel by its entire column, the other layouts are opt-in
+ */
+struct H5_LAYOUT_PARAM{
+	H5Layout layout;
+	hsize_t chunk_rows;//number of events per chunk, 0 (default) means the entire column
+	hsize_t tile_cols;//number of channels per chunk, only used by tile layout
+	int deflate;//gzip compression level (1-9), 0 means no compression
+	bool shuffle;//byte shuffle filter applied before the compression
+	H5_LAYOUT_PARAM(){
+		layout = H5Layout::column;
+		chunk_rows = 0;//the legacy {1, nEvents} chunk
+		tile_cols = 8;
+		deflate = 0;
+		shuffle = false;
+	}
+	/**
+	 * the actual chunk dims ({channels, events}) for the data set of the given size
+	 */
+	void get_chunk_dims(hsize_t nCol, hsize_t nEvents, hsize_t * chunk_dims) const;
+	DSetCreatPropList get_plist(hsize_t nCol, hsize_t nEvents) const;
+	/**
+	 * record/restore the layout to/from the data set
+	 */
+	void save(DataSet & dataset) const;
+	void load(const DataSet & dataset);
+};
 
 /*
  * simple vector version of keyword type
@@ -134,7 +172,16 @@ public:
 	virtual bool get_readonly() const{
 		return false;
 		}
+	/**
+	 * compensate the events
+	 * The generic version realizes the entire event matrix (get_data/set_data),
+	 * which MemCytoFrame (in place) and H5CytoFrame (by the blocks of rows) override to avoid the copy
+	 */
 	virtual void compensate(const compensation & comp);
+	/**
+	 * look up the columns of the markers and detectors of the compensation
+	 */
+	void get_compensation_idx(const compensation & comp, arma::uvec & marker_idx, arma::uvec & detector_idx) const;
 
 	virtual void scale_time_channel(string time_channel = "time");
 	/**
@@ -221,8 +268,9 @@ public:
 	 * save the CytoFrame as HDF5 format
 	 *
 	 * @param filename the path of the output H5 file
+	 * @param layout the chunking and compression of the event data
 	 */
-	virtual void write_h5(const string & filename) const;
+	virtual void write_h5(const string & filename, const H5_LAYOUT_PARAM & layout = H5_LAYOUT_PARAM()) const;
 	/**
 	 * get the data of entire event matrix
 	 * @return
@@ -442,6 +490,18 @@ public:
 	 */
 	virtual void append_data_columns(const EVENT_DATA_VEC & new_cols)=0;
 
+	/**
+	 * Add the events (rows) to the end of the data, e.g. the ones streamed from an acquisition.
+	 * The $TOT keyword is updated as well.
+	 * The params (e.g. the ranges) are left as they are.
+	 */
+	void append_events(const EVENT_DATA_VEC & new_events);
+
+	/**
+	 * Append rows to data matrix, which is handled by each backend.
+	 */
+	virtual void append_data_rows(const EVENT_DATA_VEC & new_events)=0;
+
 	/**
 	 * get all the marker names
 	 * @return
@@ -129,7 +129,10 @@ public:
 				if(h5_opt == CytoFileOption::move&&oldh5!="")
 				{
 					if(!fs::equivalent(fs::path(oldh5), fs::path(cf_filename)))
+					{
+						H5FileCache::instance().release(oldh5);
 						fs::remove_all(oldh5);
+					}
 
 				}
 			}
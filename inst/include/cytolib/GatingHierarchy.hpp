@@ -20,6 +20,7 @@
 #include "MemCytoFrame.hpp"
 #include "CytoFrameView.hpp"
 #include "H5CytoFrame.hpp"
+#include "unmixing.hpp"
 using namespace std;
 
 namespace cytolib
@@ -102,6 +103,23 @@ private:
 	PARAM_VEC transFlag; /*< for internal use of parse flowJo workspace */
 	trans_local trans; /*< the transformation used for this particular GatingHierarchy object */
 	CytoFrameView frame_;
+	/*
+	 * resolve the compensation to be applied to the cytoframe
+	 * @return false when no compensation is needed
+	 */
+	bool resolve_compensation(CytoFrame & cytoframe);
+	/*
+	 * add prefix/suffix to the compensated channels
+	 */
+	void prefix_compensated_channels(CytoFrame & cytoframe);
+	/*
+	 * the reference nodes of each bool gate (refs) and the bool gates referencing each node (referrers)
+	 */
+	void get_bool_refs(vector<VertexID_vec> & refs, vector<VertexID_vec> & referrers);
+	/*
+	 * order the nodes so that each one comes after its parent and reference nodes (when they are among the nodes as well)
+	 */
+	VertexID_vec sort_by_dependency(const VertexID_vec & nodes, const vector<VertexID_vec> & refs);
 public:
 	bool is_cytoFrame_only() const{return tree.m_vertices.size()==1;};
 	CytoFrameView & get_cytoframe_view_ref(){return frame_;}
@@ -132,6 +150,14 @@ public:
 	 * add prefix (e.g. Comp_ or <>) to channel name of the data
 	 */
 	void compensate(CytoFrame & cytoframe);
+	/**
+	 * compensate the data through the spectral unmixing engine (see SpectralUnmixer)
+	 * which is the alternative path to compensate(cytoframe) for the large spectral panels
+	 * @param cytoframe
+	 * @param param the unmixing method and threads
+	 * @return the throughput metrics (empty when no compensation is applied)
+	 */
+	UNMIX_STATS compensate(CytoFrame & cytoframe, const UNMIX_PARAM & param);
 	trans_local getLocalTrans() const{return trans;}
 
 	/**
@@ -324,6 +350,70 @@ public:
 	void gating(MemCytoFrame & cytoframe, VertexID u,bool recompute=false, bool computeTerminalBool=true, bool skip_faulty_node = false);
 	void gating(MemCytoFrame & cytoframe, VertexID u,bool recompute
 			, bool computeTerminalBool, bool skip_faulty_node, INTINDICES &parentIndice);
+	/**
+	 * gate the entire tree concurrently
+	 *
+	 * The populations are scheduled as the tasks of a dependency graph, where each node depends on its parent
+	 * and (for boolean gates) on its reference nodes, so that the independent nodes (e.g. siblings) are gated in parallel.
+	 * It produces the same populations as gating(cytoframe, 0, ...) given the same arguments, except that
+	 * the reference nodes are never gated recursively from the boolean gates, i.e. a boolean gate only fails
+	 * when its reference nodes fail, which also avoids re-gating the reference subtrees when recompute is true.
+	 * The nodes that fail, and the ones skipped because of them (i.e. their descendants and the boolean gates referring to them),
+	 * are left ungated instead of keeping their outdated indices.
+	 *
+	 * @param cytoframe the compensated and transformed data
+	 * @param num_threads the number of threads
+	 * @param recompute
+	 * @param computeTerminalBool
+	 * @param skip_faulty_node
+	 */
+	void parallel_gating(MemCytoFrame & cytoframe, int num_threads, bool recompute=false, bool computeTerminalBool=true, bool skip_faulty_node = false);
+	/**
+	 * flag the node to be re-gated by regate_dirty, e.g. after its gate is modified in place.
+	 * Flagging the root invalidates the entire tree (e.g. the data is compensated or transformed differently).
+	 *
+	 * The nodes are also flagged by setGate, moveNode, set_compensation, addTransMap and the gate adjustments (extendGate, adjustGate, transform_gate, shift_gate),
+	 * and unflagged once they are gated.
+	 */
+	void mark_dirty(VertexID u){
+		getNodeProperty(u).setDirtyFlag(true);
+	}
+	/**
+	 * discard the outdated gating result of the node that fails (or is skipped) to be re-gated, which also flags it as dirty
+	 * The indices of the logical/cluster gates are kept since they are the gate definition rather than the gating result.
+	 */
+	void invalidate_node(VertexID u);
+	/**
+	 * the nodes to be re-gated by regate_dirty (in the order they are gated)
+	 *
+	 * They are the dirty nodes, their descendants and the boolean gates that reference any of those
+	 * (as well as the descendants of the boolean gates and so on).
+	 */
+	VertexID_vec get_dirty_nodes();
+	/**
+	 * re-gate the dirty nodes and the nodes depending on them (see get_dirty_nodes), leaving the rest of the tree as it is
+	 *
+	 * Each node is gated once after its parent and its reference nodes, so there is no recursive re-gating from the boolean gates.
+	 *
+	 * @param cytoframe the compensated and transformed data
+	 * @param computeTerminalBool
+	 * @param skip_faulty_node when true, the faulty nodes are skipped along with their descendants and the boolean gates referring to them,
+	 * 							which are all left ungated (see invalidate_node) rather than keeping their outdated indices
+	 * @return the nodes that are re-gated
+	 */
+	VertexID_vec regate_dirty(MemCytoFrame & cytoframe, bool computeTerminalBool=true, bool skip_faulty_node = false);
+	/**
+	 * gate the events appended to the data (see CytoFrame::append_events) since the tree was gated,
+	 * i.e. the rows from the total of the root node on, and add them to the gated nodes
+	 *
+	 * Only the new events are evaluated by the gates (the boolean gates are recomputed from the updated reference nodes).
+	 * The logical and cluster gates carry no membership for the new events, so they are not added to these nodes.
+	 *
+	 * @param cytoframe the compensated and transformed data, which must extend the data that the tree was gated on
+	 * @param computeTerminalBool
+	 * @param skip_faulty_node when true, the faulty nodes and their descendants are skipped
+	 */
+	void gating_appended_events(MemCytoFrame & cytoframe, bool computeTerminalBool=true, bool skip_faulty_node = false);
 	/*
 	 * bool gating operates on the indices of reference nodes
 	 * because they are global, thus needs to be combined with parent indices
@@ -333,6 +423,7 @@ public:
 	 */
 
 	vector<bool> boolGating(MemCytoFrame & cytoframe, VertexID u, bool computeTerminalBool);
+	EventBitmap boolGatingBitmap(MemCytoFrame & cytoframe, VertexID u, bool computeTerminalBool);
 	/*
 	 * external boolOpSpec can be provided .
 	 * It is mainly used by openCyto rectRef gate
@@ -343,6 +434,7 @@ public:
 	 * @return
 	 */
 	vector<bool> boolGating(MemCytoFrame & cytoframe, vector<BOOL_GATE_OP> boolOpSpec, bool computeTerminalBool);
+	EventBitmap boolGatingBitmap(MemCytoFrame & cytoframe, const vector<BOOL_GATE_OP> & boolOpSpec, bool computeTerminalBool);
 
 	/*
 	 * current output the graph in dot format
@@ -542,6 +634,7 @@ public:
 	 */
 	void addTransMap(trans_map tm){
 		trans.setTransMap(tm);
+		mark_dirty(0);
 
 	}
 };
@@ -14,6 +14,8 @@
 #include "GatingHierarchy.hpp"
 #include <cytolib/CytoFrameView.hpp>
 #include <string>
+#include <mutex>
+#include <condition_variable>
 #include <cytolib/delimitedMessage.hpp>
 #include <cytolib/global.hpp>
 
@@ -27,6 +29,70 @@ namespace cytolib
 #define PB true
 #define BS false
 
+/**
+ * \class GatingHierarchyLoader
+ * \brief loads the GatingHierarchy objects from the archive on their first access (i.e. the lazy mode of the GatingSet archive constructor)
+ *
+ * It is shared by the copies of the GatingSet so that each sample is only loaded once.
+ */
+class GatingHierarchyLoader{
+	string path_;
+	string cf_ext_;
+	CytoCtx ctx_;
+	bool is_skip_data_;
+	bool readonly_;
+	mutex mutex_;//serializes the loading and guards the entries to be materialized
+	unordered_map<string, weak_ptr<GatingHierarchy>> loaded_;
+public:
+	GatingHierarchyLoader(const string & path, const string & cf_ext, const CytoCtx & ctx, bool is_skip_data, bool readonly):path_(path), cf_ext_(cf_ext), ctx_(ctx), is_skip_data_(is_skip_data), readonly_(readonly){};
+	/**
+	 * parse the pb of the sample and load its cytoframe
+	 */
+	GatingHierarchyPtr load(const string & sample_uid) const;
+	/**
+	 * load the sample into gh unless it is already loaded
+	 * @param gh the entry of the GatingSet, which is only accessed under the lock
+	 * @return the loaded gh
+	 */
+	GatingHierarchyPtr materialize(GatingHierarchyPtr & gh, const string & sample_uid);
+};
+typedef shared_ptr<GatingHierarchyLoader> GatingHierarchyLoaderPtr;
+
+/**
+ * \class MemoryBudget
+ * \brief the bytes of event data that are allowed to be realized in memory at once (see GatingSet::gate_all)
+ *
+ * acquire() blocks until the request fits into the remaining budget,
+ * but always admits the request when nothing is resident so that it can't dead-lock on an oversized sample.
+ * The peak usage is recorded for reporting.
+ */
+class MemoryBudget{
+	size_t budget_, in_use_, count_, peak_bytes_, peak_count_;
+	mutable mutex mtx_;
+	condition_variable cv_;
+public:
+	/**
+	 * @param budget the maximum bytes, 0 means unlimited
+	 */
+	MemoryBudget(size_t budget):budget_(budget), in_use_(0), count_(0), peak_bytes_(0), peak_count_(0){};
+	void acquire(size_t nBytes);
+	void release(size_t nBytes);
+	/**
+	 * the max bytes held at once
+	 */
+	size_t get_peak_bytes() const{
+		lock_guard<mutex> guard(mtx_);
+		return peak_bytes_;
+	}
+	/**
+	 * the max number of the requests (e.g. samples) admitted at once
+	 */
+	size_t get_peak_count() const{
+		lock_guard<mutex> guard(mtx_);
+		return peak_count_;
+	}
+};
+
 /**
  * \class GatingSet
  * \brief A container class that stores multiple GatingHierarchy objects.
@@ -35,30 +101,70 @@ namespace cytolib
  */
 class GatingSet{
 	typedef unordered_map<string, GatingHierarchyPtr> ghMap;
-	ghMap ghs_;
+	mutable ghMap ghs_;//the entries are NULL until they are loaded when the archive is opened lazily
 	vector<string> sample_names_;
+	GatingHierarchyLoaderPtr loader_;//only set when the archive is opened lazily
 	GatingHierarchyPtr get_first_gh() const;
 	string uid_;
 	CytoCtx ctx_;
 
 public:
-	typedef typename ghMap::iterator iterator;
-	typedef typename ghMap::const_iterator const_iterator;
+	/**
+	 * the iterator over the samples, which loads the sample (when the archive is opened lazily) once it is dereferenced
+	 * so that iterating the GatingSet doesn't load the samples that are not accessed
+	 */
+	template<bool IS_CONST>
+	class lazy_iterator{
+		typedef typename ghMap::iterator base_iterator;
+		base_iterator it_;
+		GatingHierarchyLoader * loader_;
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef typename conditional<IS_CONST, const ghMap::value_type, ghMap::value_type>::type value_type;
+		typedef ptrdiff_t difference_type;
+		typedef value_type * pointer;
+		typedef value_type & reference;
+		lazy_iterator():loader_(NULL){};
+		lazy_iterator(base_iterator it, GatingHierarchyLoader * loader):it_(it), loader_(loader){};
+		//iterator converts to const_iterator
+		lazy_iterator(const lazy_iterator<false> & other):it_(other.base()), loader_(other.get_loader()){};
+		reference operator*() const{
+			if(loader_)
+				loader_->materialize(it_->second, it_->first);
+			return *it_;
+		}
+		pointer operator->() const{return &(**this);}
+		lazy_iterator & operator++(){++it_;return *this;}
+		lazy_iterator operator++(int){lazy_iterator res = *this;++it_;return res;}
+		bool operator==(const lazy_iterator & other) const{return it_ == other.it_;}
+		bool operator!=(const lazy_iterator & other) const{return it_ != other.it_;}
+		base_iterator base() const{return it_;}
+		GatingHierarchyLoader * get_loader() const{return loader_;}
+	};
+	typedef lazy_iterator<false> iterator;
+	typedef lazy_iterator<true> const_iterator;
 
 	/*
 	 * forwarding APIs
 	 */
 	 size_t size() const{return ghs_.size();}
-	 iterator end(){return ghs_.end();}
-	 iterator begin(){return ghs_.begin();}
-	 const_iterator end() const{return ghs_.end();}
-	 const_iterator begin() const{return ghs_.begin();}
-	 iterator find(const string &sample_uid){
-			 return ghs_.find(sample_uid);
+	 iterator end(){return iterator(ghs_.end(), loader_.get());}
+	 iterator begin(){return iterator(ghs_.begin(), loader_.get());}
+	 const_iterator end() const{return const_iterator(ghs_.end(), loader_.get());}
+	 const_iterator begin() const{return const_iterator(ghs_.begin(), loader_.get());}
+	 iterator find(const string &sample_uid){return iterator(ghs_.find(sample_uid), loader_.get());}
+	 const_iterator find(const string &sample_uid) const{return const_iterator(ghs_.find(sample_uid), loader_.get());}
+	 /**
+	  * whether the sample is already loaded (always true unless the archive is opened lazily)
+	  */
+	 bool is_loaded(const string &sample_uid) const{
+		 auto it = ghs_.find(sample_uid);
+		 return it != ghs_.end() && it->second != NULL;
 	 }
-	 const_iterator find(const string &sample_uid) const{
-					 return ghs_.find(sample_uid);
-			 }
+	/**
+	 * load all the samples that are not loaded yet (when the archive is opened lazily)
+	 */
+	void load_all() const;
 	 size_t erase ( const string& k ){return ghs_.erase(k);}
 
 	string get_uid(){return uid_;}
@@ -73,10 +179,12 @@ public:
 	 * separate filename from dir to avoid to deal with path parsing in c++
 	 * @param path the dir of filename
 	 * @param is_skip_data whether to skip writing cytoframe data to pb. It is typically remain as default unless for debug purpose (e.g. re-writing gs that is loaded from legacy pb archive without actual data associated)
+	 * @param num_threads the number of samples written concurrently (the archive is the same regardless)
 	 */
 	void serialize_pb(string path, CytoFileOption h5_opt
 			, bool is_skip_data = false
-			, const CytoCtx & ctx = CytoCtx());
+			, const CytoCtx & ctx = CytoCtx()
+			, int num_threads = 1);
 	/**
 	 * constructor from the archives (de-serialization)
 	 * @param path
@@ -84,12 +192,19 @@ public:
 	 * @param select_sample_idx samples to load
 	 * @param remote_path when this is supplied, path is the temp local folder that holds pb file
 	 * 						and h5 files stay at remote_path and will be loaded through H5RCytoFrame class
+	 * @param lazy when true, only the gs index is parsed here, and each GatingHierarchy (along with its cytoframe)
+	 * 				is loaded on its first access (getGatingHierarchy, find or iterating the GatingSet)
+	 * 				which is safe to be called from multiple threads.
+	 * 				The channel consistency among the samples is not checked since the archive was checked when it was saved.
+	 * @param num_threads the number of samples loaded concurrently (when not lazy)
 	 */
 	GatingSet(string path, bool is_skip_data = false
 				, bool readonly = true
 				, vector<string> select_samples = {}
 				, bool print_lib_ver = false
-				, CytoCtx ctxptr= CytoCtx());
+				, CytoCtx ctxptr= CytoCtx()
+				, bool lazy = false
+				, int num_threads = 1);
 	/**
 	 * legacy de-serialization for single pb file
 	 * @param path
@@ -258,6 +373,32 @@ public:
 	 */
 	GatingSet get_cytoset(string node_path);
 
+	/**
+	 * Gate all the samples in parallel.
+	 *
+	 * Each sample is loaded, (optionally) compensated and transformed, and gated independently,
+	 * so the samples are dispatched dynamically across the threads.
+	 * A failure of one sample does not abort the batch: it is recorded and the rest of samples continue.
+	 *
+	 * @param num_threads the number of samples processed concurrently
+	 * @param memory_budget the maximum bytes of the event data realized in memory at once (0 means unlimited).
+	 * 			A sample is admitted only when it fits into the remaining budget, except that one sample is always admitted
+	 * 			when none is resident, so that the sample larger than the budget is still gated (alone).
+	 * @param preprocess whether to compensate and transform the data before gating (the processed data is saved back to the cytoframe)
+	 * @param recompute
+	 * @param computeTerminalBool
+	 * @param skip_faulty_node see GatingHierarchy::gating. When false, a faulty node fails the entire sample.
+	 * @return the error messages of the failed samples keyed by sample uid, which is empty when all samples succeed
+	 */
+	map<string, string> gate_all(int num_threads = 1, size_t memory_budget = 0, bool preprocess = false
+			, bool recompute = true, bool computeTerminalBool = true, bool skip_faulty_node = false);
+	/**
+	 * gate_all within the given budget, which is charged by each sample for the memory of realizing its events,
+	 * i.e. twice the events of the underlying frame when the view is subsetted or the frame is in memory (both copies are held at once)
+	 */
+	map<string, string> gate_all(int num_threads, MemoryBudget & budget, bool preprocess = false
+			, bool recompute = true, bool computeTerminalBool = true, bool skip_faulty_node = false);
+
 	string generate_cytoframe_folder(string cf_dir) const
 	{
 		cf_dir = (fs::path(cf_dir) / uid_).string();
@@ -317,6 +458,7 @@ public:
 	 * @param _new
 	 */
 	void set_channel(const string & _old, const string & _new){
+		load_all();
 		for(auto & p : ghs_)
 			p.second->set_channel(_old, _new);
 	};
@@ -331,6 +473,7 @@ public:
 	vector<string> get_markers(){return get_first_gh()->get_markers();};
 
 	void set_marker(const string & _channel, const string & _marker){
+		load_all();
 		for(auto & p : ghs_)
 			p.second->set_marker(_channel, _marker);
 	};
@@ -410,27 +553,53 @@ public:
 		fs::path cf_path;
 		if(fmt!= FileFormat::MEM)
 			cf_path = generate_cytoframe_folder(cf_dir);
-		for(const auto & it : sample_uid_vs_file_path)
+		/*
+		 * files are parsed concurrently by a bounded pool of config.num_threads workers
+		 * (h5 IO is serialized through h5_mutex since hdf5 lib is not thread-safe)
+		 * and then attached in input order so that the sample order is deterministic
+		 */
+		int nSample = sample_uid_vs_file_path.size();
+		vector<CytoFramePtr> frames(nSample);
+		vector<exception_ptr> errors(nSample);
+		#pragma omp parallel for schedule(dynamic) num_threads(max(1, config.num_threads))
+		for(int i = 0; i < nSample; i++)
 		{
+			const auto & it = sample_uid_vs_file_path[i];
+			try
+			{
+				string cf_filename = (cf_path/it.first).string();
+				CytoFramePtr fr_ptr;
+				if(fmt == FileFormat::H5)
+				{
+					//decode the events to h5 chunk by chunk instead of loading the entire file into memory
+					cf_filename += "." + fmt_to_str(fmt);
+					MemCytoFrame fr(it.second,config);
+					fr.set_pheno_data("name", path_base_name(it.second));
+					fr.stream_fcs_to_h5(cf_filename);
+					lock_guard<recursive_mutex> guard(h5_mutex());
+					fr_ptr = load_cytoframe(cf_filename, readonly, ctx);
+				}
+				else
+				{
+					fr_ptr.reset(new MemCytoFrame(it.second,config));
+					//set pdata
+					fr_ptr->set_pheno_data("name", path_base_name(it.second));
 
-
-			CytoFramePtr fr_ptr(new MemCytoFrame(it.second,config));
-			//set pdata
-			fr_ptr->set_pheno_data("name", path_base_name(it.second));
-
-			dynamic_cast<MemCytoFrame&>(*fr_ptr).read_fcs();
-
-			string cf_filename = (cf_path/it.first).string();
-			if(fmt != FileFormat::MEM)
+					dynamic_cast<MemCytoFrame&>(*fr_ptr).read_fcs();
+				}
+				frames[i] = fr_ptr;
+			}
+			catch(...)
 			{
-				cf_filename += "." + fmt_to_str(fmt);
-				fr_ptr->write_to_disk(cf_filename, fmt, ctx);
-				fr_ptr = load_cytoframe(cf_filename, readonly, ctx);
+				errors[i] = current_exception();
 			}
-
-			add_cytoframe_view(it.first, CytoFrameView(fr_ptr));
-
 		}
+		for(int i = 0; i < nSample; i++)
+			if(errors[i])
+				rethrow_exception(errors[i]);
+
+		for(int i = 0; i < nSample; i++)
+			add_cytoframe_view(sample_uid_vs_file_path[i].first, CytoFrameView(frames[i]));
 	}
 
 	/**
@@ -10,6 +10,7 @@
 #ifndef INST_INCLUDE_CYTOLIB_H5CYTOFRAME_HPP_
 #define INST_INCLUDE_CYTOLIB_H5CYTOFRAME_HPP_
 #include <cytolib/MemCytoFrame.hpp>
+#include <cytolib/H5FileCache.hpp>
 #include <cytolib/global.hpp>
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
@@ -32,13 +33,32 @@ protected:
 	bool is_dirty_keys;
 	bool is_dirty_pdata;
 	FileAccPropList access_plist_;//used to custom fapl, especially for s3 backend
-	EVENT_DATA_VEC read_data(uvec col_idx) const;
-	int h5_flags() const{
-		if(get_readonly())
-			return H5F_ACC_RDONLY;
-		else
-			return H5F_ACC_RDWR;
-	};
+	H5_LAYOUT_PARAM layout_;//storage layout of the event data loaded from h5
+	/**
+	 * read the events of the selected columns (and rows) from h5 with a single read
+	 * @param col_idx
+	 * @param row_idx only used when is_row_indexed is true, otherwise all rows are read
+	 */
+	EVENT_DATA_VEC read_data(uvec col_idx, const uvec & row_idx = uvec(), bool is_row_indexed = false) const;
+	/**
+	 * write the selected columns (and rows) along with the meta data to a new h5 file
+	 * The events are streamed from this h5 by the bounded chunks of rows without loading the entire matrix
+	 * @param row_idx only used when is_row_indexed is true, otherwise all rows are copied
+	 */
+	void write_h5_subset(const string & h5_filename, const uvec & row_idx, bool is_row_indexed, const uvec & col_idx) const;
+	/**
+	 * open the h5 for read through the process-wide file cache
+	 */
+	H5FileHandle open_h5() const{
+		return H5FileCache::instance().open(filename_, H5F_ACC_RDONLY, access_plist_);
+	}
+	/**
+	 * open the h5 for write through the process-wide file cache, which replaces the cached read-only handle of the file
+	 */
+	H5FileHandle open_h5_rw() const{
+		check_write_permission();
+		return H5FileCache::instance().open(filename_, H5F_ACC_RDWR, access_plist_);
+	}
 public:
 	void flush_meta();
 	void flush_params();
@@ -62,6 +82,7 @@ public:
 		is_dirty_pdata = frm.is_dirty_pdata;
 		readonly_ = frm.readonly_;
 		access_plist_ = frm.access_plist_;
+		layout_ = frm.layout_;
 		memcpy(dims, frm.dims, sizeof(dims));
 
 	}
@@ -75,6 +96,7 @@ public:
 		swap(filename_, frm.filename_);
 		swap(dims, frm.dims);
 		swap(access_plist_, frm.access_plist_);
+		swap(layout_, frm.layout_);
 
 		swap(readonly_, frm.readonly_);
 		swap(is_dirty_params, frm.is_dirty_params);
@@ -90,6 +112,7 @@ public:
 		is_dirty_pdata = frm.is_dirty_pdata;
 		readonly_ = frm.readonly_;
 		access_plist_ = frm.access_plist_;
+		layout_ = frm.layout_;
 		memcpy(dims, frm.dims, sizeof(dims));
 		return *this;
 	}
@@ -103,6 +126,7 @@ public:
 		swap(is_dirty_pdata, frm.is_dirty_pdata);
 		swap(readonly_, frm.readonly_);
 		swap(access_plist_, frm.access_plist_);
+		swap(layout_, frm.layout_);
 		return *this;
 	}
 
@@ -149,49 +173,55 @@ public:
 		return res;
 	}
 
-	void append_data_columns(const EVENT_DATA_VEC & new_cols)
-	{
-		EVENT_DATA_VEC this_data = get_data();
-		this_data.insert_cols(this_data.n_cols, new_cols);
-		set_data(this_data);
-	}
+	/**
+	 * extend the data set by the new columns and only write them
+	 */
+	void append_data_columns(const EVENT_DATA_VEC & new_cols);
+	/**
+	 * extend the data set by the new rows and only write them
+	 */
+	void append_data_rows(const EVENT_DATA_VEC & new_events);
 	vector<string> get_rownames() const
 	{
 		vector<string> rownames;
-		H5File file(filename_, h5_flags(), FileCreatPropList::DEFAULT, access_plist_);
-		auto dsname = DATASET_ROWNAME;
-		if(file.exists(dsname))
+		// HDF5 only understands vector of char* :-(
+		std::vector<char*> rn_c_str;
+		auto h5 = open_h5();
 		{
-			auto dataset = file.openDataSet(dsname);
-			auto dataspace = dataset.getSpace();
-
-			unsigned nrow = n_rows();
-
-			hsize_t dimsm[] = {nrow};
-			DataSpace memspace(1,dimsm);
-			StrType str_type(H5::PredType::C_S1, H5T_VARIABLE);
-
-			// HDF5 only understands vector of char* :-(
-			std::vector<char*> rn_c_str(nrow);
-			dataset.read(rn_c_str.data(), str_type ,memspace, dataspace);
+			lock_guard<recursive_mutex> guard(h5_mutex());
+			H5File & file = h5.file();
+			auto dsname = DATASET_ROWNAME;
+			if(file.exists(dsname))
+			{
+				auto dataset = file.openDataSet(dsname);
+				auto dataspace = dataset.getSpace();
 
-			for (unsigned ii = 0; ii < rn_c_str.size(); ++ii)
-				rownames.push_back(string(rn_c_str[ii]));
+				unsigned nrow = n_rows();
 
+				hsize_t dimsm[] = {nrow};
+				DataSpace memspace(1,dimsm);
+				StrType str_type(H5::PredType::C_S1, H5T_VARIABLE);
 
+				rn_c_str.resize(nrow);
+				dataset.read(rn_c_str.data(), str_type ,memspace, dataspace);
+			}
 		}
+		for (unsigned ii = 0; ii < rn_c_str.size(); ++ii)
+			rownames.push_back(string(rn_c_str[ii]));
 		return rownames;
 	}
 	void set_rownames(const vector<string> & rn)
 	{
 
-		H5File file(filename_, h5_flags(), FileCreatPropList::DEFAULT, access_plist_);
-		check_write_permission();
+		auto h5 = open_h5_rw();
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		H5File & file = h5.file();
 		write_h5_rownames(file, rn);
 	}
 	void del_rownames(){
-		H5File file(filename_, h5_flags(), FileCreatPropList::DEFAULT, access_plist_);
-		check_write_permission();
+		auto h5 = open_h5_rw();
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		H5File & file = h5.file();
 
 		if(file.exists(DATASET_ROWNAME))
 			file.unlink(DATASET_ROWNAME);
@@ -230,8 +260,7 @@ public:
 			, bool readonly = false):filename_(h5_filename), is_dirty_params(false), is_dirty_keys(false), is_dirty_pdata(false)
 	{
 		MemCytoFrame fr(fcs_filename, config);
-		fr.read_fcs();
-		fr.write_h5(h5_filename);
+		fr.stream_fcs_to_h5(h5_filename);
 		*this = H5CytoFrame(h5_filename, readonly);
 	}
 	/**
@@ -245,18 +274,21 @@ public:
 			init_load();
 	}
 	void init_load(){
-		//always use the same flag and keep lock at cf level to avoid h5 open error caused conflicting h5 flags among cf objects that points to the same h5
-		H5File file(filename_, h5_flags(), FileCreatPropList::DEFAULT, access_plist_);
+		auto h5 = open_h5();
 		load_meta();
 
 
 		//open dataset for event data
-
-		auto dataset = file.openDataSet(DATASET_NAME);
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		auto & dataset = h5.dataset();
 		auto dataspace = dataset.getSpace();
 		dataspace.getSimpleExtentDims(dims);
+		layout_.load(dataset);
 
 	}
+	const H5_LAYOUT_PARAM & get_layout() const{
+		return layout_;
+	}
 	/**
 	 * abandon the changes to the meta data in cache by reloading them from disk
 	 */
@@ -290,6 +322,8 @@ public:
 					{
 					case CytoFileOption::copy:
 						{
+							H5FileCache::instance().release(filename_);
+							H5FileCache::instance().release(h5_filename);
 							if(fs::exists(h5path))
 								fs::remove(h5path);
 							fs::copy(filename_, h5_filename);
@@ -297,6 +331,8 @@ public:
 						}
 					case CytoFileOption::move:
 						{
+							H5FileCache::instance().release(filename_);
+							H5FileCache::instance().release(h5_filename);
 							if(fs::exists(h5path))
 								fs::remove(h5path);
 							fs::rename(filename_, h5_filename);
@@ -310,6 +346,7 @@ public:
 						}
 					case CytoFileOption::symlink:
 						{
+							H5FileCache::instance().release(h5_filename);
 							if(fs::exists(h5path))
 								fs::remove(h5path);
 							fs::create_symlink(filename_, h5_filename);
@@ -346,11 +383,17 @@ public:
 		if(is_col)
 			return read_data(idx);
 		else
-			return get_data().rows(idx);
+		{
+			unsigned n = n_cols();
+			uvec col_idx(n);
+			for(unsigned i = 0; i < n; i++)
+				col_idx[i] = i;
+			return read_data(col_idx, idx, true);
+		}
 	}
 	EVENT_DATA_VEC get_data(uvec row_idx, uvec col_idx) const
 	{
-		return read_data(col_idx).rows(row_idx);
+		return read_data(col_idx, row_idx, true);
 	}
 	/*
 	 * protect the h5 from being overwritten accidentally
@@ -377,6 +420,9 @@ public:
 			new_filename = generate_unique_filename(fs::temp_directory_path().string(), "", ".h5");
 			fs::remove(new_filename);
 		}
+		//close the cached handles so that everything is flushed to disk before copying
+		H5FileCache::instance().release(filename_);
+		H5FileCache::instance().release(new_filename);
 		fs::copy_file(filename_, new_filename);
 		CytoFramePtr ptr(new H5CytoFrame(new_filename, false));
 		//copy cached meta
@@ -395,8 +441,7 @@ public:
 			new_filename = generate_unique_filename(fs::temp_directory_path().string(), "", ".h5");
 			fs::remove(new_filename);
 		}
-		MemCytoFrame fr(*this);
-		fr.copy(row_idx, col_idx)->write_h5(new_filename);//this flushes the meta data as well
+		write_h5_subset(new_filename, row_idx, true, col_idx);
 		return CytoFramePtr(new H5CytoFrame(new_filename, false));
 	}
 
@@ -410,8 +455,16 @@ public:
 			new_filename = generate_unique_filename(fs::temp_directory_path().string(), "", ".h5");
 			fs::remove(new_filename);
 		}
-		MemCytoFrame fr(*this);
-		fr.copy(idx, is_row_indexed)->write_h5(new_filename);//this flushes the meta data as well
+		if(is_row_indexed)
+		{
+			unsigned n = n_cols();
+			uvec col_idx(n);
+			for(unsigned i = 0; i < n; i++)
+				col_idx[i] = i;
+			write_h5_subset(new_filename, idx, true, col_idx);
+		}
+		else
+			write_h5_subset(new_filename, uvec(), false, idx);
 		return CytoFramePtr(new H5CytoFrame(new_filename, false));
 	}
 
@@ -426,6 +479,13 @@ public:
 		check_write_permission();
 		set_data(_data);
 	}
+	/**
+	 * compensate the events in h5 by the blocks of rows (see g_h5_copy_max_elements),
+	 * which only reads the marker and detector columns and writes back the marker columns
+	 * instead of loading the entire matrix
+	 * @param comp
+	 */
+	void compensate(const compensation & comp);
 
 //	vector<string> get_rownames() const
 //	{
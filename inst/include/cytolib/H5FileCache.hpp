@@ -0,0 +1,141 @@
+/*Copyright 2019 Fred Hutchinson Cancer Research Center
+ * See the included LICENSE file for details on the license that is granted to the
+ * user of this software.
+ * H5FileCache.hpp
+ *
+ *  Created on: Oct 18, 2026
+ */
+
+#ifndef INST_INCLUDE_CYTOLIB_H5FILECACHE_HPP_
+#define INST_INCLUDE_CYTOLIB_H5FILECACHE_HPP_
+#include <cytolib/global.hpp>
+#include <list>
+#include <unordered_map>
+#include <thread>
+#include <condition_variable>
+#include <H5Cpp.h>
+using namespace H5;
+
+namespace cytolib
+{
+/**
+ * the identity of the file on disk, which tells whether a cached handle still points to the current file
+ */
+struct H5_FILE_STAT{
+	bool is_valid;//false when the path can't be stat'ed (e.g. remote), which is never revalidated
+	unsigned long long dev, ino, size;
+	long long mtime;
+	H5_FILE_STAT():is_valid(false), dev(0), ino(0), size(0), mtime(0){};
+	H5_FILE_STAT(const string & path);
+	bool operator==(const H5_FILE_STAT & other) const;
+};
+/**
+ * an opened h5 file along with its event data set
+ */
+struct H5_FILE_ENTRY{
+	H5File file;//declared before dataset so that it is closed last
+	DataSet dataset;
+	string key;
+	string path;
+	unsigned flags;
+	bool is_dataset_open;
+	FileAccPropList fapl;//a copy of the fapl it is opened with
+	H5_FILE_STAT stat;//the file at the time it is opened (or last written through this entry)
+	vector<std::thread::id> holders;//the threads of the handles in use
+	H5_FILE_ENTRY(const string & _key, const string & _path, unsigned _flags, const FileAccPropList & _fapl);
+};
+typedef shared_ptr<H5_FILE_ENTRY> H5FileEntryPtr;
+
+/**
+ * the access to a (cached) h5 file
+ * It doesn't lock h5_mutex() by itself (except for opening and closing), the h5 calls made through it must be made while holding h5_mutex()
+ * so that the threads only serialize on the actual h5 IO rather than for the lifetime of the handle
+ */
+class H5FileHandle{
+	H5FileEntryPtr entry_;
+public:
+	H5FileHandle(H5FileEntryPtr entry);
+	H5FileHandle(H5FileHandle && other) = default;
+	H5FileHandle(const H5FileHandle &) = delete;
+	H5FileHandle & operator=(const H5FileHandle &) = delete;
+	~H5FileHandle();
+	H5File & file(){
+		return entry_->file;
+	}
+	/**
+	 * the event data set, which is opened on the first access and then kept along with the file
+	 */
+	DataSet & dataset();
+};
+
+/**
+ * Process-wide LRU cache of the opened h5 files.
+ *
+ * Opening the file (and the event data set) dominates the small reads, e.g. per-column reads iterated across many samples,
+ * so the handles are kept open (up to the capacity) and shared by all the H5CytoFrame objects pointing to the same file.
+ *
+ * A file is only ever open in one mode: a read-only request reuses the read-write handle of the file,
+ * while a read-write request closes the read-only handle (waiting for the other threads to finish with it) and reopens the file for write,
+ * which is then kept in the cache in place of the read-only one. The read-write handle is flushed every time it is released.
+ *
+ * Note that an open handle holds the h5 file lock (hdf5 >= 1.10), i.e. the cached handles prevent other processes from opening the files for write
+ * (and the cached read-write handles from opening them at all). Release them (see release, clear or set_capacity(0)) before handing the files over,
+ * or set the environment variable HDF5_USE_FILE_LOCKING=FALSE at the cost of the cross-process protection.
+ *
+ * The entries are keyed by the canonical path so that the different spellings of the same file share the same handle,
+ * and a cached handle is only reused when the fapl is the same and the file on disk has not been replaced or modified since it was opened.
+ *
+ * The files that are about to be overwritten, moved or deleted must still be released from the cache first
+ * since an open handle keeps the file alive.
+ */
+class H5FileCache{
+	size_t capacity_;
+	size_t open_count_;
+	typedef list<pair<string, H5FileEntryPtr>> LRU_LIST;
+	LRU_LIST lru_;//most recently used first
+	unordered_map<string, LRU_LIST::iterator> entries_;
+	unordered_map<string, weak_ptr<H5_FILE_ENTRY>> live_;//all the opened files including the ones no longer cached but still in use
+	std::condition_variable_any released_;
+	H5FileCache():capacity_(64), open_count_(0){};
+	void evict(const string & key);
+	void touch(H5FileEntryPtr entry);
+	friend class H5FileHandle;
+	void on_release(H5FileEntryPtr & entry);
+public:
+	static H5FileCache & instance();
+	/**
+	 * the key of the file in the cache, i.e. the canonical path (or the path as is when it doesn't resolve)
+	 */
+	static string get_key(const string & path);
+	/**
+	 * open the h5 file (or reuse the handle that is already open)
+	 * Opening the file in the other mode waits for the other threads to release its current handle,
+	 * so it must not be called while holding h5_mutex(), and throws when the current thread still holds it
+	 * @param path
+	 * @param flags H5F_ACC_RDONLY or H5F_ACC_RDWR
+	 * @param fapl
+	 */
+	H5FileHandle open(const string & path, unsigned flags, const FileAccPropList & fapl = FileAccPropList::DEFAULT);
+	/**
+	 * close the cached handle of the file (the file is actually closed once the last handle in use is gone)
+	 */
+	void release(const string & path);
+	/**
+	 * close the cached handles of all the files under the directory
+	 */
+	void release_dir(const string & path);
+	void clear();
+	/**
+	 * set the maximum number of files kept open, 0 disables the cache
+	 */
+	void set_capacity(size_t n);
+	size_t get_capacity() const;
+	size_t size() const;
+	/**
+	 * the number of times the files are actually opened by the cache
+	 */
+	size_t get_open_count() const;
+};
+};
+
+#endif /* INST_INCLUDE_CYTOLIB_H5FILECACHE_HPP_ */
@@ -21,6 +21,11 @@ namespace cytolib
 struct FCS_READ_PARAM{
 	FCS_READ_HEADER_PARAM header;
 	FCS_READ_DATA_PARAM data;
+	int num_threads;//number of FCS files ingested concurrently by GatingSet::add_fcs
+	H5_LAYOUT_PARAM h5_layout;//storage layout of the event data when FCS is ingested into h5
+	FCS_READ_PARAM(){
+		num_threads = 1;
+	};
 };
 
 /**
@@ -39,6 +44,9 @@ class MemCytoFrame: public CytoFrame{
 	void string_to_keywords(string txt, bool emptyValue);
 	void parse_fcs_text_section(ifstream &in, bool emptyValue);
 	void open_fcs_file();
+	FCS_DATA_PLAN plan_fcs_data(const FCS_READ_DATA_PARAM & config);
+	void check_fcs_event_count(const FCS_DATA_PLAN & plan, uint64_t nBytesRead);
+	void finish_fcs_data(const FCS_DATA_PLAN & plan, const FCS_READ_DATA_PARAM & config, const vector<EVENT_DATA_TYPE> & realMin);
 
 public:
 //	void close_h5(){};
@@ -87,6 +95,18 @@ public:
 	 */
 	void read_fcs_data(ifstream &in, const FCS_READ_DATA_PARAM & config);
 	void read_fcs_header();
+	/**
+	 * Convert the FCS file to h5 without holding all the events in memory.
+	 *
+	 * The header and text segment are parsed as read_fcs does, then the data segment is decoded
+	 * in chunks of config.data.stream_chunk_size events, which are appended to the data set of the h5 file
+	 * that is later loaded by H5CytoFrame. The events are not kept in this object afterwards.
+	 * The events are decoded in memory instead when the lines are subsetted (which_lines)
+	 * or the layout compresses the entire column as a single chunk.
+	 *
+	 * @param h5_filename the path of the output H5 file
+	 */
+	void stream_fcs_to_h5(const string & h5_filename);
 	/**
 	 * parse the FCS header and Text segment
 	 *
@@ -207,6 +227,12 @@ public:
 	}
 
 	void append_data_columns(const EVENT_DATA_VEC & new_cols);
+	void append_data_rows(const EVENT_DATA_VEC & new_events);
+	/**
+	 * compensate the data in place
+	 * @param comp
+	 */
+	void compensate(const compensation & comp);
 
 	void transform_data(const trans_local & trans);
 };
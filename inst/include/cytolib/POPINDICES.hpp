@@ -12,12 +12,65 @@
 #define POPINDICES_HPP_
 
 #include "gate.hpp"
+#include <cstdint>
 
 namespace cytolib
 {
 void packToBytes(const vector <bool> & x, vector<unsigned char> & bytes);
 void unpackFromBytes(vector <bool> & x, const vector<unsigned char>& x_bytes);
 
+/**
+ * \class EventBitmap
+ * \brief the word-packed bitmap of the event indices
+ *
+ * The bits are packed into 64-bit words so that the set algebra (and/or/not) is done word by word,
+ * the count is done by popcount and the iteration skips the empty words.
+ * The byte stream (bit i is stored at bit i%8 of byte i/8) is the same as the one produced by packToBytes,
+ * i.e. the format of the BOOL type pb::POPINDICES.
+ */
+class EventBitmap{
+	vector<uint64_t> words_;
+	unsigned nBits_;
+	/**
+	 * reset the unused bits of the last word
+	 */
+	void clear_tail();
+public:
+	EventBitmap():nBits_(0){};
+	EventBitmap(unsigned nBits, bool value = false);
+	EventBitmap(const vector<bool> & x);
+	EventBitmap(const vector<unsigned> & ind, unsigned nBits);
+	unsigned size() const{return nBits_;}
+	bool test(unsigned i) const{
+		return (words_[i >> 6] >> (i & 63)) & 1;
+	}
+	void set(unsigned i){
+		words_[i >> 6] |= uint64_t(1) << (i & 63);
+	}
+	unsigned count() const;
+	EventBitmap & operator&=(const EventBitmap & y);
+	EventBitmap & operator|=(const EventBitmap & y);
+	void flip();
+	/**
+	 * call f(i) for each set bit i in the ascending order
+	 */
+	template<class F> void for_each(F f) const{
+		for(unsigned w = 0; w < words_.size(); w++)
+		{
+			uint64_t word = words_[w];
+			while(word)
+			{
+				f((w << 6) + __builtin_ctzll(word));
+				word &= word - 1;
+			}
+		}
+	}
+	vector<unsigned> to_indices() const;
+	vector<bool> to_bool() const;
+	string to_bytes() const;
+	static EventBitmap from_bytes(const string & bytes, unsigned nBits);
+};
+
 /**
  * \class POPINDICES
  * \brief the event indices for the subpopulation
@@ -37,6 +90,10 @@ public:
 	 */
 	virtual vector<bool> getIndices()=0;
 	virtual vector<unsigned> getIndices_u()=0;
+	/**
+	 * convert the POPINDICES to the bitmap, which is used for the set algebra (e.g. bool gating)
+	 */
+	virtual EventBitmap getBitmap()=0;
 	/**
 	 * compute the event count from the event indices
 	 */
@@ -54,20 +111,26 @@ public:
  */
 class BOOLINDICES:public POPINDICES{
 private:
-	vector <bool> x;
+	EventBitmap x;
 public:
 	BOOLINDICES():POPINDICES(){};
 
 	BOOLINDICES(vector <unsigned> _ind, unsigned _nEvent);
 	BOOLINDICES(vector <bool> _ind);
+	BOOLINDICES(const EventBitmap & _ind):POPINDICES(_ind.size()),x(_ind){};
 	vector<bool> getIndices(){
+		return x.to_bool();
+	}
+	vector<unsigned> getIndices_u(){
+		return x.to_indices();
+	}
+	EventBitmap getBitmap(){
 		return x;
 	}
-	vector<unsigned> getIndices_u();
 
 
 	unsigned getCount(){
-		return count(x.begin(),x.end(),true);
+		return x.count();
 	}
 
 
@@ -92,12 +155,16 @@ public:
 	INTINDICES():POPINDICES(){};
 
 	INTINDICES(vector <bool> _ind);
+	INTINDICES(const EventBitmap & _ind):POPINDICES(_ind.size()),x(_ind.to_indices()){};
 
 	INTINDICES(vector <unsigned> _ind, unsigned _nEvent):POPINDICES(_nEvent),x(_ind){};
 
 	vector<bool> getIndices();
 
 	vector<unsigned> getIndices_u(){return x;};
+	EventBitmap getBitmap(){
+		return EventBitmap(x, nEvents);
+	}
 	unsigned getCount(){
 
 		return x.size();
@@ -132,6 +199,9 @@ public:
 		return res;
 	}
 	vector<unsigned> getIndices_u();
+	EventBitmap getBitmap(){
+		return EventBitmap(nEvents, true);
+	}
 
 
 	unsigned getCount(){
@@ -32,6 +32,8 @@ private:
 	int spline_method;
 	string caltype;//TODO:move this to transformation class
 	bool flag;
+	SPLINE_INDEX spline_idx;//built along with the coefficients, empty when they are stale
+	void build_index();
 public:
 	vector<double> getX();
 	vector<double> getY();
@@ -53,7 +55,7 @@ public:
 	 * API provided for Rcpp to access calibration table
 	 */
 	Spline_Coefs getSplineCoefs();
-	void transforming(double * input, int nSize);
+	void transforming(EVENT_DATA_TYPE * input, int nSize);
 	void convertToPb(pb::calibrationTable & cal_pb);
 
 	calibrationTable(const pb::calibrationTable & cal_pb);
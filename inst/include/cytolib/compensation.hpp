@@ -17,9 +17,24 @@ using namespace arma;
 #include <boost/algorithm/string.hpp>
 #include <queue>
 #include "global.hpp"
+#include "datatype.hpp"
 namespace cytolib
 {
+/**
+ * the factorized inverse of a spillover matrix along with the spillover values it was computed from
+ */
+struct COMP_INVERSE{
+	vector<double> spillOver;
+	unsigned nMarker;
+	mat K;//detector-by-marker
+};
 class compensation{
+	/*
+	 * cached inverse (shared by the copies of this object)
+	 * it is replaced (never modified) through atomic_load/atomic_store so that the concurrent readers are safe
+	 */
+	mutable shared_ptr<const COMP_INVERSE> inverse_;
+	shared_ptr<const COMP_INVERSE> get_inverse_ptr() const;
 public:
 	string cid;
 	string prefix;
@@ -149,6 +164,25 @@ public:
 	 * @return
 	 */
 	mat get_spillover_mat ()const;
+	/**
+	 * The (least squares) inverse of the spillover matrix, i.e. the detector-by-marker matrix K
+	 * that maps the detector values of an event (as row vector) to its compensated marker values.
+	 *
+	 * It is computed by QR factorization on the first call and then cached until spillOver is changed.
+	 * @return
+	 */
+	mat get_inverse() const{return get_inverse_ptr()->K;}
+	/**
+	 * compensate the events in place
+	 *
+	 * Only the marker columns are overwritten. The rows are processed in cache-sized tiles,
+	 * so no copy (or transpose) of the entire event matrix is made.
+	 * @param data the col-major event matrix
+	 * @param marker_idx the column indices of the markers
+	 * @param detector_idx the column indices of the detectors
+	 * @param num_threads
+	 */
+	void apply(arma::Mat<EVENT_DATA_TYPE> & data, const arma::uvec & marker_idx, const arma::uvec & detector_idx, int num_threads = 1) const;
 	void update_channels(const CHANNEL_MAP & chnl_map);
 	void convertToPb(pb::COMP & comp_pb);
 	compensation(const pb::COMP & comp_pb);
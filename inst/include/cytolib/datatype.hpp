@@ -12,8 +12,33 @@
 
 namespace cytolib
 {
-
-
+	/*
+	 * the in-memory type of the event data (and the values derived from it, e.g. gate coordinates and ranges).
+	 * Building with CYTOLIB_FLOAT_EVENTS stores the events as float32, which matches the h5 storage
+	 * and halves the memory and bandwidth, at the cost of the precision of the intermediate computations.
+	 * The library and its consumers must be built with the same setting.
+	 */
+#ifdef CYTOLIB_FLOAT_EVENTS
+	typedef float EVENT_DATA_TYPE;
+#define CYTOLIB_EVENT_DATA_MODE event_data_float32
+#else
 	typedef double EVENT_DATA_TYPE;
+#define CYTOLIB_EVENT_DATA_MODE event_data_float64
+#endif
+	/*
+	 * The mismatched setting (which changes the class layouts) is caught at link time:
+	 * every translation unit references the symbol named after its own setting,
+	 * which is only defined by the library built with the same setting (see global.cpp).
+	 */
+	extern const int CYTOLIB_EVENT_DATA_MODE;
+#if defined(_MSC_VER)
+#ifdef CYTOLIB_FLOAT_EVENTS
+#pragma detect_mismatch("CYTOLIB_FLOAT_EVENTS", "1")
+#else
+#pragma detect_mismatch("CYTOLIB_FLOAT_EVENTS", "0")
+#endif
+#elif defined(__GNUC__)
+	static const int * const event_data_mode_check __attribute__((used)) = &CYTOLIB_EVENT_DATA_MODE;
+#endif
 }
 #endif /* INST_INCLUDE_CYTOLIB_DATATYPE_HPP_ */
@@ -349,82 +349,10 @@ class rectGate:public polygonGate {
 	bool is_quad;
 	QUAD quadrant;//it is only valid when is_quad is true
 public:
-	INDICE_TYPE gating(MemCytoFrame & fdata, INDICE_TYPE & parentInd)
-	{
-			vector<coordinate> vertices=param.getVertices();
-			unsigned nVertex=vertices.size();
-			if(nVertex!=2)
-				throw(domain_error("invalid number of vertices for rectgate!"));
-			string x=param.xName();
-			string y=param.yName();
-			EVENT_DATA_TYPE * xdata = fdata.get_data_memptr(x, ColType::channel);
-			EVENT_DATA_TYPE * ydata =fdata.get_data_memptr(y, ColType::channel);
-
-			int nEvents=parentInd.size();
-			INDICE_TYPE res;
-			res.reserve(nEvents);
-
-			/*
-			 * actual gating
-			 */
-			for(auto i : parentInd)
-			{
-				bool inX=false,inY=false;
-				EVENT_DATA_TYPE xMin=vertices[0].x;
-				EVENT_DATA_TYPE yMin=vertices[0].y;
-
-				EVENT_DATA_TYPE xMax=vertices[1].x;
-				EVENT_DATA_TYPE yMax=vertices[1].y;
-
-				if(xMin>xMax||yMin>yMax)
-					throw(domain_error("invalid vertices for rectgate!"));
-
-				if(is_quad)
-				{
-					//avoid the edge cells counted multiple times
-					switch(quadrant)
-					{
-						case Q1:
-						{
-							inX=xdata[i]<=xMax&&xdata[i]>=xMin;
-							inY=ydata[i]<=yMax&&ydata[i]>yMin;
-							break;
-						}
-						case Q2:
-						{
-							inX=xdata[i]<=xMax&&xdata[i]>xMin;
-							inY=ydata[i]<=yMax&&ydata[i]>=yMin;
-							break;
-						}
-						case Q3:
-						{
-							inX=xdata[i]<=xMax&&xdata[i]>=xMin;
-							inY=ydata[i]<yMax&&ydata[i]>=yMin;
-							break;
-						}
-						case Q4:
-						{
-							inX=xdata[i]<xMax&&xdata[i]>=xMin;
-							inY=ydata[i]<=yMax&&ydata[i]>=yMin;
-							break;
-						}
-					}
-				}
-				else
-				{
-					inX=xdata[i]<=xMax&&xdata[i]>=xMin;
-					inY=ydata[i]<=yMax&&ydata[i]>=yMin;
-				}
-
-
-				bool isIn = inX&&inY;
-				if(isIn != neg)
-				res.push_back(i);
-			}
-
-			return res;
-
-		}
+	/*
+	 * evaluated by the vectorized rectangle kernel (see in_rect)
+	 */
+	INDICE_TYPE gating(MemCytoFrame & fdata, INDICE_TYPE & parentInd);
 	unsigned short getType() const{return RECTGATE;}
 	gatePtr clone() const{return gatePtr(new rectGate(*this));};
 	void convertToPb(pb::gate & gate_pb);
@@ -0,0 +1,69 @@
+/* Copyright 2019 Fred Hutchinson Cancer Research Center
+ * See the included LICENSE file for details on the license that is granted to the
+ * user of this software.
+ * gate_kernels.hpp
+ *
+ *  Created on: Oct 18, 2026
+ */
+
+#ifndef INST_INCLUDE_CYTOLIB_GATE_KERNELS_HPP_
+#define INST_INCLUDE_CYTOLIB_GATE_KERNELS_HPP_
+
+#include "in_polygon.hpp"
+
+namespace cytolib
+{
+/**
+ * the ellipse (x - mu)' Q (x - mu) <= bound, where Q is the inverse of the covariance matrix
+ * it is evaluated in the precision of the event data
+ */
+struct ELLIPSE_QUADRATIC_FORM
+{
+	double mux, muy;
+	double qxx, qxy, qyy;//qxy is the sum of both off-diagonal elements
+	double bound;
+};
+
+/**
+ * the rectangle xmin <= x <= xmax, ymin <= y <= ymax, where each bound can be made open (e.g. to avoid counting the edge events in multiple quadrants)
+ */
+struct RECT_BOUNDS
+{
+	EVENT_DATA_TYPE xmin, xmax, ymin, ymax;
+	bool xmin_open, xmax_open, ymin_open, ymax_open;
+};
+
+/*
+ * The gating kernels of the simple gates.
+ *
+ * The membership predicate is evaluated block by block into a mask by a branch-free (vectorized) loop,
+ * the events are gathered through parentInd, or read directly from the columns when parentInd covers all the events (see is_dense_indices).
+ * The indices of the selected events are then compacted (in the order of parentInd) and appended to res.
+ * parentInd can be further split into chunks that are gated by multiple threads.
+ */
+
+/**
+ * whether parentInd is 0, 1, ..., nEvents - 1, i.e. the events of the root
+ */
+bool is_dense_indices(const INDICE_TYPE & parentInd, unsigned nEvents);
+/**
+ * min <= x <= max
+ * @param is_dense whether parentInd is all the events (see is_dense_indices)
+ */
+void in_range(const EVENT_DATA_TYPE * data, EVENT_DATA_TYPE min, EVENT_DATA_TYPE max, const INDICE_TYPE & parentInd, bool is_dense, bool is_negated, INDICE_TYPE & res, int num_threads = 1);
+/**
+ * within any of the ranges (bounds included), which must be sorted by the lower bounds and disjoint (see MultiRangeGate::SortAndMergeRanges)
+ * each event is located by a branch-free binary search over the lower bounds, i.e. O(log k) for k ranges
+ */
+void in_ranges(const EVENT_DATA_TYPE * data, const vector<pair<float, float>> & ranges, const INDICE_TYPE & parentInd, bool is_dense, bool is_negated, INDICE_TYPE & res, int num_threads = 1);
+/**
+ * the inside of the rectangle (see RECT_BOUNDS)
+ */
+void in_rect(const EVENT_DATA_TYPE * xdata, const EVENT_DATA_TYPE * ydata, const RECT_BOUNDS & b, const INDICE_TYPE & parentInd, bool is_dense, bool is_negated, INDICE_TYPE & res, int num_threads = 1);
+/**
+ * the inside (boundary included) of the ellipse
+ */
+void in_ellipse(const EVENT_DATA_TYPE * xdata, const EVENT_DATA_TYPE * ydata, const ELLIPSE_QUADRATIC_FORM & q, const INDICE_TYPE & parentInd, bool is_dense, bool is_negated, INDICE_TYPE & res, int num_threads = 1);
+}
+
+#endif /* INST_INCLUDE_CYTOLIB_GATE_KERNELS_HPP_ */
@@ -17,6 +17,7 @@
 #include <vector>
 #include <chrono>
 #include <unordered_set>
+#include <mutex>
 #include "datatype.hpp"
 #include "CytoVFS.hpp"
 using namespace std;
@@ -47,9 +48,19 @@ namespace cytolib
 	void PRINT(string a);
 	void PRINT(const char * a);
 
+	/**
+	 * The HDF5 library is typically not built thread-safe (e.g. Rhdf5lib),
+	 * so the h5 IO issued from the worker threads (e.g. parallel FCS ingestion) is serialized through this lock
+	 */
+	std::recursive_mutex & h5_mutex();
+
 	extern vector<string> spillover_keys;
 	extern unsigned short g_loglevel;// debug print is turned off by default
 	extern bool my_throw_on_error;//can be toggle off to get a partially parsed gating tree for debugging purpose
+	extern int g_gate_num_threads;//the number of threads used to gate the events of a single population (1 by default)
+	extern int g_comp_num_threads;//the number of threads used to compensate the events of a single sample (1 by default)
+	extern int g_trans_num_threads;//the number of threads used to transform the events of a single channel (1 by default)
+	extern size_t g_h5_copy_max_elements;//the max number of the events (rows x cols) held in memory at a time when copying or rewriting h5 by blocks (4M by default)
 
 	const int bsti = 1;  // Byte swap test integer
 	#define is_host_big_endian() ( (*(char*)&bsti) == 0 )
@@ -28,7 +28,53 @@ struct CYTO_POINT
 	CYTO_POINT(){};
 };
 
-void in_polygon(EVENT_DATA_TYPE * xdata, EVENT_DATA_TYPE * ydata, const vector<CYTO_POINT> & vertices, INDICE_TYPE & parentInd, bool is_negated, INDICE_TYPE &res);
+/**
+ * the pre-calculated edge of the polygon
+ */
+struct POLYGON_EDGE
+{
+	EVENT_DATA_TYPE p1x, p1y;//the start vertex
+	EVENT_DATA_TYPE dx, dy;//p2 - p1
+	EVENT_DATA_TYPE bottom, top;//y range
+	EVENT_DATA_TYPE left, right;//x range
+	EVENT_DATA_TYPE top_x;//x of the top vertex
+	bool is_horizontal;
+};
+
+/**
+ * The polygon gating engine.
+ *
+ * The edge table (bottom/top/left/right of each edge) is calculated once per polygon instead of per event,
+ * the events beyond the bounding box (below, above or to the right of the polygon) are rejected up front,
+ * and the rest of events are tested in batches by iterating the edges in the outer loop so that the inner loop over
+ * the contiguous x/y buffers can be vectorized.
+ * parentInd can be further split into chunks that are gated by multiple threads.
+ * It gives exactly the same results as the classic ray-casting(even-odd) test, including the events on the edges/vertices.
+ */
+class PolygonGatingEngine
+{
+	vector<POLYGON_EDGE> edges_;
+	vector<POLYGON_EDGE> cross_edges_;//the non-horizontal edges, i.e. the ones that can be crossed by the ray
+	EVENT_DATA_TYPE x_max_, y_min_, y_max_;
+	/**
+	 * the classic per-event ray-casting test
+	 */
+	bool is_in(EVENT_DATA_TYPE x, EVENT_DATA_TYPE y) const;
+	void gating_chunk(const EVENT_DATA_TYPE * xdata, const EVENT_DATA_TYPE * ydata, const unsigned * ind, size_t n, bool is_negated, INDICE_TYPE & res) const;
+public:
+	PolygonGatingEngine(const vector<CYTO_POINT> & vertices);
+	/**
+	 * @param xdata the x column
+	 * @param ydata the y column
+	 * @param parentInd the indices of the events to be tested
+	 * @param is_negated
+	 * @param res the indices (in the order of parentInd) of the events that are in the polygon are appended to it
+	 * @param num_threads the number of threads to split parentInd into
+	 */
+	void gating(const EVENT_DATA_TYPE * xdata, const EVENT_DATA_TYPE * ydata, const INDICE_TYPE & parentInd, bool is_negated, INDICE_TYPE &res, int num_threads = 1) const;
+};
+
+void in_polygon(EVENT_DATA_TYPE * xdata, EVENT_DATA_TYPE * ydata, const vector<CYTO_POINT> & vertices, INDICE_TYPE & parentInd, bool is_negated, INDICE_TYPE &res, int num_threads = 1);
 }
 
 #endif /* INST_INCLUDE_CYTOLIB_IN_POLYGON_HPP_ */
@@ -46,6 +46,7 @@ private:
 	popIndPtr indices;/**< ptr to the POPINDICES */
 	POPSTATS fjStats,fcStats;
 	bool hidden;
+	bool dirty;/**< the gate (or the input of it) was changed since the node was gated */
 
 
 public:
@@ -53,7 +54,7 @@ public:
 	bool isGated(){return indices.get()!=NULL;};
 	int getTotal(){return indices->getTotal();};
 
-	nodeProperties():thisGate(NULL),hidden(false){}
+	nodeProperties():thisGate(NULL),hidden(false),dirty(false){}
 
 	/*
 	 * convert pb object to internal structure
@@ -109,12 +110,22 @@ public:
 	bool getHiddenFlag(){
 		return (hidden);
 	}
+	/**
+	 * whether the population needs to be re-gated (see GatingHierarchy::regate_dirty)
+	 */
+	bool isDirty(){
+		return dirty;
+	}
+	void setDirtyFlag(bool _value){
+		dirty=_value;
+	}
 
 	/**
 	 * setter for the private member of gate
 	 */
 	void setGate(gatePtr gate){
 		thisGate=gate;
+		dirty=true;
 	}
 
 	/**
@@ -123,6 +134,7 @@ public:
 	 */
 	vector<bool> getIndices();
 	vector<unsigned> getIndices_u();
+	EventBitmap getBitmap();
 
 	void setIndices(unsigned _nEvent){
 			indices.reset(new ROOTINDICES(_nEvent));
@@ -133,8 +145,18 @@ public:
 	 *
 	 */
 	void setIndices(vector<bool> _ind);
+	void setIndices(const EventBitmap & _ind);
 
 	void setIndices(INDICE_TYPE _ind, unsigned nTotal);
+	/**
+	 * discard the gating result (e.g. the node fails to be re-gated) so that the outdated indices are no longer read
+	 * and the node is re-gated by the next regate_dirty
+	 */
+	void resetIndices(){
+		indices.reset();
+		fcStats.erase("count");
+		dirty = true;
+	}
 	/*
 	 * potentially it is step can be done within the same loop in gating
 	 * TODO:MFI can be calculated here as well
@@ -33,6 +33,8 @@ struct FCS_READ_DATA_PARAM{
 	 vector<int64_t> which_lines; //select rows to be read in
 	 int seed;
 	 bool isTransformed;//record the outcome after parsing
+	 bool use_mmap;//decode events directly from the memory-mapped data section instead of reading it into a buffer first
+	 uint64_t stream_chunk_size;//number of events decoded and written at a time when streaming FCS to h5
 	 FCS_READ_DATA_PARAM(){
 		 scale = false;
 		 truncate_max_range = true;
@@ -43,11 +45,240 @@ struct FCS_READ_DATA_PARAM{
 		 num_threads = 1;
 		 isTransformed = false;
 		 seed = 1;
+		 use_mmap = true;
+		 stream_chunk_size = 1 << 18;
 	 }
 
 
 };
 
+/**
+ * byte swapping of the raw integer bits (written as plain shifts so that compilers emit bswap for them)
+ */
+inline uint8_t fcs_bswap(uint8_t v){return v;}
+inline uint16_t fcs_bswap(uint16_t v){return static_cast<uint16_t>((v >> 8) | (v << 8));}
+inline uint32_t fcs_bswap(uint32_t v){
+	return ((v & 0x000000ffu) << 24) | ((v & 0x0000ff00u) << 8) | ((v & 0x00ff0000u) >> 8) | ((v & 0xff000000u) >> 24);
+}
+inline uint64_t fcs_bswap(uint64_t v){
+	return (static_cast<uint64_t>(fcs_bswap(static_cast<uint32_t>(v))) << 32) | fcs_bswap(static_cast<uint32_t>(v >> 32));
+}
+template<int N> struct fcs_raw_bits;
+template<> struct fcs_raw_bits<1>{typedef uint8_t type;};
+template<> struct fcs_raw_bits<2>{typedef uint16_t type;};
+template<> struct fcs_raw_bits<4>{typedef uint32_t type;};
+template<> struct fcs_raw_bits<8>{typedef uint64_t type;};
+
+/**
+ * load one (possibly unaligned) element of type T from the raw data section
+ */
+template<typename T, bool BYTESWAP>
+inline T fcs_load(const char * p)
+{
+	typename fcs_raw_bits<sizeof(T)>::type u;
+	memcpy(&u, p, sizeof(T));
+	if(BYTESWAP)
+		u = fcs_bswap(u);
+	T v;
+	memcpy(&v, &u, sizeof(T));
+	return v;
+}
+
+/**
+ * convert n elements of one parameter from the row-major raw bytes to a contiguous column
+ *
+ * @param src the first element of this parameter in the raw bytes
+ * @param stride the number of bytes of each row(event)
+ * @param n number of rows
+ * @param dest the output column
+ */
+template<typename T, bool BYTESWAP>
+void fcs_decode_column(const char * src, size_t stride, size_t n, EVENT_DATA_TYPE * dest)
+{
+	for(size_t r = 0; r < n; r++)
+		dest[r] = static_cast<EVENT_DATA_TYPE>(fcs_load<T, BYTESWAP>(src + r * stride));
+}
+
+typedef void (*FCS_DECODE_FUNC)(const char *, size_t, size_t, EVENT_DATA_TYPE *);
+
+template<bool BYTESWAP>
+FCS_DECODE_FUNC get_fcs_decode_func(bool isInteger, int nBytes)
+{
+	if(isInteger)
+	{
+		switch(nBytes)
+		{
+		case sizeof(BYTE)://1 byte
+			return fcs_decode_column<char, BYTESWAP>;
+		case sizeof(unsigned short): //2 bytes
+			return fcs_decode_column<unsigned short, BYTESWAP>;
+		case sizeof(unsigned)://4 bytes
+			return fcs_decode_column<unsigned, BYTESWAP>;
+		case sizeof(uint64_t)://8 bytes
+			return fcs_decode_column<uint64_t, BYTESWAP>;
+		default:
+			std::string serror = "unsupported byte width :";
+			serror.append(std::to_string(nBytes));
+			throw std::range_error(serror.c_str());
+		}
+	}
+	else
+	{
+		switch(nBytes)
+		{
+		case sizeof(float):
+			return fcs_decode_column<float, BYTESWAP>;
+		case sizeof(double):
+			return fcs_decode_column<double, BYTESWAP>;
+		default:
+			std::string serror ="Unsupported bitwidths for numerical data type:";
+			serror.append(std::to_string(nBytes));
+			throw std::range_error(serror.c_str());
+		}
+	}
+}
+
+/**
+ * The per-parameter decoding plan of the FCS data section.
+ *
+ * The datatype/bitwidth/endian dispatch is resolved once into a specialized conversion function
+ * and all the truncation/transformation decisions are resolved into flags, so that the events
+ * are processed in blocks by a sequence of branch-free loops instead of re-evaluating them for each element
+ */
+struct FCS_COLUMN_DECODER{
+	FCS_DECODE_FUNC decode;
+	size_t offset;//byte offset of the parameter within each row
+	bool isMask;
+	uint64_t base;
+	bool truncate_max, truncate_min;
+	EVENT_DATA_TYPE max, min_limit;
+	bool isLog, isGain;//linearize either log-stored values or by PnG
+	EVENT_DATA_TYPE PnE[2], PnG;
+	int scale;//0: no scaling, 1: scale log-stored values, 2: scale linear values
+	float decade;
+
+	FCS_COLUMN_DECODER():decode(NULL),offset(0),isMask(false),base(0),truncate_max(false),truncate_min(false),max(0),min_limit(0)
+						,isLog(false),isGain(false),PnG(1),scale(0),decade(1){PnE[0] = PnE[1] = 0;}
+	/**
+	 * decode n rows into dest and update the running minimum
+	 * @param rows the beginning of the first row in the raw bytes
+	 * @param stride the number of bytes of each row
+	 */
+	void operator()(const char * rows, size_t stride, size_t n, EVENT_DATA_TYPE * dest, EVENT_DATA_TYPE & realMin) const
+	{
+		decode(rows + offset, stride, n, dest);
+		// apply bitmask for integer data
+		if(isMask)
+			for(size_t r = 0; r < n; r++)
+				dest[r] = static_cast<uint64_t>(dest[r]) % base;
+		// truncate data at range
+		if(truncate_max)
+			for(size_t r = 0; r < n; r++)
+				dest[r] = dest[r] > max ? max : dest[r];
+		if(truncate_min)
+			for(size_t r = 0; r < n; r++)
+				dest[r] = dest[r] < min_limit ? min_limit : dest[r];
+		if(isLog)
+			for(size_t r = 0; r < n; r++)
+				dest[r] = pow(10,dest[r]/max * PnE[0]) * PnE[1];
+		else if(isGain)
+			for(size_t r = 0; r < n; r++)
+				dest[r] = dest[r] / PnG;
+		if(scale == 1)
+			for(size_t r = 0; r < n; r++)
+				dest[r] = decade*((dest[r]-1)/(max-1));
+		else if(scale == 2)
+			for(size_t r = 0; r < n; r++)
+				dest[r] = decade*((dest[r])/(max));
+		for(size_t r = 0; r < n; r++)
+			realMin = realMin > dest[r]?dest[r]:realMin;
+	}
+};
+
+/**
+ * the number of rows decoded at a time by each thread, sized to keep the raw bytes and the output of a block in cache
+ */
+const size_t FCS_DECODE_BLOCK_ROWS = 4096;
+
+/**
+ * The decisions made from the keywords before decoding the data section.
+ * It is shared by the in-memory parser and the streaming FCS-to-h5 converter,
+ * which decodes the same plan one chunk of rows at a time
+ */
+struct FCS_DATA_PLAN{
+	bool isTransformation, scale, fcsPnGtransform;
+	float decade;
+	size_t nRowSize;//number of bits of each row
+	int64_t nBytes;//size of the data section according to the header
+	uint64_t nrow;
+	vector<int> iByteOrd;//byte order of each element for the mixed endian, empty otherwise
+	vector<FCS_COLUMN_DECODER> decoders;
+	int num_threads;
+	FCS_DATA_PLAN():isTransformation(false),scale(false),fcsPnGtransform(false),decade(1),nRowSize(0),nBytes(0),nrow(0),num_threads(1){};
+	/**
+	 * rearrange the raw bytes of the mixed endian into little endian (in place)
+	 * @param buf the raw bytes of nrow rows
+	 */
+	void fix_mixed_endian(char * buf, size_t nrow) const
+	{
+		if(iByteOrd.empty())
+			return;
+		size_t elementSize = iByteOrd.size();
+		size_t nElement = nrow * decoders.size();
+		vector<char> tmp(elementSize);
+		for(size_t ind = 0; ind < nElement; ind++){
+
+			memcpy(tmp.data(), buf + ind * elementSize, elementSize);
+
+			for(size_t i = 0; i < elementSize; i++){
+				auto j = iByteOrd[i];
+				auto pos_new = ind * elementSize + j;
+				buf[pos_new] = tmp[i];
+			}
+		}
+	}
+	/**
+	 * cp raw bytes(row-major) to a 2d mat (col-major) in blocks of rows,
+	 * so that each block of raw bytes is fetched once for all the parameters
+	 *
+	 * @param rows the raw bytes of nrow rows
+	 * @param dest the col-major output
+	 * @param ld the leading dimension (number of rows allocated for each column) of dest
+	 * @param realMin (output) the minimum of each parameter
+	 */
+	void decode(const char * rows, size_t nrow, EVENT_DATA_TYPE * dest, size_t ld, vector<EVENT_DATA_TYPE> & realMin) const
+	{
+		size_t nCol = decoders.size();
+		size_t nRowSizeBytes = nRowSize/8;
+		int nThreads = 1;
+	#ifdef _OPENMP
+		omp_set_num_threads(num_threads);
+		nThreads = omp_get_max_threads();
+	#endif
+		//running minimum of each parameter for each thread
+		vector<EVENT_DATA_TYPE> realMins(nThreads * nCol, numeric_limits<EVENT_DATA_TYPE>::max());
+		int64_t nBlock = (nrow + FCS_DECODE_BLOCK_ROWS - 1) / FCS_DECODE_BLOCK_ROWS;
+
+		#pragma omp parallel for
+		for(int64_t b = 0; b < nBlock; b++)
+		{
+			int tid = 0;
+	#ifdef _OPENMP
+			tid = omp_get_thread_num();
+	#endif
+			size_t r = b * FCS_DECODE_BLOCK_ROWS;
+			size_t n = min<size_t>(FCS_DECODE_BLOCK_ROWS, nrow - r);
+			const char * block = rows + r * nRowSizeBytes;
+			for(size_t c = 0; c < nCol; c++)
+				decoders[c](block, nRowSizeBytes, n, dest + c * ld + r, realMins[tid * nCol + c]);
+		}
+
+		realMin.assign(nCol, numeric_limits<EVENT_DATA_TYPE>::max());
+		for(size_t c = 0; c < nCol; c++)
+			for(int i = 0; i < nThreads; i++)
+				realMin[c] = min(realMin[c], realMins[i * nCol + c]);
+	}
+};
 
 };
 
@@ -12,6 +12,7 @@
 
 #define SPLINE_HPP_
 #include <vector>
+#include "datatype.hpp"
 using namespace std;
 
 namespace cytolib
@@ -38,7 +39,40 @@ void spline_eval_C(int *method, int *nu, double *u, double *v,
  */
 
 void natural_spline(vector<double>x, vector<double> y, vector<double>& b,vector<double>& c,vector<double>& d);
-void spline_eval(int method, double* u,int nSize,
+void spline_eval(int method, EVENT_DATA_TYPE* u,int nSize,
 		  const vector<double> & x, const vector<double> & y, const vector<double> & b, const vector<double> & c, const vector<double> & d);
+
+struct SPLINE_KNOT{
+	double x, y, b, c, d;
+};
+/*
+ * the uniform-grid bucket index over the knots of a natural spline,
+ * which finds the interval of an event in O(1) instead of the binary search of spline_eval
+ */
+struct SPLINE_INDEX{
+	/*
+	 * the coefficients of the knots interleaved,
+	 * plus an extra one at the end for the linear extrapolation on the left (i.e. the first knot with d = 0)
+	 */
+	vector<SPLINE_KNOT> knots;
+	/*
+	 * bucket[k]: the number of the knots below the lower edge of the k-th bucket
+	 * the intervals of the events in bucket k are thus searched within the knots [bucket[k], bucket[k + 1])
+	 */
+	vector<int> bucket;
+	double x0;
+	double inv_width;
+	bool empty() const{return knots.empty();}
+};
+/*
+ * build the index of the natural spline (returns the empty one when the knots are not sorted)
+ */
+SPLINE_INDEX spline_index(const vector<double> & x, const vector<double> & y, const vector<double> & b, const vector<double> & c, const vector<double> & d);
+/*
+ * the natural spline evaluation (i.e. method=2) by the index
+ * it selects the same interval as a binary search for each event, so the output is identical to spline_eval
+ * (except the events right on a knot, which spline_eval may evaluate from either side of it depending on the previous event)
+ */
+void spline_eval(const SPLINE_INDEX & index, EVENT_DATA_TYPE* u, int nSize);
 };
 #endif /* SPLINE_HPP_ */
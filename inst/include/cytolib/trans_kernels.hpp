@@ -0,0 +1,98 @@
+/*Copyright 2019 Fred Hutchinson Cancer Research Center
+ * See the included LICENSE file for details on the license that is granted to the
+ * user of this software.
+ * trans_kernels.hpp
+ *
+ *  Created on: Oct 18, 2026
+ */
+
+#ifndef INST_INCLUDE_CYTOLIB_TRANS_KERNELS_HPP_
+#define INST_INCLUDE_CYTOLIB_TRANS_KERNELS_HPP_
+#include <cytolib/global.hpp>
+#include <cytolib/datatype.hpp>
+#include <algorithm>
+#include <exception>
+#include <vector>
+
+namespace cytolib
+{
+/*
+ * the events are transformed block by block, which is the unit of the threads
+ */
+const int TRANS_BLOCK_SIZE = 256;
+/*
+ * the events are not split across threads unless each thread gets at least this many
+ */
+const int TRANS_MIN_EVENTS_PER_THREAD = 1 << 15;
+
+/**
+ * apply f(block, len) to the blocks of events (in parallel by g_trans_num_threads threads)
+ * the exception thrown by f in parallel is rethrown after all the threads are done (the one of the first failed block)
+ */
+template<typename F> void transform_blocks(EVENT_DATA_TYPE * x, int n, F f)
+{
+	int nBlock = (n + TRANS_BLOCK_SIZE - 1) / TRANS_BLOCK_SIZE;
+	int nThread = std::min(g_trans_num_threads, n / TRANS_MIN_EVENTS_PER_THREAD);
+	if(nThread <= 1)
+	{//run it outside of the parallel region so that the exceptions still propagate to the caller
+		for(int k = 0; k < nBlock; k++)
+		{
+			int start = k * TRANS_BLOCK_SIZE;
+			f(x + start, std::min(TRANS_BLOCK_SIZE, n - start));
+		}
+		return;
+	}
+	//the exceptions can't escape the parallel region, so they are caught per block
+	std::vector<std::exception_ptr> errors(nBlock);
+	#pragma omp parallel for schedule(static) num_threads(nThread)
+	for(int k = 0; k < nBlock; k++)
+	{
+		int start = k * TRANS_BLOCK_SIZE;
+		try{
+			f(x + start, std::min(TRANS_BLOCK_SIZE, n - start));
+		}
+		catch(...)
+		{
+			errors[k] = std::current_exception();
+		}
+	}
+	for(auto & e : errors)
+		if(e)
+			std::rethrow_exception(e);
+}
+
+/*
+ * Batch kernels of the transformations, which transform the events in place.
+ *
+ * The invariants of the transformations are hoisted by the callers into the coefficients.
+ * log and exp are evaluated by branch-free polynomial approximations, which are vectorized (omp simd) and
+ * accurate to about 1 ulp (max relative error 2.3e-16 measured over the entire double range).
+ * exp10 (i.e. exp of a scaled argument) additionally carries the rounding of the argument, i.e. relative error |a*x+b| * 1.1e-16.
+ * sinh is (e^y - e^-y) / 2, of which the error is relative for |y| >= 1 and absolute (< 4e-16) below.
+ * The arguments out of the domain of the approximations (non-positive, subnormal, inf, nan or overflowing)
+ * are handled by the std functions.
+ */
+
+/**
+ * x = a * x + b
+ */
+void batch_affine(EVENT_DATA_TYPE * x, int n, double a, double b);
+/**
+ * x = x > 0 ? a * ln(x) + b : non_positive
+ */
+void batch_log_affine(EVENT_DATA_TYPE * x, int n, double a, double b, EVENT_DATA_TYPE non_positive);
+/**
+ * x = exp(a * x + b)
+ */
+void batch_exp_affine(EVENT_DATA_TYPE * x, int n, double a, double b);
+/**
+ * x = c * sinh(a * x + b)
+ */
+void batch_sinh_affine(EVENT_DATA_TYPE * x, int n, double a, double b, double c);
+/**
+ * x = a * asinh(s * x) + b
+ */
+void batch_asinh_affine(EVENT_DATA_TYPE * x, int n, double s, double a, double b);
+};
+
+#endif /* INST_INCLUDE_CYTOLIB_TRANS_KERNELS_HPP_ */
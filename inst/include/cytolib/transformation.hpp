@@ -324,6 +324,27 @@ struct logicle_params
 struct sfun_info{
 	double b,w;
 };
+
+/**
+ * the piecewise cubic tables of the fast logicle mode
+ * each segment stores the coefficients c0..c3 of the cubic in t (the relative position within the segment)
+ */
+struct LOGICLE_TABLE{
+	/*
+	 * forward: the segments are log2-spaced on |value| in [2^e_min, 2^(e_max+1)),
+	 * i.e. each binary exponent is split into 2^log2K segments by the leading mantissa bits
+	 */
+	int e_min, e_max;
+	unsigned log2K;
+	vector<double> fwd;
+	/*
+	 * inverse: the segments are evenly spaced on scale in [x1, x1 + nSeg * h)
+	 */
+	double h;
+	unsigned nSeg;
+	vector<double> inv;
+	double tol;
+};
 class logicleTrans:public transformation
 {
 //	const double DEFAULT_DECADES = 4.5;
@@ -336,6 +357,7 @@ class logicleTrans:public transformation
 
 	logicle_params p;
 	bool isGml2;
+	shared_ptr<const LOGICLE_TABLE> table_;//the tables of fast mode (shared by the copies)
 
 public:
 	logicle_params get_params();
@@ -381,6 +403,22 @@ public:
 
 	double scale (double value) const;
 	double inverse (double scale) const;
+	/**
+	 * Switch on/off the fast mode of transforming().
+	 *
+	 * The fast mode evaluates scale() and inverse() from piecewise cubic (Hermite) tables,
+	 * which are built here once from the exact values and slopes at the knots.
+	 * The knots are refined until the error, checked at the interior points of every segment, is below tol.
+	 * The values beyond the tables (which cover at least 8 times of T) fall back to the exact evaluation.
+	 * It throws domain_error when the tables can't be built within tol.
+	 * @param is_fast
+	 * @param tol the max absolute error against scale() (in scale units, i.e. before multiplied by M)
+	 * 			and against inverse() (in raw units)
+	 */
+	void set_fast(bool is_fast, double tol = 1e-6);
+	bool is_fast() const{return bool(table_);}
+	double scale_fast(double value) const;
+	double inverse_fast(double scale) const;
 
 	virtual void transforming(EVENT_DATA_TYPE * input, int nSize);
 	TransPtr clone() const;
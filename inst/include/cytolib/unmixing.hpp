@@ -0,0 +1,77 @@
+/*Copyright 2019 Fred Hutchinson Cancer Research Center
+ * See the included LICENSE file for details on the license that is granted to the
+ * user of this software.
+ * unmixing.hpp
+ *
+ *  Created on: Oct 18, 2026
+ */
+
+#ifndef INST_INCLUDE_CYTOLIB_UNMIXING_HPP_
+#define INST_INCLUDE_CYTOLIB_UNMIXING_HPP_
+#include "MemCytoFrame.hpp"
+
+namespace cytolib
+{
+enum class UnmixMethod {OLS, WLS};
+
+struct UNMIX_PARAM{
+	UnmixMethod method = UnmixMethod::OLS;
+	/*
+	 * WLS only: the variance of a detector is modeled as Poisson (i.e. proportional to its signal) plus this background variance,
+	 * which also keeps the weights of the dim (or negative) detectors finite
+	 */
+	double background_variance = 1;
+	int num_threads = 1;
+};
+
+/**
+ * the throughput of an unmixing run
+ */
+struct UNMIX_STATS{
+	size_t nEvents = 0;
+	size_t nDetector = 0;
+	size_t nMarker = 0;
+	double seconds = 0;
+	double events_per_sec() const{
+		return seconds > 0 ? nEvents / seconds : 0;
+	}
+};
+
+/**
+ * Spectral unmixing engine.
+ *
+ * The spectra (marker-by-detector spillover matrix) of a compensation are factorized once at construction
+ * and then reused for any number of frames.
+ *
+ * OLS: the events are multiplied by the cached least squares inverse (see compensation::apply).
+ * WLS: each event is solved by its own normal equations, where the detectors are weighted by the inverse of their (Poisson) variance,
+ * 		i.e. 1 / (max(signal, 0) + background_variance).
+ * 		The events whose normal equations are not positive definite fall back to OLS.
+ * Both run on the tiles of events in parallel and overwrite only the marker columns in place.
+ */
+class SpectralUnmixer{
+	compensation comp_;
+	UNMIX_PARAM param_;
+	mat M_;//marker-by-detector spectra, so that the spectrum of each detector is contiguous
+	mat K_;//detector-by-marker least squares inverse
+public:
+	SpectralUnmixer(const compensation & comp, const UNMIX_PARAM & param = UNMIX_PARAM());
+	/**
+	 * unmix the events in place
+	 * @param data the col-major event matrix
+	 * @param marker_idx the column indices of the markers
+	 * @param detector_idx the column indices of the detectors
+	 * @return the throughput metrics
+	 */
+	UNMIX_STATS unmix(EVENT_DATA_VEC & data, const arma::uvec & marker_idx, const arma::uvec & detector_idx) const;
+	/**
+	 * unmix the frame (in place for MemCytoFrame)
+	 * @param cytoframe
+	 * @return the throughput metrics
+	 */
+	UNMIX_STATS unmix(CytoFrame & cytoframe) const;
+	const UNMIX_PARAM & get_param() const{return param_;}
+};
+};
+
+#endif /* INST_INCLUDE_CYTOLIB_UNMIXING_HPP_ */
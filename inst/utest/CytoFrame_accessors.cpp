@@ -3,6 +3,7 @@
 #include <cytolib/TileCytoFrame.hpp>
 #include <cytolib/H5CytoFrame.hpp>
 #include <cytolib/MemCytoFrame.hpp>
+#include <cytolib/unmixing.hpp>
 
 #include "fixture.hpp"
 using namespace cytolib;
@@ -222,6 +223,121 @@ BOOST_AUTO_TEST_CASE(spillover)
 		BOOST_CHECK_CLOSE(comp.spillOver[i], comp1.spillOver[i], 1);
 
 }
+BOOST_AUTO_TEST_CASE(compensate)
+{
+	auto comp = fr.get_compensation();
+	arma::uvec marker_idx(comp.marker.size());
+	for(unsigned i = 0; i < marker_idx.size(); i++)
+		marker_idx[i] = fr.get_col_idx(comp.marker[i], ColType::channel);
+	//reference: X = D * inv(S)
+	arma::mat D = conv_to<arma::mat>::from(fr.get_data());
+	arma::mat expect = D.cols(marker_idx) * inv(comp.get_spillover_mat());
+
+	for(int nThreads : {1, 4})
+	{
+		g_comp_num_threads = nThreads;
+		MemCytoFrame fr1 = fr;
+		fr1.compensate(comp);
+		arma::mat res = conv_to<arma::mat>::from(fr1.get_data().eval().cols(marker_idx));
+		BOOST_CHECK_LE(abs(res - expect).max(), 1e-6 * abs(expect).max());
+		//the columns other than markers are untouched
+		arma::mat D1 = conv_to<arma::mat>::from(fr1.get_data());
+		for(unsigned j = 0; j < D.n_cols; j++)
+			if(!any(marker_idx == j))
+				BOOST_CHECK(approx_equal(D1.col(j), D.col(j), "absdiff", 0));
+	}
+	g_comp_num_threads = 1;
+	//h5 is compensated by the blocks of rows with the same result
+	MemCytoFrame fr1 = fr;
+	fr1.compensate(comp);
+	string tmp = generate_unique_filename(fs::temp_directory_path().string(), "", ".h5");
+	fr.write_h5(tmp);
+	H5CytoFrame fr_h5(tmp, false);
+	auto max_elements = g_h5_copy_max_elements;
+	g_h5_copy_max_elements = 1000;
+	fr_h5.compensate(comp);
+	g_h5_copy_max_elements = max_elements;
+	BOOST_CHECK(approx_equal(fr_h5.get_data(), fr1.get_data(), "absdiff", 0));
+	//NaN in a detector propagates to all the markers (as the matrix product does) regardless of the zero coefficients
+	MemCytoFrame fr2 = fr;
+	EVENT_DATA_VEC dat = fr2.get_data();
+	dat(3, fr.get_col_idx(comp.detector[0], ColType::channel)) = numeric_limits<EVENT_DATA_TYPE>::quiet_NaN();
+	fr2.set_data(dat);
+	fr2.compensate(comp);
+	dat = fr2.get_data();
+	for(auto j : marker_idx)
+		BOOST_CHECK(std::isnan(dat(3, j)));
+	//the cached inverse follows the change of spillover
+	auto K = comp.get_inverse();
+	comp.spillOver[1] += 0.1;
+	BOOST_CHECK(!approx_equal(comp.get_inverse(), K, "absdiff", 0));
+	BOOST_CHECK(approx_equal(comp.get_inverse(), inv(comp.get_spillover_mat()), "reldiff", 1e-8));
+}
+BOOST_AUTO_TEST_CASE(event_precision)
+{
+	//the compensation and transformation in the precision of the events (float32 with CYTOLIB_FLOAT_EVENTS) against the double references
+	double eps = numeric_limits<EVENT_DATA_TYPE>::epsilon();
+	auto comp = fr.get_compensation();
+	arma::uvec marker_idx(comp.marker.size());
+	for(unsigned i = 0; i < marker_idx.size(); i++)
+		marker_idx[i] = fr.get_col_idx(comp.marker[i], ColType::channel);
+	arma::mat D = conv_to<arma::mat>::from(fr.get_data());
+	arma::mat expect = D.cols(marker_idx) * inv(comp.get_spillover_mat());
+	MemCytoFrame fr1 = fr;
+	fr1.compensate(comp);
+	arma::mat res = conv_to<arma::mat>::from(fr1.get_data().eval().cols(marker_idx));
+	BOOST_CHECK_LE(abs(res - expect).max(), 1e3 * eps * abs(expect).max());
+
+	double ln10 = log(10);
+	fasinhTrans fasinh(262144, 4, 262144, 0.5, 4.5);
+	flinTrans flin(-100, 262144);
+	for(unsigned j : {marker_idx[0], marker_idx[marker_idx.size() - 1]})
+	{
+		EVENT_DATA_TYPE * x = fr1.get_data_memptr(fr1.get_channels()[j], ColType::channel);
+		unsigned n = fr1.n_rows();
+		vector<EVENT_DATA_TYPE> y_asinh(x, x + n), y_lin(x, x + n);
+		fasinh.transforming(y_asinh.data(), n);
+		flin.transforming(y_lin.data(), n);
+		double err_asinh = 0, err_lin = 0;
+		for(unsigned i = 0; i < n; i++)
+		{
+			double v = x[i];
+			double e_asinh = 4 * (asinh(v * sinh(4.5 * ln10) / 262144) + 0.5 * ln10) / (5 * ln10);
+			double e_lin = (v - 100) / (262144 - 100);
+			err_asinh = max(err_asinh, abs(y_asinh[i] - e_asinh) / max(1.0, abs(e_asinh)));
+			err_lin = max(err_lin, abs(y_lin[i] - e_lin) / max(1.0, abs(e_lin)));
+		}
+		BOOST_CHECK_LE(err_asinh, 64 * eps);
+		BOOST_CHECK_LE(err_lin, 64 * eps);
+	}
+}
+BOOST_AUTO_TEST_CASE(spectral_unmixing)
+{
+	unsigned nMarker = 12, nDetector = 16, n = 100000;
+	vector<string> markers, detectors;
+	for(unsigned i = 0; i < nDetector; i++)
+		detectors.push_back("D" + to_string(i));
+	markers.assign(detectors.begin(), detectors.begin() + nMarker);
+	arma::mat spill(nDetector, nMarker, arma::fill::randu);
+	compensation comp(spill, markers, detectors);
+	//noise-free signals are recovered by both methods
+	arma::mat X(n, nMarker, arma::fill::randu);
+	X *= 1000;
+	arma::mat Y = X * comp.get_spillover_mat();
+	arma::uvec marker_idx = regspace<arma::uvec>(0, nMarker - 1);
+	arma::uvec detector_idx = regspace<arma::uvec>(0, nDetector - 1);
+	for(auto method : {UnmixMethod::OLS, UnmixMethod::WLS})
+	{
+		UNMIX_PARAM param;
+		param.method = method;
+		param.num_threads = 4;
+		EVENT_DATA_VEC dat = conv_to<EVENT_DATA_VEC>::from(Y);
+		auto stats = SpectralUnmixer(comp, param).unmix(dat, marker_idx, detector_idx);
+		BOOST_CHECK_EQUAL(stats.nEvents, n);
+		arma::mat res = conv_to<arma::mat>::from(dat.cols(0, nMarker - 1));
+		BOOST_CHECK_LE(abs(res - X).max(), 1e-3 * X.max());
+	}
+}
 BOOST_AUTO_TEST_CASE(profile_get_data)
 {
 	auto fr1 = MemCytoFrame("../flowWorkspace/wsTestSuite/profile_get_data.fcs", config);
@@ -236,6 +352,135 @@ BOOST_AUTO_TEST_CASE(profile_get_data)
 	runtime = (gettime() - start);
 	cout << "get a reference: " << runtime << endl;
 }
+BOOST_AUTO_TEST_CASE(h5_layout)
+{
+	auto fr1 = MemCytoFrame("../flowWorkspace/wsTestSuite/profile_get_data.fcs", config);
+	fr1.read_fcs();
+	auto dat = fr1.get_data();
+	unsigned nrow = fr1.n_rows();
+	uvec cidx = {1, 2, 5};
+	uvec ridx = regspace<uvec>(nrow/4, nrow/4 + 9999);
+
+	vector<pair<string, H5_LAYOUT_PARAM>> layouts(4);
+	layouts[0].first = "column(entire)";
+	layouts[0].second.chunk_rows = 0;
+	layouts[1].first = "column";
+	layouts[1].second.chunk_rows = 1 << 16;
+	layouts[2].first = "tile";
+	layouts[2].second.layout = H5Layout::tile;
+	layouts[2].second.chunk_rows = 1 << 16;
+	layouts[3].first = "tile(deflate+shuffle)";
+	layouts[3].second.layout = H5Layout::tile;
+	layouts[3].second.chunk_rows = 1 << 16;
+	layouts[3].second.deflate = 1;
+	layouts[3].second.shuffle = true;
+	for(auto & it : layouts)
+	{
+		string tmp = generate_unique_filename(fs::temp_directory_path().string(), "", ".h5");
+		fr1.write_h5(tmp, it.second);
+		H5CytoFrame fr_h5(tmp);
+		//the layout is recorded in h5
+		BOOST_CHECK(fr_h5.get_layout().layout == it.second.layout);
+		BOOST_CHECK_EQUAL(fr_h5.get_layout().deflate, it.second.deflate);
+		BOOST_CHECK_EQUAL(fr_h5.get_layout().shuffle, it.second.shuffle);
+
+		auto mat = fr_h5.get_data();
+		BOOST_CHECK(arma::approx_equal(arma::conv_to<arma::fmat>::from(dat), arma::conv_to<arma::fmat>::from(mat), "absdiff", 0));
+
+		mat = fr_h5.get_data(cidx, true);
+		BOOST_CHECK(arma::approx_equal(arma::conv_to<arma::fmat>::from(dat.cols(cidx)), arma::conv_to<arma::fmat>::from(mat), "absdiff", 0));
+
+		mat = fr_h5.get_data(ridx, false);
+		BOOST_CHECK(arma::approx_equal(arma::conv_to<arma::fmat>::from(dat.rows(ridx)), arma::conv_to<arma::fmat>::from(mat), "absdiff", 0));
+
+		mat = fr_h5.get_data(ridx, cidx);
+		BOOST_CHECK(arma::approx_equal(arma::conv_to<arma::fmat>::from(dat.submat(ridx, cidx)), arma::conv_to<arma::fmat>::from(mat), "absdiff", 0));
+
+		//scattered rows in arbitrary order (with duplicates) are read by a single union selection
+		uvec ridx_rand(500);
+		srand (1);
+		for(auto & i : ridx_rand)
+			i = rand()%nrow;
+		uvec cidx_rand = {5, 1, 1};
+		mat = fr_h5.get_data(ridx_rand, cidx_rand);
+		BOOST_CHECK(arma::approx_equal(arma::conv_to<arma::fmat>::from(dat.submat(ridx_rand, cidx_rand)), arma::conv_to<arma::fmat>::from(mat), "absdiff", 0));
+		fs::remove(tmp);
+	}
+}
+BOOST_AUTO_TEST_CASE(h5_file_cache)
+{
+	auto & cache = H5FileCache::instance();
+	auto cap = cache.get_capacity();
+	cache.set_capacity(2);
+	vector<string> files;
+	for(int i = 0; i < 3; i++)
+	{
+		files.push_back(generate_unique_filename(fs::temp_directory_path().string(), "", ".h5"));
+		fr.write_h5(files[i]);
+	}
+	//the handles are kept open across the calls up to the capacity
+	for(int i = 0; i < 3; i++)
+		H5CytoFrame(files[i], true).get_data({1}, true);
+	//least recently used one is closed
+	BOOST_CHECK_EQUAL(cache.size(), 2);
+
+	//the frames on the same file share one handle across the reads (i.e. read_data calls)
+	cache.release(files[0]);
+	auto n_open = cache.get_open_count();
+	H5CytoFrame fr1(files[0], true);
+	H5CytoFrame fr2(files[0], true);
+	for(int i = 0; i < 3; i++)
+	{
+		fr1.get_data({1}, true);
+		fr2.get_data({2}, true);
+	}
+	BOOST_CHECK_EQUAL(cache.get_open_count(), n_open + 1);
+
+	//the file is only open in one mode: read-only handle is closed for write, and the read-write one is then reused for read
+	H5CytoFrame fr_ro(files[2], true);
+	H5CytoFrame fr_rw(files[2], false);
+	fr_rw.set_keyword("$FIL", "cached");
+	fr_rw.flush_meta();
+	BOOST_CHECK_EQUAL(H5CytoFrame(files[2], true).get_keyword("$FIL"), "cached");
+	BOOST_CHECK(arma::approx_equal(fr_ro.get_data(), fr_rw.get_data(), "absdiff", 0));
+	unsigned intent;
+	H5Fget_intent(cache.open(files[2], H5F_ACC_RDONLY).file().getId(), &intent);
+	BOOST_CHECK_EQUAL(intent, H5F_ACC_RDWR);
+	//the read requests share the write handle in use
+	{
+		auto h5 = cache.open(files[2], H5F_ACC_RDWR);
+		BOOST_CHECK_NO_THROW(cache.open(files[2], H5F_ACC_RDONLY));
+	}
+
+	//the released files can be opened for write (e.g. by other processes)
+	cache.release(files[2]);
+	BOOST_CHECK_NO_THROW(H5File(files[2], H5F_ACC_RDWR).close());
+
+	//the same file under the different path
+	string alias = (fs::path(files[2]).parent_path() / "." / fs::path(files[2]).filename()).string();
+	H5CytoFrame fr_alias(alias, false);
+	fr_alias.set_keyword("$FIL", "alias");
+	fr_alias.flush_meta();
+	fr_ro.load_meta();
+	BOOST_CHECK_EQUAL(fr_ro.get_keyword("$FIL"), "alias");
+
+	//the cached file can be overwritten
+	fr.write_h5(files[2]);
+	BOOST_CHECK_EQUAL(H5CytoFrame(files[2], true).get_keyword("$FIL"), fr.get_keyword("$FIL"));
+
+	//the file replaced outside of cytolib is reopened
+	fr.copy(uvec({0, 1, 2}), true)->write_h5(files[1]);
+	fs::remove(files[2]);
+	fs::copy_file(files[1], files[2]);
+	BOOST_CHECK_EQUAL(H5CytoFrame(files[2], true).n_rows(), 3);
+
+	cache.set_capacity(cap);
+	for(auto f : files)
+	{
+		cache.release(f);
+		fs::remove(f);
+	}
+}
 BOOST_AUTO_TEST_CASE(get_time_step)
 {
 	auto fr1 = MemCytoFrame("../flowWorkspace/output/s5a01.fcs", config);
@@ -253,6 +498,10 @@ BOOST_AUTO_TEST_CASE(h5_vs_mem)
 	//check if h5 version is consistent with mem
 	BOOST_CHECK_EQUAL(fr.get_params().size(), cf_disk->get_params().size());
 	BOOST_CHECK_EQUAL(fr.get_params().begin()->max, cf_disk->get_params().begin()->max);
+	//the in-memory h5 type follows the event data type (float32 when built with CYTOLIB_FLOAT_EVENTS)
+	BOOST_CHECK_EQUAL(fr.h5_datatype_data(DataTypeLocation::MEM).getSize(), sizeof(EVENT_DATA_TYPE));
+	//the events round-trip through h5 (float32 on disk) unchanged in either mode
+	BOOST_CHECK(arma::approx_equal(conv_to<arma::fmat>::from(fr.get_data()), conv_to<arma::fmat>::from(cf_disk->get_data()), "absdiff", 0));
 
 }
 BOOST_AUTO_TEST_CASE(flags)
@@ -409,6 +658,65 @@ BOOST_AUTO_TEST_CASE(subset_by_rows)
 	BOOST_CHECK_EQUAL(cf1->n_rows(), 0);
 	BOOST_CHECK_EQUAL(cf1->n_cols(), 0);
 }
+BOOST_AUTO_TEST_CASE(h5_subset_copy)
+{
+	string tmp = generate_unique_filename(fs::temp_directory_path().string(), "", ".h5");
+	fr.write_h5(tmp);
+	H5CytoFrame cf(tmp, false);
+	vector<string> rn(cf.n_rows());
+	for(unsigned i = 0; i < rn.size(); i++)
+		rn[i] = "r" + to_string(i);
+	cf.set_rownames(rn);
+	cf.set_keyword("$FIL", "subset");//cached meta is carried over without flushing
+	EVENT_DATA_VEC dat = fr.get_data();
+	//unsorted rows with duplicates, reordered columns
+	uvec row_idx = {7, 3, 3, 1000, 5};
+	uvec col_idx = {4, 1, 2};
+	auto cf1 = cf.copy(row_idx, col_idx);
+	EVENT_DATA_VEC dat1 = cf1->get_data();
+	EVENT_DATA_VEC dat_expect = dat.submat(row_idx, col_idx);
+	BOOST_CHECK_EQUAL_COLLECTIONS(dat1.begin(), dat1.end(), dat_expect.begin(), dat_expect.end());
+	auto channels = cf.get_channels();
+	auto channels1 = cf1->get_channels();
+	BOOST_CHECK_EQUAL(channels1.size(), col_idx.size());
+	for(unsigned i = 0; i < col_idx.size(); i++)
+		BOOST_CHECK_EQUAL(channels1[i], channels[col_idx[i]]);
+	BOOST_CHECK_EQUAL(cf1->get_keyword("$FIL"), "subset");
+	auto rn1 = cf1->get_rownames();
+	BOOST_CHECK_EQUAL(rn1.size(), row_idx.size());
+	BOOST_CHECK_EQUAL(rn1[3], "r1000");
+
+	//all rows
+	cf1 = cf.copy(col_idx, false);
+	dat1 = cf1->get_data();
+	dat_expect = dat.cols(col_idx);
+	BOOST_CHECK_EQUAL_COLLECTIONS(dat1.begin(), dat1.end(), dat_expect.begin(), dat_expect.end());
+	BOOST_CHECK_EQUAL(cf1->get_rownames().size(), cf.n_rows());
+	//all columns
+	cf1 = cf.copy(row_idx, true);
+	dat1 = cf1->get_data();
+	dat_expect = dat.rows(row_idx);
+	BOOST_CHECK_EQUAL_COLLECTIONS(dat1.begin(), dat1.end(), dat_expect.begin(), dat_expect.end());
+	BOOST_CHECK_EQUAL(cf1->n_cols(), cf.n_cols());
+
+	//the source chunked by the entire column is copied by the rows within the budget rather than by the whole chunk
+	H5_LAYOUT_PARAM layout;
+	layout.chunk_rows = 0;
+	string tmp1 = generate_unique_filename(fs::temp_directory_path().string(), "", ".h5");
+	fr.write_h5(tmp1, layout);
+	H5CytoFrame cf_col(tmp1, true);
+	auto max_elements = g_h5_copy_max_elements;
+	g_h5_copy_max_elements = 100;
+	auto cf2 = cf_col.copy(col_idx, false);
+	auto cf3 = cf_col.copy(row_idx, col_idx);
+	g_h5_copy_max_elements = max_elements;
+	dat1 = cf2->get_data();
+	dat_expect = dat.cols(col_idx);
+	BOOST_CHECK_EQUAL_COLLECTIONS(dat1.begin(), dat1.end(), dat_expect.begin(), dat_expect.end());
+	dat1 = cf3->get_data();
+	dat_expect = dat.submat(row_idx, col_idx);
+	BOOST_CHECK_EQUAL_COLLECTIONS(dat1.begin(), dat1.end(), dat_expect.begin(), dat_expect.end());
+}
 BOOST_AUTO_TEST_CASE(set_channel)
 {
 	vector<string> channels = fr.get_channels();
@@ -518,6 +826,53 @@ BOOST_AUTO_TEST_CASE(append_columns)
   BOOST_CHECK_EQUAL(fr1.get_keyword("$P" + to_string(fr1.n_cols()-1) + "R"), to_string(new_params[fr1.n_cols()-2].max + 1));
 }
 
+BOOST_AUTO_TEST_CASE(h5_append_columns)
+{
+	string tmp = generate_unique_filename(fs::temp_directory_path().string(), "", ".h5");
+	fr.write_h5(tmp);
+	H5CytoFrame cf(tmp, false);
+	uvec copy_idx = {6, 7};
+	EVENT_DATA_VEC new_cols = fr.get_data(copy_idx, true) * 2;
+	vector<string> new_names = {"new_channel_1", "new_channel_2"};
+	cf.append_columns(new_names, new_cols);
+	BOOST_CHECK_EQUAL(cf.n_cols(), fr.n_cols() + 2);
+	EVENT_DATA_VEC dat = cf.get_data();
+	EVENT_DATA_VEC dat_expect = join_rows(fr.get_data(), new_cols);
+	BOOST_CHECK_EQUAL_COLLECTIONS(dat.begin(), dat.end(), dat_expect.begin(), dat_expect.end());
+	//persisted
+	cf.flush_meta();
+	H5CytoFrame cf1(tmp);
+	BOOST_CHECK_EQUAL(cf1.n_cols(), fr.n_cols() + 2);
+	BOOST_CHECK_EQUAL(cf1.get_channels().back(), new_names[1]);
+	dat = cf1.get_data();
+	BOOST_CHECK_EQUAL_COLLECTIONS(dat.begin(), dat.end(), dat_expect.begin(), dat_expect.end());
+}
+BOOST_AUTO_TEST_CASE(append_events)
+{
+	EVENT_DATA_VEC dat = fr.get_data();
+	unsigned n = fr.n_rows();
+	EVENT_DATA_VEC head = dat.rows(0, n / 2 - 1);
+	EVENT_DATA_VEC tail = dat.rows(n / 2, n - 1);
+	MemCytoFrame fr1 = *fr.copy();
+	fr1.set_data(head);
+	fr1.append_events(tail);
+	EVENT_DATA_VEC dat1 = fr1.get_data();
+	BOOST_CHECK_EQUAL_COLLECTIONS(dat1.begin(), dat1.end(), dat.begin(), dat.end());
+	BOOST_CHECK_EQUAL(fr1.get_keyword("$TOT"), to_string(n));
+	//h5
+	string tmp = generate_unique_filename(fs::temp_directory_path().string(), "", ".h5");
+	fr1.set_data(head);
+	fr1.write_h5(tmp);
+	H5CytoFrame cf(tmp, false);
+	cf.append_events(tail);
+	dat1 = cf.get_data();
+	BOOST_CHECK_EQUAL_COLLECTIONS(dat1.begin(), dat1.end(), dat.begin(), dat.end());
+	H5CytoFrame cf1(tmp);
+	BOOST_CHECK_EQUAL(cf1.n_rows(), n);
+	BOOST_CHECK_EQUAL(cf1.get_keyword("$TOT"), to_string(n));
+	//column mismatch
+	BOOST_CHECK_THROW(cf.append_events(tail.cols(0, 1)), domain_error);
+}
 BOOST_AUTO_TEST_CASE(shallow_copy)
 {
 	CytoFramePtr fr_orig = cf_disk->copy();//create a safe copy to test with by deep copying
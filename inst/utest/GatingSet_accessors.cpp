@@ -1,4 +1,6 @@
 #include <cytolib/GatingSet.hpp>
+#include <cytolib/gate_kernels.hpp>
+#include <cytolib/trans_kernels.hpp>
 #include <experimental/filesystem>
 #include <regex>
 
@@ -18,6 +20,39 @@ struct GSFixture {
 	string path;
 };
 
+/*
+ * the pb files of the two archives are byte-identical
+ * and the h5 files hold the same content (the h5 object headers carry the modification time, so they are compared by content)
+ */
+void check_same_archive(const string & dir1, const string & dir2)
+{
+	CytoVFS vfs{CytoCtx()};
+	for(auto & e : fs::directory_iterator(dir1))
+	{
+		string fn = e.path().filename().string();
+		string f2 = (fs::path(dir2) / fn).string();
+		if(e.path().extension() == ".h5")
+		{
+			H5CytoFrame fr1(e.path().string(), true);
+			H5CytoFrame fr2(f2, true);
+			BOOST_CHECK(arma::approx_equal(fr1.get_data(), fr2.get_data(), "absdiff", 0));
+			auto ch1 = fr1.get_channels();
+			auto ch2 = fr2.get_channels();
+			BOOST_CHECK_EQUAL_COLLECTIONS(ch1.begin(), ch1.end(), ch2.begin(), ch2.end());
+			auto m1 = fr1.get_markers();
+			auto m2 = fr2.get_markers();
+			BOOST_CHECK_EQUAL_COLLECTIONS(m1.begin(), m1.end(), m2.begin(), m2.end());
+			BOOST_CHECK(fr1.get_keywords() == fr2.get_keywords());
+			BOOST_CHECK(fr1.get_pheno_data() == fr2.get_pheno_data());
+			auto rn1 = fr1.get_rownames();
+			auto rn2 = fr2.get_rownames();
+			BOOST_CHECK_EQUAL_COLLECTIONS(rn1.begin(), rn1.end(), rn2.begin(), rn2.end());
+		}
+		else
+			BOOST_CHECK(vfs.read_buf(e.path().string()) == vfs.read_buf(f2));
+	}
+}
+
 BOOST_FIXTURE_TEST_SUITE(GatingSet_test,GSFixture)
 #ifdef HAVE_TILEDB
 
@@ -107,6 +142,594 @@ BOOST_AUTO_TEST_CASE(quadgate) {
 					gh->getNodeProperty(gh->getNodeID("D")).getCounts());
 
 }
+BOOST_AUTO_TEST_CASE(polygon_engine) {
+	//unit square
+	vector<CYTO_POINT> square = {CYTO_POINT(0,0), CYTO_POINT(1,0), CYTO_POINT(1,1), CYTO_POINT(0,1)};
+	//vertices, edges(including the horizontal top/bottom ones), inside and outside
+	vector<EVENT_DATA_TYPE> x = {0, 1, 1, 0, 0.5, 0.5, 1, 0, 0.5, 1.5, -0.5, 0.5, 0.5, 1.5};
+	vector<EVENT_DATA_TYPE> y = {0, 0, 1, 1, 0, 1, 0.5, 0.5, 0.5, 0.5, 0.5, 1.5, -0.5, 1};
+	INDICE_TYPE ind(x.size());
+	iota(ind.begin(), ind.end(), 0);
+	INDICE_TYPE res;
+	in_polygon(x.data(), y.data(), square, ind, false, res);
+	//same as the classic ray casting: the points at the top level stop at the first edge that is not crossed
+	INDICE_TYPE expect = {0, 1, 4, 6, 7, 8};
+	BOOST_CHECK_EQUAL_COLLECTIONS(res.begin(), res.end(), expect.begin(), expect.end());
+	res.clear();
+	in_polygon(x.data(), y.data(), square, ind, true, res);
+	expect = {2, 3, 5, 9, 10, 11, 12, 13};
+	BOOST_CHECK_EQUAL_COLLECTIONS(res.begin(), res.end(), expect.begin(), expect.end());
+
+	//multi-threaded gating preserves the order of parentInd
+	unsigned n = 1e6;
+	x.resize(n);
+	y.resize(n);
+	for(unsigned i = 0; i < n; i++)
+	{
+		x[i] = (i % 1000) / 100.0;
+		y[i] = (i / 1000 % 1000) / 100.0;
+	}
+	vector<CYTO_POINT> poly = {CYTO_POINT(1,1), CYTO_POINT(8,2), CYTO_POINT(5,5), CYTO_POINT(9,9), CYTO_POINT(2,7)};
+	ind.resize(n);
+	iota(ind.rbegin(), ind.rend(), 0);
+	INDICE_TYPE res1, res4;
+	in_polygon(x.data(), y.data(), poly, ind, false, res1);
+	in_polygon(x.data(), y.data(), poly, ind, false, res4, 4);
+	BOOST_CHECK_GT(res1.size(), 0);
+	BOOST_CHECK_EQUAL_COLLECTIONS(res1.begin(), res1.end(), res4.begin(), res4.end());
+}
+BOOST_AUTO_TEST_CASE(parallel_gating) {
+	auto gh = gs.begin()->second;
+	auto cf = MemCytoFrame(*(gh->get_cytoframe_view().get_cytoframe_ptr()));
+	gh->gating(cf, 0, true, true);
+	auto vids = gh->getVertices();
+	vector<vector<unsigned>> ind;
+	for(auto u : vids)
+		ind.push_back(gh->getNodeProperty(u).getIndices_u());
+
+	gh->parallel_gating(cf, 4, true, true);
+	for(unsigned i = 0; i < vids.size(); i++)
+	{
+		auto ind1 = gh->getNodeProperty(vids[i]).getIndices_u();
+		BOOST_CHECK_EQUAL_COLLECTIONS(ind1.begin(), ind1.end(), ind[i].begin(), ind[i].end());
+	}
+}
+BOOST_AUTO_TEST_CASE(parallel_gating_faulty) {
+	GatingSet gs1({"../flowWorkspace/output/s5a01.fcs"}, FCS_READ_PARAM());
+	auto gh = gs1.begin()->second;
+	auto rect = [](vector<coordinate> vertices){
+		shared_ptr<rectGate> g(new rectGate());
+		paramPoly p;
+		p.setName({"FSC-H", "SSC-H"});
+		p.setVertices(vertices);
+		g->setParam(p);
+		return g;
+	};
+	auto boolgate = [](string ref){
+		shared_ptr<boolGate> g(new boolGate());
+		BOOL_GATE_OP op;
+		op.path = {ref};
+		op.op = '&';
+		op.isNot = false;
+		g->boolOpSpec.push_back(op);
+		return g;
+	};
+	auto id = gh->addGate(rect({coordinate(300,0), coordinate(500,400)}), 0, "rect");
+	gh->addGate(rect({coordinate(300,0), coordinate(400,400)}), id, "rect_child");
+	auto bad = rect({coordinate(200,0), coordinate(500,400)});
+	id = gh->addGate(bad, 0, "bad");
+	gh->addGate(rect({coordinate(300,0), coordinate(400,400)}), id, "bad_child");
+	gh->addGate(boolgate("bad"), 0, "ref_bad");
+	auto c1 = boolgate("rect");
+	auto c2 = boolgate("rect");
+	id = gh->addGate(c1, 0, "c1");
+	gh->addGate(c2, 0, "c2");
+	gh->addGate(rect({coordinate(300,0), coordinate(400,400)}), id, "c1_child");
+	auto cf = MemCytoFrame(*(gh->get_cytoframe_view().get_cytoframe_ptr()));
+	gh->parallel_gating(cf, 4, true, true);
+	for(auto u : gh->getVertices())
+		BOOST_CHECK(gh->getNodeProperty(u).isGated());
+
+	//the faulty node, the circular references and the nodes depending on them no longer hold the outdated indices
+	paramPoly p = bad->getParam();
+	p.setVertices({coordinate(200,0), coordinate(500,400), coordinate(500,500)});
+	bad->setParam(p);
+	c1->boolOpSpec[0].path = {"c2"};
+	c2->boolOpSpec[0].path = {"c1"};
+	BOOST_CHECK_THROW(gh->parallel_gating(cf, 4, true, true), domain_error);
+	gh->parallel_gating(cf, 4, true, true, true);
+	for(string pop : {"rect", "rect/rect_child"})
+		BOOST_CHECK(gh->getNodeProperty(gh->getNodeID(pop)).isGated());
+	for(string pop : {"bad", "bad/bad_child", "ref_bad", "c1", "c2", "c1/c1_child"})
+		BOOST_CHECK(!gh->getNodeProperty(gh->getNodeID(pop)).isGated());
+	//they are re-gated once fixed
+	c1->boolOpSpec[0].path = {"rect"};
+	c2->boolOpSpec[0].path = {"rect"};
+	p.setVertices({coordinate(200,0), coordinate(500,400)});
+	bad->setParam(p);
+	auto regated = gh->regate_dirty(cf);
+	BOOST_CHECK_EQUAL(regated.size(), 6);
+	for(auto u : gh->getVertices())
+		BOOST_CHECK(gh->getNodeProperty(u).isGated());
+
+	//regate_dirty leaves the skipped nodes (and the ones referring to them) ungated as well
+	p.setVertices({coordinate(200,0), coordinate(500,400), coordinate(500,500)});
+	bad->setParam(p);
+	gh->mark_dirty(gh->getNodeID("bad"));
+	BOOST_CHECK_THROW(gh->regate_dirty(cf), domain_error);
+	BOOST_CHECK(!gh->getNodeProperty(gh->getNodeID("bad")).isGated());
+	gh->regate_dirty(cf, true, true);
+	for(string pop : {"bad", "bad/bad_child", "ref_bad"})
+	{
+		BOOST_CHECK(!gh->getNodeProperty(gh->getNodeID(pop)).isGated());
+		BOOST_CHECK(gh->getNodeProperty(gh->getNodeID(pop)).isDirty());
+	}
+	for(string pop : {"rect", "rect/rect_child", "c1", "c2", "c1/c1_child"})
+		BOOST_CHECK(gh->getNodeProperty(gh->getNodeID(pop)).isGated());
+	//the terminal bool gates are left ungated (and dirty) without computeTerminalBool
+	p.setVertices({coordinate(200,0), coordinate(500,400)});
+	bad->setParam(p);
+	gh->mark_dirty(0);
+	gh->regate_dirty(cf, false);
+	BOOST_CHECK(gh->getNodeProperty(gh->getNodeID("c1")).isGated());
+	for(string pop : {"c2", "ref_bad"})
+	{
+		BOOST_CHECK(!gh->getNodeProperty(gh->getNodeID(pop)).isGated());
+		BOOST_CHECK(gh->getNodeProperty(gh->getNodeID(pop)).isDirty());
+	}
+}
+BOOST_AUTO_TEST_CASE(event_precision) {
+	//the populations gated (with compensation and transformation) in the precision of the events (float32 with CYTOLIB_FLOAT_EVENTS)
+	//against the ones saved in the archive, which only differ by the events rounded across the gate boundaries
+	auto gh = gs.begin()->second;
+	auto vids = gh->getVertices();
+	vector<vector<unsigned>> saved;
+	for(auto u : vids)
+		saved.push_back(gh->getNodeProperty(u).getIndices_u());
+	auto cf = MemCytoFrame(*(gh->get_cytoframe_view().get_cytoframe_ptr()));
+	gh->gating(cf, 0, true, true);
+	for(unsigned i = 0; i < vids.size(); i++)
+	{
+		auto ind = gh->getNodeProperty(vids[i]).getIndices_u();
+		vector<unsigned> diff;
+		set_symmetric_difference(ind.begin(), ind.end(), saved[i].begin(), saved[i].end(), back_inserter(diff));
+		BOOST_CHECK_LE(diff.size(), 1 + 1e-4 * saved[i].size());
+	}
+}
+BOOST_AUTO_TEST_CASE(regate_dirty) {
+	auto gh = gs.begin()->second;
+	auto cf = MemCytoFrame(*(gh->get_cytoframe_view().get_cytoframe_ptr()));
+	gh->gating(cf, 0, true, true);
+	BOOST_CHECK_EQUAL(gh->get_dirty_nodes().size(), 0);
+	//modify the gate of the first non-bool node that has descendants
+	auto vids = gh->getVertices();
+	VertexID u = 0;
+	for(auto v : vids)
+	{
+		if(v > 0 && gh->getChildren(v).size() > 0 && gh->getNodeProperty(v).getGate()->getType() != BOOLGATE)
+		{
+			u = v;
+			break;
+		}
+	}
+	BOOST_REQUIRE(u > 0);
+	auto g = gh->getNodeProperty(u).getGate()->clone();
+	g->setNegate(!g->isNegate());
+	gh->getNodeProperty(u).setGate(g);
+	//the node and all its descendants are affected, the ones not affected keep their indices
+	auto dirty = gh->get_dirty_nodes();
+	BOOST_CHECK_EQUAL(dirty.front(), u);
+	for(auto v : vids)
+		if(gh->isDescendant(u, v))
+			BOOST_CHECK(find(dirty.begin(), dirty.end(), v) != dirty.end());
+	map<VertexID, vector<unsigned>> ind_old;
+	for(auto v : vids)
+		ind_old[v] = gh->getNodeProperty(v).getIndices_u();
+
+	auto regated = gh->regate_dirty(cf);
+	BOOST_CHECK_EQUAL(regated.size(), dirty.size());
+	BOOST_CHECK_EQUAL(gh->get_dirty_nodes().size(), 0);
+	map<VertexID, vector<unsigned>> ind;
+	for(auto v : vids)
+		ind[v] = gh->getNodeProperty(v).getIndices_u();
+
+	//compared to the full re-gating that also gates each bool gate after its reference nodes
+	gh->parallel_gating(cf, 1, true, true);
+	for(auto v : vids)
+	{
+		auto ind1 = gh->getNodeProperty(v).getIndices_u();
+		BOOST_CHECK_EQUAL_COLLECTIONS(ind1.begin(), ind1.end(), ind[v].begin(), ind[v].end());
+		if(find(dirty.begin(), dirty.end(), v) == dirty.end())
+			BOOST_CHECK_EQUAL_COLLECTIONS(ind1.begin(), ind1.end(), ind_old[v].begin(), ind_old[v].end());
+	}
+	//flagging the root regates the entire tree
+	gh->mark_dirty(0);
+	BOOST_CHECK_EQUAL(gh->regate_dirty(cf).size(), vids.size());
+}
+BOOST_AUTO_TEST_CASE(gating_appended_events) {
+	auto gh = gs.begin()->second;
+	auto cf = MemCytoFrame(*(gh->get_cytoframe_view().get_cytoframe_ptr()));
+	gh->parallel_gating(cf, 1, true, true);
+	auto vids = gh->getVertices();
+	vector<vector<unsigned>> ind;
+	for(auto u : vids)
+		ind.push_back(gh->getNodeProperty(u).getIndices_u());
+	//gate the first half of the events and then stream in the rest
+	EVENT_DATA_VEC dat = cf.get_data();
+	unsigned n = cf.n_rows();
+	auto cf1 = cf;
+	cf1.set_data(EVENT_DATA_VEC(dat.rows(0, n / 2 - 1)));
+	gh->parallel_gating(cf1, 1, true, true);
+	cf1.append_events(dat.rows(n / 2, n - 1));
+	gh->gating_appended_events(cf1);
+	BOOST_CHECK_EQUAL(cf1.n_rows(), n);
+	for(unsigned i = 0; i < vids.size(); i++)
+	{
+		auto ind1 = gh->getNodeProperty(vids[i]).getIndices_u();
+		BOOST_CHECK_EQUAL_COLLECTIONS(ind1.begin(), ind1.end(), ind[i].begin(), ind[i].end());
+	}
+}
+BOOST_AUTO_TEST_CASE(gate_all) {
+	auto samples = gs.get_sample_uids();
+	map<string, vector<vector<unsigned>>> ind;
+	for(auto sn : samples)
+	{
+		auto gh = gs.getGatingHierarchy(sn);
+		auto cf = MemCytoFrame(*(gh->get_cytoframe_view().get_cytoframe_ptr()));
+		gh->gating(cf, 0, true, true);
+		for(auto u : gh->getVertices())
+			ind[sn].push_back(gh->getNodeProperty(u).getIndices_u());
+	}
+	//the budget only admits one sample at a time
+	MemoryBudget budget(1);
+	auto errs = gs.gate_all(4, budget);
+	BOOST_CHECK_EQUAL(errs.size(), 0);
+	BOOST_CHECK_EQUAL(budget.get_peak_count(), 1);
+	for(auto sn : samples)
+	{
+		auto gh = gs.getGatingHierarchy(sn);
+		auto vids = gh->getVertices();
+		for(unsigned i = 0; i < vids.size(); i++)
+		{
+			auto ind1 = gh->getNodeProperty(vids[i]).getIndices_u();
+			BOOST_CHECK_EQUAL_COLLECTIONS(ind1.begin(), ind1.end(), ind[sn][i].begin(), ind[sn][i].end());
+		}
+	}
+	//the subsetted view is charged for both the loaded frame and its realized subset
+	size_t nBytes = 0;
+	for(auto sn : samples)
+	{
+		auto cf_ptr = gs.getGatingHierarchy(sn)->get_cytoframe_view().get_cytoframe_ptr();
+		size_t n = size_t(cf_ptr->n_rows()) * cf_ptr->n_cols() * sizeof(EVENT_DATA_TYPE);
+		if(sn == samples[0])
+		{
+			auto & cfv = gs.getGatingHierarchy(sn)->get_cytoframe_view_ref();
+			cfv.rows_(regspace<uvec>(0, cf_ptr->n_rows() / 2));
+			n *= 2;
+		}
+		nBytes = max(nBytes, n);
+	}
+	MemoryBudget budget1(nBytes);
+	errs = gs.gate_all(4, budget1);
+	BOOST_CHECK_EQUAL(errs.size(), 0);
+	BOOST_CHECK_EQUAL(budget1.get_peak_bytes(), nBytes);
+}
+BOOST_AUTO_TEST_CASE(fast_logicle) {
+	double tol = 1e-6;
+	logicleTrans lt(262144, 0.5, 4.5, 0, false);
+	logicleTrans lt_fast = lt;
+	lt_fast.set_fast(true, tol);
+	//accuracy against the exact evaluation across the linear, logarithmic and out-of-table ranges
+	double err_fwd = 0, err_inv = 0;
+	for(double v = -5000; v < 5000; v += 0.37)
+		err_fwd = max(err_fwd, abs(lt_fast.scale_fast(v) - lt.scale(v)));
+	for(double v = 1; v < 1e8; v *= 1.001)
+		err_fwd = max(err_fwd, abs(lt_fast.scale_fast(v) - lt.scale(v)));
+	for(double x = -0.2; x < 1.5; x += 1e-5)
+		err_inv = max(err_inv, abs(lt_fast.inverse_fast(x) - lt.inverse(x)));
+	BOOST_CHECK_LE(err_fwd, tol);
+	BOOST_CHECK_LE(err_inv, tol);
+	BOOST_CHECK_EQUAL(lt_fast.scale_fast(0), lt.scale(0));
+	//W = 0, where scale() doesn't converge for the tiny values covered by the table
+	logicleTrans lt0(262144, 0, 4.5, 0, false);
+	logicleTrans lt0_fast = lt0;
+	lt0_fast.set_fast(true, tol);
+	err_fwd = 0;
+	for(double v = 1e-3; v < 1e8; v *= 1.001)
+		err_fwd = max(err_fwd, max(abs(lt0_fast.scale_fast(v) - lt0.scale(v)), abs(lt0_fast.scale_fast(-v) - lt0.scale(-v))));
+	BOOST_CHECK_LE(err_fwd, tol);
+	BOOST_CHECK_EQUAL(lt0_fast.scale_fast(0), lt0.scale(0));
+	//transforming
+	unsigned n = 1000000;
+	vector<EVENT_DATA_TYPE> x(n);
+	for(unsigned i = 0; i < n; i++)
+		x[i] = (i % 1000) * 300.0 - 20000;
+	auto y = x, y_fast = x;
+	lt.transforming(y.data(), n);
+	lt_fast.transforming(y_fast.data(), n);
+	double err = 0;
+	for(unsigned i = 0; i < n; i++)
+		err = max(err, abs(double(y_fast[i] - y[i])) - 1e-5 * abs(y[i]));//allow the rounding of float events
+	BOOST_CHECK_LE(err, 4.5 * tol);
+	//the inverse transformation shares the tables
+	auto inv = lt_fast.getInverseTransformation();
+	inv->transforming(y_fast.data(), n);
+	err = 0;
+	for(unsigned i = 0; i < n; i++)
+		err = max(err, abs(double(y_fast[i] - x[i])) - 1e-5 * abs(x[i]));
+	BOOST_CHECK_LE(err, 1e-2);
+}
+BOOST_AUTO_TEST_CASE(batch_trans) {
+	//the batch kernels against the scalar formulas
+	unsigned n = 1000000;
+	vector<EVENT_DATA_TYPE> x(n), x_small(n);
+	for(unsigned i = 0; i < n; i++)
+	{
+		x[i] = (i % 1000) * 300.0 - 20000;
+		x_small[i] = (i % 1000) * 0.003 - 1;
+	}
+	x[1] = 0;
+	auto check = [](string name, transformation & trans, const vector<EVENT_DATA_TYPE> & in, function<double(double)> f){
+		unsigned n = in.size();
+		vector<EVENT_DATA_TYPE> y(n), y_batch = in;
+		for(unsigned i = 0; i < n; i++)
+			y[i] = f(in[i]);
+		trans.transforming(y_batch.data(), n);
+		double err = 0;
+		for(unsigned i = 0; i < n; i++)
+			err = max(err, abs(double(y_batch[i] - y[i])) - 1e-6 * abs(y[i]));//allow the rounding of float events
+		BOOST_CHECK_LE(err, 1e-10);
+	};
+	double ln10 = log(10);
+	fasinhTrans fasinh(262144, 4, 262144, 0.5, 4.5);
+	check("fasinh", fasinh, x, [ln10](double v){return 4 * (asinh(v * sinh(4.5 * ln10) / 262144) + 0.5 * ln10) / (5 * ln10);});
+	fsinhTrans fsinh(262144, 4, 262144, 0.5, 4.5);
+	check("fsinh", fsinh, x_small, [ln10](double v){return sinh(5 * ln10 * v / 4 - 0.5 * ln10) * 262144 / sinh(4.5 * ln10);});
+	logTrans lg(2, 1.5, 3, 262144);
+	check("log", lg, x, [](double v){return v > 0 ? (log10(v) - log10(2)) / 1.5 * 3 : 0;});
+	logInverseTrans lg_inv(2, 1.5, 3, 262144);
+	check("logInverse", lg_inv, x_small, [](double v){return pow(10, v * 1.5 / 3 + log10(2));});
+	logGML2Trans gml2(262144, 4.5);
+	check("logGML2", gml2, x, [](double v){return v > 0 ? (log10(v) - log10(262144)) / 4.5 + 1 : 100;});//the non-positive values are imputed by the smallest positive one
+	logGML2InverseTrans gml2_inv(262144, 4.5);
+	check("logGML2Inverse", gml2_inv, x_small, [](double v){return pow(10, v * 4.5 - 4.5 + log10(262144));});
+	flinTrans flin(-100, 262144);
+	check("flin", flin, x, [](double v){return (v - 100) / (262144 - 100);});
+	scaleTrans sc(EVENT_DATA_TYPE(2.5));
+	check("scale", sc, x, [](double v){return v * 2.5;});
+	//sinh keeps the relative accuracy near zero
+	vector<EVENT_DATA_TYPE> x_zero;
+	for(double v = 1e-12; v < 3; v *= 1.1)
+	{
+		x_zero.push_back(v);
+		x_zero.push_back(-v);
+	}
+	auto y_zero = x_zero;
+	batch_sinh_affine(y_zero.data(), y_zero.size(), 1, 0, 1);
+	double rel_err = 0;
+	for(unsigned i = 0; i < x_zero.size(); i++)
+		rel_err = max(rel_err, abs(y_zero[i] - sinh(double(x_zero[i]))) / abs(sinh(double(x_zero[i]))));
+	BOOST_CHECK_LE(rel_err, 4 * numeric_limits<EVENT_DATA_TYPE>::epsilon());
+	//the error thrown by the parallel blocks is propagated to the caller
+	g_trans_num_threads = 4;
+	logicleTrans lt(262144, 0.5, 4.5, 0, false);
+	auto x_nan = x;
+	x_nan[n / 2] = numeric_limits<EVENT_DATA_TYPE>::quiet_NaN();
+	BOOST_CHECK_THROW(lt.transforming(x_nan.data(), n), const char *);
+	g_trans_num_threads = 1;
+}
+BOOST_AUTO_TEST_CASE(spline_bucket_index) {
+	biexpTrans bt;
+	bt.computCalTbl();
+	bt.interpolate();
+	auto tbl = bt.getCalTbl();
+	unsigned n = 1000000;
+	vector<EVENT_DATA_TYPE> x(n);
+	for(unsigned i = 0; i < n; i++)
+		x[i] = ((i * 7919) % 1000) * 300.0 - 20000 + (i % 13) * 0.1;//unsorted
+	x[1] = numeric_limits<EVENT_DATA_TYPE>::quiet_NaN();
+	x[2] = numeric_limits<EVENT_DATA_TYPE>::infinity();
+	x[3] = -1e30;
+	auto y = x, y_idx = x;
+	spline_eval(2, y.data(), n, tbl.getX(), tbl.getY(), tbl.getB(), tbl.getC(), tbl.getD());
+	tbl.transforming(y_idx.data(), n);
+	BOOST_CHECK(isnan(y_idx[1]));
+	for(unsigned i = 2; i < n; i++)
+		BOOST_REQUIRE_EQUAL(y_idx[i], y[i]);
+}
+BOOST_AUTO_TEST_CASE(gate_kernels) {
+	unsigned n = 1e6;
+	vector<EVENT_DATA_TYPE> x(n), y(n);
+	for(unsigned i = 0; i < n; i++)
+	{
+		x[i] = (i % 1000) / 100.0;
+		y[i] = (i / 1000 % 1000) / 100.0;
+	}
+	x[1] = numeric_limits<EVENT_DATA_TYPE>::quiet_NaN();
+	INDICE_TYPE root(n), sub;
+	iota(root.begin(), root.end(), 0);
+	for(unsigned i = 0; i < n; i += 3)
+		sub.push_back(i);
+	BOOST_CHECK(is_dense_indices(root, n));
+	BOOST_CHECK(!is_dense_indices(sub, n));
+	//the ellipse centered at (5, 4) with the semi-axes 3 and 2 rotated by 30 degrees
+	double theta = M_PI / 6, ct = cos(theta), st = sin(theta);
+	double a2 = 9, b2 = 4;
+	ELLIPSE_QUADRATIC_FORM q;
+	q.mux = 5;
+	q.muy = 4;
+	q.qxx = ct * ct / a2 + st * st / b2;
+	q.qxy = 2 * ct * st * (1 / a2 - 1 / b2);
+	q.qyy = st * st / a2 + ct * ct / b2;
+	q.bound = 1;
+	for(auto neg : {false, true})
+		for(auto parentInd : {root, sub})
+		{
+			bool is_dense = is_dense_indices(parentInd, n);
+			INDICE_TYPE expect_range, expect_ellipse;
+			for(auto i : parentInd)
+			{
+				bool isIn = x[i] <= 7.5 && x[i] >= 2.5;
+				if(isIn != neg)
+					expect_range.push_back(i);
+			}
+			for(auto i : parentInd)
+			{
+				//in the precision of the event data
+				EVENT_DATA_TYPE dx = x[i] - EVENT_DATA_TYPE(q.mux);
+				EVENT_DATA_TYPE dy = y[i] - EVENT_DATA_TYPE(q.muy);
+				bool isIn = dx * (EVENT_DATA_TYPE(q.qxx) * dx + EVENT_DATA_TYPE(q.qxy) * dy) + EVENT_DATA_TYPE(q.qyy) * dy * dy <= EVENT_DATA_TYPE(q.bound);
+				if(isIn != neg)
+					expect_ellipse.push_back(i);
+			}
+			for(int nThreads : {1, 4})
+			{
+				INDICE_TYPE res_range, res_ellipse;
+				in_range(x.data(), 2.5, 7.5, parentInd, is_dense, neg, res_range, nThreads);
+				in_ellipse(x.data(), y.data(), q, parentInd, is_dense, neg, res_ellipse, nThreads);
+				BOOST_CHECK_EQUAL_COLLECTIONS(res_range.begin(), res_range.end(), expect_range.begin(), expect_range.end());
+				BOOST_CHECK_EQUAL_COLLECTIONS(res_ellipse.begin(), res_ellipse.end(), expect_ellipse.begin(), expect_ellipse.end());
+			}
+		}
+}
+BOOST_AUTO_TEST_CASE(rect_kernel) {
+	unsigned n = 1e6;
+	vector<EVENT_DATA_TYPE> x(n), y(n);
+	for(unsigned i = 0; i < n; i++)
+	{
+		x[i] = (i % 1000) / 100.0;
+		y[i] = (i / 1000 % 1000) / 100.0;
+	}
+	x[1] = numeric_limits<EVENT_DATA_TYPE>::quiet_NaN();
+	INDICE_TYPE root(n), sub;
+	iota(root.begin(), root.end(), 0);
+	for(unsigned i = 0; i < n; i += 3)
+		sub.push_back(i);
+	//the events on the bounds are the ones distinguishing the open bounds
+	EVENT_DATA_TYPE xMin = 2.5, xMax = 7.5, yMin = 3, yMax = 6;
+	//the plain rectGate, then the quadrants Q1 - Q4
+	for(int quad = 0; quad <= 4; quad++)
+	{
+		RECT_BOUNDS b = {xMin, xMax, yMin, yMax, quad == Q2, quad == Q4, quad == Q1, quad == Q3};
+		for(auto neg : {false, true})
+			for(auto parentInd : {root, sub})
+			{
+				//the scalar loop of the legacy rectGate::gating
+				INDICE_TYPE expect;
+				for(auto i : parentInd)
+				{
+					bool inX, inY;
+					switch(quad)
+					{
+						case Q1:
+							inX=x[i]<=xMax&&x[i]>=xMin;
+							inY=y[i]<=yMax&&y[i]>yMin;
+							break;
+						case Q2:
+							inX=x[i]<=xMax&&x[i]>xMin;
+							inY=y[i]<=yMax&&y[i]>=yMin;
+							break;
+						case Q3:
+							inX=x[i]<=xMax&&x[i]>=xMin;
+							inY=y[i]<yMax&&y[i]>=yMin;
+							break;
+						case Q4:
+							inX=x[i]<xMax&&x[i]>=xMin;
+							inY=y[i]<=yMax&&y[i]>=yMin;
+							break;
+						default:
+							inX=x[i]<=xMax&&x[i]>=xMin;
+							inY=y[i]<=yMax&&y[i]>=yMin;
+					}
+					if((inX&&inY) != neg)
+						expect.push_back(i);
+				}
+				for(int nThreads : {1, 4})
+				{
+					INDICE_TYPE res;
+					in_rect(x.data(), y.data(), b, parentInd, is_dense_indices(parentInd, n), neg, res, nThreads);
+					BOOST_CHECK_EQUAL_COLLECTIONS(res.begin(), res.end(), expect.begin(), expect.end());
+				}
+			}
+	}
+}
+BOOST_AUTO_TEST_CASE(multi_range_kernel) {
+	unsigned n = 1e6;
+	vector<EVENT_DATA_TYPE> x(n);
+	for(unsigned i = 0; i < n; i++)
+		x[i] = (i * 7919 % 100000) / 10.0;
+	x[1] = numeric_limits<EVENT_DATA_TYPE>::quiet_NaN();
+	INDICE_TYPE parentInd;
+	for(unsigned i = 0; i < n; i += 2)
+		parentInd.push_back(i);
+	for(unsigned nRange : {1, 4, 16, 64, 256, 1024})
+	{
+		//the ranges of width 2 evenly spread over [0, 10000)
+		vector<pair<float, float>> ranges;
+		for(unsigned k = 0; k < nRange; k++)
+		{
+			float lo = k * 10000.0 / nRange;
+			ranges.push_back({lo, lo + 2});
+		}
+		for(auto neg : {false, true})
+		{
+			INDICE_TYPE expect, res;
+			for(auto i : parentInd)
+			{
+				bool isIn = false;
+				for(const auto & region : ranges)
+				{
+					isIn = x[i] <= region.second && x[i] >= region.first;
+					if(isIn)
+						break;
+				}
+				if(isIn != neg)
+					expect.push_back(i);
+			}
+			in_ranges(x.data(), ranges, parentInd, false, neg, res);
+			BOOST_CHECK_EQUAL_COLLECTIONS(res.begin(), res.end(), expect.begin(), expect.end());
+		}
+	}
+}
+BOOST_AUTO_TEST_CASE(event_bitmap) {
+	unsigned n = 1000001;
+	vector<bool> a(n), b(n);
+	for(unsigned i = 0; i < n; i++)
+	{
+		a[i] = i % 3 == 0;
+		b[i] = i % 7 < 3;
+	}
+	EventBitmap A(a), B(b);
+	BOOST_CHECK_EQUAL(A.count(), count(a.begin(), a.end(), true));
+	//and not
+	vector<bool> r = b;
+	r.flip();
+	transform(r.begin(), r.end(), a.begin(), r.begin(), logical_and<bool>());
+	EventBitmap R = B;
+	R.flip();
+	R &= A;
+	BOOST_CHECK(R.to_bool() == r);
+	BOOST_CHECK_EQUAL(R.count(), count(r.begin(), r.end(), true));
+	//or
+	r = a;
+	transform(r.begin(), r.end(), b.begin(), r.begin(), logical_or<bool>());
+	R = A;
+	R |= B;
+	BOOST_CHECK(R.to_bool() == r);
+	auto ind = R.to_indices();
+	BOOST_CHECK(EventBitmap(ind, n).to_bool() == r);
+
+	//same bytes as pb::POPINDICES
+	vector<unsigned char> bytes((n + 7) / 8, 0);
+	packToBytes(a, bytes);
+	string s = A.to_bytes();
+	BOOST_CHECK(s == string(bytes.begin(), bytes.end()));
+	pb::POPINDICES ind_pb;
+	BOOLINDICES(a).convertToPb(ind_pb);
+	BOOLINDICES A1(ind_pb);
+	BOOST_CHECK(A1.getIndices() == a);
+	BOOST_CHECK_EQUAL(A1.getCount(), A.count());
+}
 BOOST_AUTO_TEST_CASE(serialize) {
 	GatingSet gs1 = gs.copy();
 	/*
@@ -143,6 +766,82 @@ BOOST_AUTO_TEST_CASE(serialize) {
 	BOOST_CHECK_EQUAL(cf2.get_pheno_data().find(pdn)->second, pdv);
 
 }
+BOOST_AUTO_TEST_CASE(lazy_load) {
+	GatingSet gs1(path, false, true, {}, false, CytoCtx(), true);
+	GatingSet gs2(path, false, true, {}, false);
+	auto samples = gs2.get_sample_uids();
+	auto samples1 = gs1.get_sample_uids();
+	BOOST_CHECK_EQUAL(gs1.size(), gs2.size());
+	BOOST_CHECK_EQUAL_COLLECTIONS(samples1.begin(), samples1.end(), samples.begin(), samples.end());
+	//iterating only loads the samples that are dereferenced
+	auto it = gs1.begin();
+	for(auto sn : samples1)
+		BOOST_CHECK(!gs1.is_loaded(sn));
+	string sn = it->first;
+	BOOST_CHECK(gs1.is_loaded(sn));
+	BOOST_CHECK_EQUAL(it->second, gs1.getGatingHierarchy(sn));
+	for(auto sn1 : samples1)
+		if(sn1 != sn)
+			BOOST_CHECK(!gs1.is_loaded(sn1));
+	//load on demand from multiple threads
+	vector<GatingHierarchyPtr> ghs(samples.size() * 2);
+	#pragma omp parallel for num_threads(4)
+	for(unsigned i = 0; i < ghs.size(); i++)
+		ghs[i] = gs1.getGatingHierarchy(samples[i % samples.size()]);
+	for(unsigned i = 0; i < samples.size(); i++)
+	{
+		BOOST_CHECK_EQUAL(ghs[i], ghs[i + samples.size()]);//loaded once
+		auto gh1 = ghs[i];
+		auto gh2 = gs2.getGatingHierarchy(samples[i]);
+		auto paths1 = gh1->getNodePaths(REGULAR, true, true);
+		auto paths2 = gh2->getNodePaths(REGULAR, true, true);
+		BOOST_CHECK_EQUAL_COLLECTIONS(paths1.begin(), paths1.end(), paths2.begin(), paths2.end());
+		BOOST_CHECK_EQUAL(gh1->getNodeProperty(1).getStats(true)["count"], gh2->getNodeProperty(1).getStats(true)["count"]);
+		auto ch1 = gh1->get_channels();
+		auto ch2 = gh2->get_channels();
+		BOOST_CHECK_EQUAL_COLLECTIONS(ch1.begin(), ch1.end(), ch2.begin(), ch2.end());
+	}
+	//the copies share the loaded samples
+	auto gs3 = gs1.sub_samples({samples[0]});
+	BOOST_CHECK_EQUAL(gs3.getGatingHierarchy(samples[0]), ghs[0]);
+}
+BOOST_AUTO_TEST_CASE(parallel_serialize) {
+	GatingSet gs1(path, false, true, {}, false);
+	string tmp1 = generate_unique_dir(fs::temp_directory_path().c_str(), "gs");
+	string tmp2 = generate_unique_dir(fs::temp_directory_path().c_str(), "gs");
+	gs1.serialize_pb(tmp1, CytoFileOption::copy);
+	gs1.serialize_pb(tmp2, CytoFileOption::copy, false, CytoCtx(), 4);
+	//the archives are the same
+	check_same_archive(tmp1, tmp2);
+
+	GatingSet gs2(tmp2, false, true, {}, false, CytoCtx(), false, 4);
+	auto samples1 = gs1.get_sample_uids();
+	auto samples2 = gs2.get_sample_uids();
+	BOOST_CHECK_EQUAL_COLLECTIONS(samples1.begin(), samples1.end(), samples2.begin(), samples2.end());
+	for(auto & sn : samples1)
+	{
+		auto paths1 = gs1.getGatingHierarchy(sn)->getNodePaths(REGULAR, true, true);
+		auto paths2 = gs2.getGatingHierarchy(sn)->getNodePaths(REGULAR, true, true);
+		BOOST_CHECK_EQUAL_COLLECTIONS(paths1.begin(), paths1.end(), paths2.begin(), paths2.end());
+	}
+}
+BOOST_AUTO_TEST_CASE(parallel_serialize_mem) {
+	//the in-memory frames are written to h5 by the workers concurrently
+	GatingSet gs1(path, false, true, {}, false);
+	for(auto & sn : gs1.get_sample_uids())
+	{
+		auto gh = gs1.getGatingHierarchy(sn);
+		gh->set_cytoframe_view(CytoFrameView(CytoFramePtr(new MemCytoFrame(*(gh->get_cytoframe_view().get_cytoframe_ptr())))));
+	}
+	string tmp1 = generate_unique_dir(fs::temp_directory_path().c_str(), "gs");
+	string tmp2 = generate_unique_dir(fs::temp_directory_path().c_str(), "gs");
+	gs1.serialize_pb(tmp1, CytoFileOption::copy);
+	gs1.serialize_pb(tmp2, CytoFileOption::copy, false, CytoCtx(), 4);
+	check_same_archive(tmp1, tmp2);
+	GatingSet gs2(tmp2, false, true, {}, false, CytoCtx(), false, 4);
+	for(auto & sn : gs1.get_sample_uids())
+		BOOST_CHECK(arma::approx_equal(gs1.get_cytoframe_view(sn).get_data(), gs2.get_cytoframe_view(sn).get_data(), "absdiff", 0));
+}
 BOOST_AUTO_TEST_CASE(get_cytoset) {
 	GatingSet cs = gs.get_cytoset();
 	BOOST_CHECK_EQUAL(cs.get_sample_uids().size(), gs.size());
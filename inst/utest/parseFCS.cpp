@@ -1,9 +1,48 @@
 #include <cytolib/MemCytoFrame.hpp>
 #include <cytolib/H5CytoFrame.hpp>
+#include <cytolib/GatingSet.hpp>
 #include "fixture.hpp"
 #include <cytolib/global.hpp>
+#include <random>
 using namespace cytolib;
 
+/*
+ * the legacy per-element conversion of the FCS data section (the type and width are dispatched for each element),
+ * which is kept as the reference of the specialized decoders
+ */
+EVENT_DATA_TYPE legacy_decode_element(const char * src, bool isInteger, int thisSize, bool isbyteswap)
+{
+	char p[8];
+	memcpy(p, src, thisSize);
+	if(isbyteswap)
+		std::reverse(p, p + thisSize);
+	if(isInteger)
+	{
+		switch(thisSize)
+		{
+		case sizeof(BYTE):
+			return static_cast<EVENT_DATA_TYPE>(*p);
+		case sizeof(unsigned short):
+			return static_cast<EVENT_DATA_TYPE>(*reinterpret_cast<unsigned short *>(p));
+		case sizeof(unsigned):
+			return static_cast<EVENT_DATA_TYPE>(*reinterpret_cast<unsigned *>(p));
+		case sizeof(uint64_t):
+			return static_cast<EVENT_DATA_TYPE>(*reinterpret_cast<uint64_t *>(p));
+		}
+	}
+	else
+	{
+		switch(thisSize)
+		{
+		case sizeof(float):
+			return *reinterpret_cast<float *>(p);
+		case sizeof(double):
+			return static_cast<EVENT_DATA_TYPE>(*reinterpret_cast<double *>(p));
+		}
+	}
+	throw(range_error("unsupported byte width"));
+}
+
 BOOST_FIXTURE_TEST_SUITE(parseFCS,parseFCSFixture)
 BOOST_AUTO_TEST_CASE(sample_1071)
 {
@@ -212,6 +251,109 @@ BOOST_AUTO_TEST_CASE(samples_F1)
 	BOOST_CHECK_EQUAL(cytofrm.n_rows(), 1000000);
 	BOOST_CHECK_CLOSE(cytofrm.get_data()[1], 60981.75, 1e-6);
 
+	//buffered read should give the same events as the default memory-mapped one
+	config.data.use_mmap = false;
+	MemCytoFrame cytofrm1(filename.c_str(), config);
+	cytofrm1.read_fcs();
+	BOOST_CHECK(arma::approx_equal(cytofrm.get_data(), cytofrm1.get_data(), "absdiff", 0));
+
+}
+BOOST_AUTO_TEST_CASE(decode_speed)
+{
+	//the specialized decoders produce the identical output to the legacy per-element loop for each (type, width, byteswap)
+	size_t nrow = 1 << 20;
+	unsigned nCol = 4;
+	vector<pair<bool, int>> types = {{true, 1}, {true, 2}, {true, 4}, {true, 8}, {false, 4}, {false, 8}};
+	mt19937 gen(1);
+	for(auto t : types)
+		for(bool isbyteswap : {false, true})
+		{
+			bool isInteger = t.first;
+			int width = t.second;
+			size_t stride = width * nCol;
+			vector<char> raw(nrow * stride);
+			for(auto & b : raw)
+				b = static_cast<char>(gen());
+			arma::Mat<EVENT_DATA_TYPE> ref(nrow, nCol), res(nrow, nCol);
+			double start = gettime();
+			for(unsigned c = 0; c < nCol; c++)
+				for(size_t r = 0; r < nrow; r++)
+					ref(r, c) = legacy_decode_element(raw.data() + r * stride + c * width, isInteger, width, isbyteswap);
+			double t_legacy = gettime() - start;
+			auto decode = isbyteswap ? get_fcs_decode_func<true>(isInteger, width) : get_fcs_decode_func<false>(isInteger, width);
+			start = gettime();
+			for(unsigned c = 0; c < nCol; c++)
+				decode(raw.data() + c * width, stride, nrow, res.colptr(c));
+			double t_decode = gettime() - start;
+			//compared bitwise since the random bytes of the floating types include NaN
+			BOOST_CHECK_EQUAL(memcmp(ref.memptr(), res.memptr(), ref.n_elem * sizeof(EVENT_DATA_TYPE)), 0);
+			cout << (isInteger ? "I" : "F") << width * 8 << (isbyteswap ? " byteswap" : "") << " speedup: " << t_legacy / t_decode << endl;
+		}
+
+	//the blocked decoding is independent of the number of threads
+	string filename="../flowWorkspace/wsTestSuite/McGill/Treg/samples_F1.fcs";
+	FCS_READ_PARAM config;
+	MemCytoFrame cytofrm(filename.c_str(), config);
+	cytofrm.read_fcs();
+	config.data.num_threads = 4;
+	MemCytoFrame cytofrm1(filename.c_str(), config);
+	cytofrm1.read_fcs();
+	BOOST_CHECK(arma::approx_equal(cytofrm.get_data(), cytofrm1.get_data(), "absdiff", 0));
+	for(unsigned i = 0; i < cytofrm.n_cols(); i++)
+		BOOST_CHECK_EQUAL(cytofrm.get_params()[i].min, cytofrm1.get_params()[i].min);
+}
+BOOST_AUTO_TEST_CASE(stream_to_h5)
+{
+	string filename="../flowWorkspace/wsTestSuite/McGill/Treg/samples_F1.fcs";
+	FCS_READ_PARAM config;
+	MemCytoFrame cytofrm(filename.c_str(), config);
+	cytofrm.read_fcs();
+
+	//decode into h5 in small chunks
+	config.data.stream_chunk_size = 1e4;
+	config.h5_layout.chunk_rows = 3000;
+	string h5file = generate_unique_filename(fs::temp_directory_path().string(), "", ".h5");
+	H5CytoFrame h5fr(filename, config, h5file);
+	BOOST_CHECK_EQUAL(h5fr.n_rows(), 1000000);
+	BOOST_CHECK(arma::approx_equal(arma::conv_to<arma::fmat>::from(cytofrm.get_data()), arma::conv_to<arma::fmat>::from(h5fr.get_data()), "absdiff", 0));
+	BOOST_CHECK_EQUAL(h5fr.get_params()[1].min, cytofrm.get_params()[1].min);
+	BOOST_CHECK_EQUAL(h5fr.get_keyword("flowCore_$P2Rmax"), cytofrm.get_keyword("flowCore_$P2Rmax"));
+
+	//the chunk of the entire column is still written by the bounded chunks of events
+	config.h5_layout.chunk_rows = 0;
+	h5file = generate_unique_filename(fs::temp_directory_path().string(), "", ".h5");
+	H5CytoFrame h5fr1(filename, config, h5file);
+	BOOST_CHECK_EQUAL(h5fr1.get_layout().chunk_rows, 1000000);
+	BOOST_CHECK(arma::approx_equal(arma::conv_to<arma::fmat>::from(cytofrm.get_data()), arma::conv_to<arma::fmat>::from(h5fr1.get_data()), "absdiff", 0));
+
+	//the compressed chunk of the entire column is decoded in memory instead
+	config.h5_layout.deflate = 1;
+	h5file = generate_unique_filename(fs::temp_directory_path().string(), "", ".h5");
+	H5CytoFrame h5fr2(filename, config, h5file);
+	BOOST_CHECK_EQUAL(h5fr2.get_layout().deflate, 1);
+	BOOST_CHECK(arma::approx_equal(arma::conv_to<arma::fmat>::from(cytofrm.get_data()), arma::conv_to<arma::fmat>::from(h5fr2.get_data()), "absdiff", 0));
+}
+BOOST_AUTO_TEST_CASE(parallel_add_fcs)
+{
+	vector<pair<string,string>> files;
+	for(auto i : {"s3", "s1", "s2", "s4"})
+		files.push_back(make_pair(i, "../flowWorkspace/wsTestSuite/curlyQuad/example1/A1001.001.fcs"));
+	FCS_READ_PARAM config;
+	GatingSet gs(files, config);
+	config.num_threads = 4;
+	GatingSet gs1(files, config);
+
+	//samples are attached in the input order regardless of which thread finishes first
+	auto samples = gs1.get_sample_uids();
+	auto samples_serial = gs.get_sample_uids();
+	BOOST_CHECK_EQUAL_COLLECTIONS(samples.begin(), samples.end(), samples_serial.begin(), samples_serial.end());
+	BOOST_CHECK_EQUAL(samples[0], "s3");
+	for(auto s : samples)
+		BOOST_CHECK(arma::approx_equal(gs.get_cytoframe_view(s).get_data(), gs1.get_cytoframe_view(s).get_data(), "absdiff", 0));
+
+	//errors are reported after all workers finish
+	files.push_back(make_pair("s5", "nonexist.fcs"));
+	BOOST_CHECK_THROW(GatingSet(files, config), domain_error);
 }
 BOOST_AUTO_TEST_CASE(truncated_data_section)
 {
@@ -1,6 +1,7 @@
 // Copyright 2019 Fred Hutchinson Cancer Research Center
 // See the included LICENSE file for details on the licence that is granted to the user of this software.
 #include <cytolib/CytoFrame.hpp>
+#include <cytolib/H5FileCache.hpp>
 
 
 namespace cytolib
@@ -82,47 +83,34 @@ namespace cytolib
 	 * R*t(X) == t(Q)*t(A) (Q orthogonal)
 	 * that can now be solved efficiently for t(X) by back substitution, then transposed for X
 	 */
-	void CytoFrame::compensate(const compensation& comp) {
+	void CytoFrame::get_compensation_idx(const compensation & comp, arma::uvec & marker_idx, arma::uvec & detector_idx) const{
 	  int nMarker = comp.marker.size();
-	  EVENT_DATA_VEC dat = get_data();
-	  arma::uvec indices(nMarker);
+	  marker_idx.set_size(nMarker);
 	  for (int i = 0; i < nMarker; i++) {
 	    int id = get_col_idx(comp.marker[i], ColType::channel);
 	    if (id < 0)
 	      throw(std::domain_error("compensation parameter '" + comp.marker[i] +
              "' not found in cytoframe parameters!"));
 	    
-	    indices[i] = id;
+	    marker_idx[i] = id;
 	  }
 	  int nDetector = comp.detector.size();
-	  arma::uvec indices_detector(nDetector);
+	  detector_idx.set_size(nDetector);
 	  for (int i = 0; i < nDetector; i++) {
 	    int id = get_col_idx(comp.detector[i], ColType::channel);
 	    if (id < 0)
-	      throw(std::domain_error("compensation parameter '" + comp.marker[i] +
+	      throw(std::domain_error("compensation parameter '" + comp.detector[i] +
              "' not found in cytoframe parameters!"));
 	    
-	    indices_detector[i] = id;
+	    detector_idx[i] = id;
 	  }
-	  arma::mat A(dat.memptr(), n_rows(), n_cols(), false,
-               true);  // point to the original data
-	  // Try to avoid extra memory burden from copies by performing
-	  // all of these transpositions in-place
-	  inplace_trans(A);
-	  arma::mat B = comp.get_spillover_mat();
-	  // B.print("comp");
-	  inplace_trans(B); //B is marker by detector 
-	  arma::mat Q;
-	  arma::mat R;
-	  qr_econ(Q, R, B);
-	  inplace_trans(Q);
-	  // Assign to rows representing t(X)
-	  // Note: trimatu to tell Armadillo that R is upper-triangular
-	  // so it goes straight to back-substitution
-	  A.rows(indices) = solve(trimatu(R), Q * A.rows(indices_detector));
-	  // Need to transpose A back to proper orientation
-	  //(which also takes care of transposing t(X) back to X)
-	  inplace_trans(A);
+	}
+
+	void CytoFrame::compensate(const compensation& comp) {
+	  arma::uvec indices, indices_detector;
+	  get_compensation_idx(comp, indices, indices_detector);
+	  EVENT_DATA_VEC dat = get_data();
+	  comp.apply(dat, indices, indices_detector, g_comp_num_threads);
 	  set_data(dat);
 	}
 
@@ -248,6 +236,17 @@ namespace cytolib
 
 	}
 
+	void CytoFrame::append_events(const EVENT_DATA_VEC & new_events){
+		if(new_events.n_cols != n_cols())
+			throw(domain_error("New events must have same number of columns as the existing events."));
+		append_data_rows(new_events);
+		if(keys_.find("$TOT") != keys_.end())
+		{
+			set_keyword("$TOT", to_string(n_rows()));
+			flush_meta();
+		}
+	}
+
 //	void writeFCS(const string & filename);
 
 	FloatType CytoFrame::h5_datatype_data(DataTypeLocation storage_type) const
@@ -259,7 +258,7 @@ namespace cytolib
 			return datatype;
 		}
 		else
-			return FloatType(PredType::NATIVE_DOUBLE);
+			return FloatType(sizeof(EVENT_DATA_TYPE) == sizeof(float) ? PredType::NATIVE_FLOAT : PredType::NATIVE_DOUBLE);
 	}
 	CompType CytoFrame::get_h5_datatype_params(DataTypeLocation storage_type) const
 	{
@@ -373,14 +372,82 @@ namespace cytolib
 		auto keyVec = to_kw_vec<PDATA>(pheno_data_);
 		ds.write(&keyVec[0], key_type );
 
+	}
+	void H5_LAYOUT_PARAM::get_chunk_dims(hsize_t nCol, hsize_t nEvents, hsize_t * chunk_dims) const
+	{
+		chunk_dims[0] = layout == H5Layout::tile ? min(tile_cols, nCol) : 1;
+		chunk_dims[1] = chunk_rows == 0 ? nEvents : min(chunk_rows, nEvents);
+		//h5 doesn't allow zero-sized chunk
+		chunk_dims[0] = max<hsize_t>(chunk_dims[0], 1);
+		chunk_dims[1] = max<hsize_t>(chunk_dims[1], 1);
+	}
+
+	DSetCreatPropList H5_LAYOUT_PARAM::get_plist(hsize_t nCol, hsize_t nEvents) const
+	{
+		DSetCreatPropList plist;
+		hsize_t	chunk_dims[2];
+		get_chunk_dims(nCol, nEvents, chunk_dims);
+		plist.setChunk(2, chunk_dims);
+		if(shuffle)
+			plist.setShuffle();
+		if(deflate > 0)
+			plist.setDeflate(deflate);
+		return plist;
+	}
+
+	void H5_LAYOUT_PARAM::save(DataSet & dataset) const
+	{
+		StrType str_type(H5::PredType::C_S1, H5T_VARIABLE);
+		Attribute attr = dataset.createAttribute(ATTR_LAYOUT, str_type, DataSpace(H5S_SCALAR));
+		attr.write(str_type, H5std_string(layout == H5Layout::tile ? "tile" : "column"));
+	}
+
+	void H5_LAYOUT_PARAM::load(const DataSet & dataset)
+	{
+		hsize_t	chunk_dims[2] = {1, 0};
+		auto plist = dataset.getCreatePlist();
+		if(plist.getLayout() == H5D_CHUNKED)
+			plist.getChunk(2, chunk_dims);
+		//files written before the layout was recorded are always column-chunked
+		layout = H5Layout::column;
+		if(dataset.attrExists(ATTR_LAYOUT))
+		{
+			StrType str_type(H5::PredType::C_S1, H5T_VARIABLE);
+			H5std_string val;
+			dataset.openAttribute(ATTR_LAYOUT).read(str_type, val);
+			if(val == "tile")
+				layout = H5Layout::tile;
+		}
+		tile_cols = chunk_dims[0];
+		chunk_rows = chunk_dims[1];
+		deflate = 0;
+		shuffle = false;
+		for(int i = 0; i < plist.getNfilters(); i++)
+		{
+			unsigned flags, cd_values[1] = {0}, filter_config;
+			size_t cd_nelmts = 1;
+			char name[64];
+			auto filter = plist.getFilter(i, flags, cd_nelmts, cd_values, sizeof(name), name, filter_config);
+			if(filter == H5Z_FILTER_DEFLATE)
+				deflate = cd_values[0];
+			else if(filter == H5Z_FILTER_SHUFFLE)
+				shuffle = true;
+		}
 	}
 		/**
 	 * save the CytoFrame as HDF5 format
 	 *
 	 * @param filename the path of the output H5 file
 	 */
-	void CytoFrame::write_h5(const string & filename) const
+	void CytoFrame::write_h5(const string & filename, const H5_LAYOUT_PARAM & layout) const
 	{
+		//get the events before locking so that the in-memory copies of the concurrent writers are not serialized
+		EVENT_DATA_VEC dat = get_data();
+		auto rn = get_rownames();
+		//hdf5 lib is not thread-safe
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		//the file can't be truncated while it is still opened by the cache
+		H5FileCache::instance().release(filename);
 		H5File file( filename, H5F_ACC_TRUNC );
 
 		write_h5_params(file);
@@ -396,22 +463,18 @@ namespace cytolib
 		*/
 		unsigned nEvents = n_rows();
 		hsize_t dimsf[2] = {n_cols(), nEvents};              // dataset dimensions
-		DSetCreatPropList plist;
-		hsize_t	chunk_dims[2] = {1, (nEvents > 0 ? nEvents : 1)};
-		plist.setChunk(2, chunk_dims);
-	//	plist.setFilter()
+		DSetCreatPropList plist = layout.get_plist(dimsf[0], dimsf[1]);
 		hsize_t dim_max[] = {H5S_UNLIMITED, H5S_UNLIMITED};
 
 		DataSpace dataspace( 2, dimsf, dim_max);
 		DataSet dataset = file.createDataSet( DATASET_NAME, h5_datatype_data(DataTypeLocation::H5), dataspace, plist);
+		layout.save(dataset);
 		/*
 		* Write the data to the dataset using default memory space, file
 		* space, and transfer properties.
 		*/
-		EVENT_DATA_VEC dat = get_data();
 		dataset.write(dat.mem, h5_datatype_data(DataTypeLocation::MEM));
 
-		auto rn = get_rownames();
 		write_h5_rownames(file, rn);
 	}
 
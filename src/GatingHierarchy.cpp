@@ -8,6 +8,8 @@
 #include <boost/graph/breadth_first_search.hpp>
 #include <boost/graph/depth_first_search.hpp>
 #include <boost/filesystem.hpp>
+#include <atomic>
+#include <functional>
 namespace fs = boost::filesystem;
 
 namespace cytolib
@@ -77,18 +79,13 @@ namespace cytolib
 
 
 
-	/**
-	 * compensate the data by the spillover provided by workspace
-	 * or FCS TEXT keyword
-	 * add prefix (e.g. Comp_ or <>) to channel name of the data
-	 */
-	void GatingHierarchy::compensate(CytoFrame & cytoframe)
+	bool GatingHierarchy::resolve_compensation(CytoFrame & cytoframe)
 	{
 		if(comp.cid == "-2" || comp.cid == "")
 		{
 			if(g_loglevel>=GATING_HIERARCHY_LEVEL)
 				PRINT("No compensation\n");
-			return;
+			return false;
 		}
 		else if(comp.cid == "-1")
 		{
@@ -103,12 +100,11 @@ namespace cytolib
 			//this scenario may never occur so we won't bother the fix it until it bites us
 
 		}
+		return true;
+	}
 
-		if(g_loglevel>=GATING_HIERARCHY_LEVEL)
-			PRINT("Compensating...\n");
-
-		cytoframe.compensate(comp);
-
+	void GatingHierarchy::prefix_compensated_channels(CytoFrame & cytoframe)
+	{
 		if(g_loglevel>=GATING_HIERARCHY_LEVEL)
 			PRINT("start prefixing data columns\n");
 
@@ -116,9 +112,38 @@ namespace cytolib
 		{
 			cytoframe.set_channel(old, comp.prefix + old + comp.suffix);
 		}
+	}
 
+	/**
+	 * compensate the data by the spillover provided by workspace
+	 * or FCS TEXT keyword
+	 * add prefix (e.g. Comp_ or <>) to channel name of the data
+	 */
+	void GatingHierarchy::compensate(CytoFrame & cytoframe)
+	{
+		if(!resolve_compensation(cytoframe))
+			return;
+
+		if(g_loglevel>=GATING_HIERARCHY_LEVEL)
+			PRINT("Compensating...\n");
 
+		cytoframe.compensate(comp);
 
+		prefix_compensated_channels(cytoframe);
+	}
+
+	UNMIX_STATS GatingHierarchy::compensate(CytoFrame & cytoframe, const UNMIX_PARAM & param)
+	{
+		if(!resolve_compensation(cytoframe))
+			return UNMIX_STATS();
+
+		if(g_loglevel>=GATING_HIERARCHY_LEVEL)
+			PRINT("Unmixing...\n");
+
+		UNMIX_STATS stats = SpectralUnmixer(comp, param).unmix(cytoframe);
+
+		prefix_compensated_channels(cytoframe);
+		return stats;
 	}
 
 
@@ -213,18 +238,20 @@ namespace cytolib
 				{
 
 
-					vector<bool> curIndices;
-					curIndices=boolGating(cytoframe, u, computeTerminalBool);
+					EventBitmap curIndices=boolGatingBitmap(cytoframe, u, computeTerminalBool);
 					//combine with parent indices
 					VertexID pid=getParent(u);
 					nodeProperties & parentNode =getNodeProperty(pid);
 
-					transform (curIndices.begin(), curIndices.end(), parentNode.getIndices().begin(), curIndices.begin(),logical_and<bool>());
+					curIndices &= parentNode.getBitmap();
 					node.setIndices(curIndices);
 				}
 				else
 				{
 //					cout << computeTerminalBool << " : " << getChildren(u).size() <<  " : " << g->getType() << endl;
+					//the terminal bool gate is left ungated (and dirty) instead of keeping the outdated indices
+					if(node.isGated())
+						node.resetIndices();
 					return;
 				}
 
@@ -233,13 +260,12 @@ namespace cytolib
 			}
 		case LOGICALGATE://skip any gating operation since the indice is already set once the gate is added
 		case CLUSTERGATE:{
-		  auto curIndices = node.getIndices();
-		  std::transform(curIndices.begin(), curIndices.end(),
-                   parentIndice.getIndices().begin(), curIndices.begin(),
-                   std::logical_and<bool>());
-		  
+		  auto curIndices = node.getBitmap();
+		  curIndices &= parentIndice.getBitmap();
+
 		  node.setIndices(curIndices);
 		  node.computeStats();
+		  node.setDirtyFlag(false);
 		}
 			
 			return;
@@ -255,6 +281,7 @@ namespace cytolib
 
 
 		node.computeStats();
+		node.setDirtyFlag(false);
 	}
 
 	void GatingHierarchy::extendGate(MemCytoFrame & cytoframe, float extend_val){
@@ -278,7 +305,10 @@ namespace cytolib
 					if(g_loglevel>=POPULATION_LEVEL)
 						PRINT(node.getName()+"\n");
 					if(g->getType()!=BOOLGATE)
+					{
 						g->extend(cytoframe,extend_val);
+						node.setDirtyFlag(true);
+					}
 				}
 			}
 	}
@@ -452,6 +482,7 @@ namespace cytolib
 		{
 			boost::remove_edge(pid_old, cid, tree);
 			boost::add_edge(pid, cid, tree);
+			mark_dirty(cid);
 
 		}
 
@@ -469,6 +500,7 @@ namespace cytolib
 			comp.prefix = prefix;
 			comp.suffix = suffix;
 		}
+		mark_dirty(0);
 	}
 	void GatingHierarchy::set_compensation(compensation && _comp, bool is_update_prefix)
 	{
@@ -480,6 +512,7 @@ namespace cytolib
 			comp.prefix = _comp.prefix;
 			comp.suffix = _comp.suffix;
 		}
+		mark_dirty(0);
 	}
 	void GatingHierarchy::printLocalTrans(){
 		PRINT("\nget trans from gating hierarchy\n");
@@ -523,7 +556,10 @@ namespace cytolib
 					if(g_loglevel>=POPULATION_LEVEL)
 						PRINT(node.getName()+"\n");
 					if(g->getType()!=BOOLGATE)
+					{
 						g->extend(extend_val,extend_to);
+						node.setDirtyFlag(true);
+					}
 				}
 			}
 	}
@@ -549,7 +585,10 @@ namespace cytolib
 					if(g_loglevel>=POPULATION_LEVEL)
 						PRINT(node.getName()+"\n");
 					if(g->getType()!=BOOLGATE)
+					{
 						g->gain(gains);
+						node.setDirtyFlag(true);
+					}
 				}
 			}
 	}
@@ -592,7 +631,10 @@ namespace cytolib
 						curlyGate.interpolate(trans1);//the interpolated polygon is in raw scale
 					}
 					if(gateType!=BOOLGATE)
+					{
 						g->transforming(trans1);
+						node.setDirtyFlag(true);
+					}
 
 				}
 			}
@@ -621,7 +663,10 @@ namespace cytolib
 						PRINT(node.getName()+"\n");
 					unsigned short gateType= g->getType();
 					if(gateType!=BOOLGATE && gateType!=CLUSTERGATE && gateType!=LOGICALGATE)
+					{
 						g->shiftGate();
+						node.setDirtyFlag(true);
+					}
 
 				}
 			}
@@ -659,7 +704,7 @@ namespace cytolib
 			if(!node.isGated())
 				gating(cytoframe, pid, recompute, computeTerminalBool, skip_faulty_node);
 
-			parentIndice = INTINDICES(node.getIndices());
+			parentIndice = INTINDICES(node.getIndices_u(), node.getTotal());
 
 		}
 
@@ -677,6 +722,7 @@ namespace cytolib
 		{
 			node.setIndices(cytoframe.n_rows());
 			node.computeStats();
+			node.setDirtyFlag(false);
 		}else
 		{
 			/*
@@ -720,6 +766,459 @@ namespace cytolib
 		}
 
 	}
+	void GatingHierarchy::parallel_gating(MemCytoFrame & cytoframe, int num_threads, bool recompute, bool computeTerminalBool, bool skip_faulty_node)
+	{
+		unsigned nNodes = boost::num_vertices(tree);
+		if(nNodes == 0)
+			return;
+		/*
+		 * build the dependency graph: each node waits for its parent and the reference nodes of its bool gate
+		 */
+		vector<VertexID_vec> dependents(nNodes);
+		unique_ptr<atomic<unsigned>[]> nDeps(new atomic<unsigned>[nNodes]);
+		unique_ptr<atomic<unsigned>[]> nChildrenLeft(new atomic<unsigned>[nNodes]);
+		for(VertexID u = 0; u < nNodes; u++)
+		{
+			nDeps[u] = 0;
+			nChildrenLeft[u] = boost::out_degree(u, tree);
+		}
+		for(VertexID u = 1; u < nNodes; u++)
+		{
+			dependents[getParent(u)].push_back(u);
+			nDeps[u]++;
+			nodeProperties & node = getNodeProperty(u);
+			gatePtr g = node.getGate();
+			if(g && g->getType() == BOOLGATE && (recompute || !node.isGated()))
+			{
+				for(const auto & op : g->getBoolSpec())
+				{
+					VertexID refID;
+					try{
+						refID = getRefNodeID(u, op.path);
+					}
+					catch(const std::exception &)
+					{
+						continue;//leave it to calgate to report the invalid reference
+					}
+					if(refID != u)
+					{
+						dependents[refID].push_back(u);
+						nDeps[u]++;
+					}
+				}
+			}
+		}
+
+		//whether the descendants of the node are to be gated (i.e. the node is gated without error)
+		vector<char> is_ok(nNodes, false);
+		vector<char> is_visited(nNodes, false);
+		//the parent indices shared by the children, released once all of them are gated
+		vector<unique_ptr<INTINDICES>> parentIndices(nNodes);
+		atomic<bool> is_aborted(false);
+		string errMsg;
+		//discard the outdated result of the node that is not gated by this call
+		function<void(VertexID)> run = [&](VertexID u){
+			try{
+				if(!is_aborted)
+				{
+					nodeProperties & node = getNodeProperty(u);
+					is_visited[u] = true;
+					if(u == 0)
+					{
+						node.setIndices(cytoframe.n_rows());
+						node.computeStats();
+						node.setDirtyFlag(false);
+						is_ok[u] = true;
+					}
+					else
+					{
+						VertexID pid = getParent(u);
+						if(is_ok[pid])
+						{
+							bool isFaulty = false;
+							if(recompute||!node.isGated())
+							{
+								try{
+									/*
+									 * the reference nodes are gated by their own tasks,
+									 * so instead of gating them recursively, the bool gate fails when they are not available
+									 */
+									gatePtr g = node.getGate();
+									if(g && g->getType() == BOOLGATE && (computeTerminalBool||getChildren(u).size()>0))
+									{
+										for(const auto & op : g->getBoolSpec())
+										{
+											VertexID refID = getRefNodeID(u, op.path);
+											//the reference node that fails (or is skipped) by this call may still hold its outdated indices
+											if(refID != u && (is_visited[refID] ? !is_ok[refID] : !getNodeProperty(refID).isGated()))
+												throw(domain_error("The reference node is not gated: " + getNodePath(refID)));
+										}
+									}
+									calgate(cytoframe, u, computeTerminalBool, *parentIndices[pid]);
+								}
+								catch(const std::exception & e)
+								{
+									isFaulty = true;
+									invalidate_node(u);
+									if(skip_faulty_node)
+									{
+										PRINT(e.what());
+										auto path = getNodePath(u, false);
+										PRINT("\n Skipping the faulty node '" + path + "' and its descendants \n");
+									}
+									else
+										throw;
+								}
+							}
+							is_ok[u] = !isFaulty && node.isGated();
+						}
+						else
+							invalidate_node(u);//the descendant of the faulty node
+						if(--nChildrenLeft[pid] == 0)
+							parentIndices[pid].reset();
+					}
+					if(is_ok[u] && nChildrenLeft[u] > 0)
+						parentIndices[u].reset(new INTINDICES(node.getIndices_u(), node.getTotal()));
+				}
+			}
+			catch(const std::exception & e)
+			{
+				#pragma omp critical(parallel_gating_error)
+				if(!is_aborted)
+				{
+					errMsg = e.what();
+					is_aborted = true;
+				}
+			}
+			//schedule the nodes that no longer wait for any other node
+			for(VertexID v : dependents[u])
+			{
+				if(--nDeps[v] == 0)
+				{
+					#pragma omp task firstprivate(v)
+					run(v);
+				}
+			}
+		};
+
+		#pragma omp parallel num_threads(max(1, num_threads))
+		#pragma omp single
+		run(0);
+
+		if(is_aborted)
+		{
+			//the nodes left behind are outdated
+			if(recompute)
+				for(VertexID u = 1; u < nNodes; u++)
+					if(!is_visited[u])
+						invalidate_node(u);
+			throw(domain_error(errMsg));
+		}
+		/*
+		 * the nodes that are never scheduled, i.e. the ones in the circular references among bool gates
+		 * and the ones (e.g. descendants) that depend on them
+		 */
+		VertexID_vec unscheduled;
+		for(VertexID u = 1; u < nNodes; u++)
+		{
+			if(nDeps[u] > 0)
+			{
+				unscheduled.push_back(u);
+				invalidate_node(u);
+			}
+		}
+		string errCircular;
+		for(VertexID u : unscheduled)
+		{
+			//whether the node depends on itself
+			bool is_circular = false;
+			vector<char> is_reached(nNodes, false);
+			VertexID_vec stack(dependents[u]);
+			while(!stack.empty() && !is_circular)
+			{
+				VertexID v = stack.back();
+				stack.pop_back();
+				if(v == u)
+					is_circular = true;
+				else if(!is_reached[v])
+				{
+					is_reached[v] = true;
+					stack.insert(stack.end(), dependents[v].begin(), dependents[v].end());
+				}
+			}
+			string msg;
+			if(is_circular)
+			{
+				msg = "The node is not gated due to the circular references among boolean gates: " + getNodePath(u);
+				if(errCircular.empty())
+					errCircular = msg;
+			}
+			else
+				msg = "Skipping the node '" + getNodePath(u) + "' that depends on the circular references among boolean gates";
+			if(skip_faulty_node)
+				PRINT(msg + "\n");
+		}
+		if(!skip_faulty_node && !errCircular.empty())
+			throw(domain_error(errCircular));
+	}
+	void GatingHierarchy::get_bool_refs(vector<VertexID_vec> & refs, vector<VertexID_vec> & referrers)
+	{
+		unsigned nNodes = boost::num_vertices(tree);
+		refs.assign(nNodes, VertexID_vec());
+		referrers.assign(nNodes, VertexID_vec());
+		for(VertexID u = 1; u < nNodes; u++)
+		{
+			gatePtr g = getNodeProperty(u).getGate();
+			if(g && g->getType() == BOOLGATE)
+			{
+				for(const auto & op : g->getBoolSpec())
+				{
+					VertexID refID;
+					try{
+						refID = getRefNodeID(u, op.path);
+					}
+					catch(const std::exception &)
+					{
+						continue;//leave it to calgate to report the invalid reference
+					}
+					if(refID != u)
+					{
+						refs[u].push_back(refID);
+						referrers[refID].push_back(u);
+					}
+				}
+			}
+		}
+	}
+
+	VertexID_vec GatingHierarchy::sort_by_dependency(const VertexID_vec & nodes, const vector<VertexID_vec> & refs)
+	{
+		unsigned nNodes = boost::num_vertices(tree);
+		vector<char> is_selected(nNodes, false);
+		for(VertexID u : nodes)
+			is_selected[u] = true;
+		VertexID_vec res;
+		vector<char> state(nNodes, 0);//0: not visited, 1: in progress, 2: done
+		function<void(VertexID)> visit = [&](VertexID u){
+			if(state[u] == 2)
+				return;
+			if(state[u] == 1)
+				throw(domain_error("circular references among boolean gates: " + getNodePath(u)));
+			state[u] = 1;
+			VertexID_vec deps = refs[u];
+			if(u > 0)
+				deps.push_back(getParent(u));
+			for(VertexID v : deps)
+				if(is_selected[v])
+					visit(v);
+			state[u] = 2;
+			res.push_back(u);
+		};
+		for(VertexID u : nodes)
+			visit(u);
+		return res;
+	}
+
+	VertexID_vec GatingHierarchy::get_dirty_nodes()
+	{
+		unsigned nNodes = boost::num_vertices(tree);
+		vector<VertexID_vec> refs, referrers;
+		get_bool_refs(refs, referrers);
+		/*
+		 * propagate from the dirty nodes to the children and the referencing bool gates
+		 */
+		vector<char> is_affected(nNodes, false);
+		VertexID_vec affected;
+		for(VertexID u = 0; u < nNodes; u++)
+			if(getNodeProperty(u).isDirty())
+			{
+				is_affected[u] = true;
+				affected.push_back(u);
+			}
+		for(unsigned i = 0; i < affected.size(); i++)
+		{
+			VertexID u = affected[i];
+			VertexID_vec next = getChildren(u);
+			next.insert(next.end(), referrers[u].begin(), referrers[u].end());
+			for(VertexID v : next)
+				if(!is_affected[v])
+				{
+					is_affected[v] = true;
+					affected.push_back(v);
+				}
+		}
+		return sort_by_dependency(affected, refs);
+	}
+
+	void GatingHierarchy::invalidate_node(VertexID u)
+	{
+		nodeProperties & node = getNodeProperty(u);
+		gatePtr g = node.getGate();
+		if(g && (g->getType() == LOGICALGATE || g->getType() == CLUSTERGATE))
+			node.setDirtyFlag(true);
+		else
+			node.resetIndices();
+	}
+
+	VertexID_vec GatingHierarchy::regate_dirty(MemCytoFrame & cytoframe, bool computeTerminalBool, bool skip_faulty_node)
+	{
+		VertexID_vec nodes = get_dirty_nodes();
+		VertexID_vec res;
+		unsigned nNodes = boost::num_vertices(tree);
+		vector<VertexID_vec> refs, referrers;
+		get_bool_refs(refs, referrers);
+		//the nodes that are not gated by this call (and thus neither are their descendants and referrers)
+		vector<char> is_skipped(nNodes, false);
+		auto skip = [&](VertexID u){
+			is_skipped[u] = true;
+			invalidate_node(u);
+		};
+		//the parent indices shared by the siblings
+		map<VertexID, INTINDICES> parentIndices;
+		for(VertexID u : nodes)
+		{
+			nodeProperties & node = getNodeProperty(u);
+			if(u == 0)
+			{
+				node.setIndices(cytoframe.n_rows());
+				node.computeStats();
+				node.setDirtyFlag(false);
+				res.push_back(u);
+				continue;
+			}
+			VertexID pid = getParent(u);
+			nodeProperties & parentNode = getNodeProperty(pid);
+			bool is_ref_skipped = false;
+			for(VertexID refID : refs[u])
+				if(is_skipped[refID])
+					is_ref_skipped = true;
+			if(is_skipped[pid] || !parentNode.isGated() || is_ref_skipped)
+			{
+				skip(u);
+				continue;
+			}
+			auto it = parentIndices.find(pid);
+			if(it == parentIndices.end())
+				it = parentIndices.emplace(pid, INTINDICES(parentNode.getIndices_u(), parentNode.getTotal())).first;
+			try{
+				calgate(cytoframe, u, computeTerminalBool, it->second);
+			}
+			catch(const std::exception & e)
+			{
+				if(skip_faulty_node)
+				{
+					PRINT(e.what());
+					auto path = getNodePath(u, false);
+					PRINT("\n Skipping the faulty node '" + path + "' and its descendants \n");
+					skip(u);
+					continue;
+				}
+				else
+				{
+					invalidate_node(u);
+					throw(domain_error(e.what()));
+				}
+			}
+			//e.g. the terminal bool gate when computeTerminalBool is false
+			if(!getNodeProperty(u).isGated())
+			{
+				is_skipped[u] = true;
+				continue;
+			}
+			res.push_back(u);
+		}
+		return res;
+	}
+	void GatingHierarchy::gating_appended_events(MemCytoFrame & cytoframe, bool computeTerminalBool, bool skip_faulty_node)
+	{
+		nodeProperties & root = getNodeProperty(0);
+		if(!root.isGated())
+			throw(domain_error("The gating hierarchy is not gated yet!"));
+		unsigned nOld = root.getTotal();
+		unsigned nEvents = cytoframe.n_rows();
+		if(nEvents < nOld)
+			throw(domain_error("The data has less events than the ones already gated!"));
+		if(nEvents == nOld)
+			return;
+
+		vector<VertexID_vec> refs, referrers;
+		get_bool_refs(refs, referrers);
+		VertexID_vec nodes = sort_by_dependency(getVertices(), refs);
+		unsigned nNodes = boost::num_vertices(tree);
+		vector<char> is_skipped(nNodes, false);
+		//the new events of the parents shared by the siblings
+		map<VertexID, INDICE_TYPE> parentIndices;
+		for(VertexID u : nodes)
+		{
+			nodeProperties & node = getNodeProperty(u);
+			if(u == 0)
+			{
+				node.setIndices(nEvents);
+				node.computeStats();
+				continue;
+			}
+			VertexID pid = getParent(u);
+			nodeProperties & parentNode = getNodeProperty(pid);
+			//the nodes that were not gated (e.g. the terminal bool gates) are left as they are
+			if(is_skipped[pid] || !node.isGated() || parentNode.getTotal() != nEvents)
+			{
+				is_skipped[u] = true;
+				continue;
+			}
+			try{
+				gatePtr g = node.getGate();
+				if(g==NULL)
+					throw(domain_error("no gate available for this node"));
+				switch(g->getType())
+				{
+				case BOOLGATE:
+					{
+						//the reference nodes are updated before
+						for(VertexID refID : refs[u])
+							if(is_skipped[refID] || !getNodeProperty(refID).isGated() || getNodeProperty(refID).getTotal() != nEvents)
+								throw(domain_error("The reference node is not gated: " + getNodePath(refID)));
+						EventBitmap curIndices = boolGatingBitmap(cytoframe, u, computeTerminalBool);
+						curIndices &= parentNode.getBitmap();
+						node.setIndices(curIndices);
+						break;
+					}
+				case LOGICALGATE:
+				case CLUSTERGATE:
+					{
+						node.setIndices(node.getIndices_u(), nEvents);
+						break;
+					}
+				default:
+					{
+						auto it = parentIndices.find(pid);
+						if(it == parentIndices.end())
+						{
+							INDICE_TYPE pind = parentNode.getIndices_u();
+							pind.erase(pind.begin(), lower_bound(pind.begin(), pind.end(), nOld));
+							it = parentIndices.emplace(pid, pind).first;
+						}
+						INDICE_TYPE newIndices = g->gating(cytoframe, it->second);
+						INDICE_TYPE curIndices = node.getIndices_u();
+						curIndices.insert(curIndices.end(), newIndices.begin(), newIndices.end());
+						node.setIndices(curIndices, nEvents);
+					}
+				}
+				node.computeStats();
+			}
+			catch(const std::exception & e)
+			{
+				if(skip_faulty_node)
+				{
+					PRINT(e.what());
+					auto path = getNodePath(u, false);
+					PRINT("\n Skipping the faulty node '" + path + "' and its descendants \n");
+					is_skipped[u] = true;
+				}
+				else
+					throw(domain_error(e.what()));
+			}
+		}
+	}
 	/*
 	 * bool gating operates on the indices of reference nodes
 	 * because they are global, thus needs to be combined with parent indices
@@ -729,6 +1228,9 @@ namespace cytolib
 	 */
 
 	vector<bool> GatingHierarchy::boolGating(MemCytoFrame & cytoframe, VertexID u, bool computeTerminalBool){
+		return boolGatingBitmap(cytoframe, u, computeTerminalBool).to_bool();
+	}
+	EventBitmap GatingHierarchy::boolGatingBitmap(MemCytoFrame & cytoframe, VertexID u, bool computeTerminalBool){
 
 		nodeProperties & node=getNodeProperty(u);
 		gatePtr  g=node.getGate();
@@ -740,13 +1242,13 @@ namespace cytolib
 		/*it is kinda of expensive to init a long bool vector
 		 *
 		 */
-		vector<bool> ind;
+		EventBitmap ind;
 		/*
 		 * combine the indices of reference populations
 		 */
 
 		vector<BOOL_GATE_OP> boolOpSpec=g->getBoolSpec();
-		for(vector<BOOL_GATE_OP>::iterator it=boolOpSpec.begin();it!=boolOpSpec.end();it++)
+		for(vector<BOOL_GATE_OP>::const_iterator it=boolOpSpec.begin();it!=boolOpSpec.end();it++)
 		{
 			/*
 			 * find id of reference node
@@ -773,7 +1275,7 @@ namespace cytolib
 				gating(cytoframe, nodeID, true, computeTerminalBool);
 			}
 
-			vector<bool> curPopInd=curPop.getIndices();
+			EventBitmap curPopInd=curPop.getBitmap();
 			if(it->isNot)
 				curPopInd.flip();
 
@@ -788,10 +1290,10 @@ namespace cytolib
 				switch(it->op)
 				{
 					case '&':
-						transform (ind.begin(), ind.end(), curPopInd.begin(), ind.begin(),logical_and<bool>());
+						ind &= curPopInd;
 						break;
 					case '|':
-						transform (ind.begin(), ind.end(), curPopInd.begin(), ind.begin(),logical_or<bool>());
+						ind |= curPopInd;
 						break;
 					default:
 						throw(domain_error("not supported operator!"));
@@ -816,14 +1318,17 @@ namespace cytolib
 	 * @return
 	 */
 	vector<bool> GatingHierarchy::boolGating(MemCytoFrame & cytoframe, vector<BOOL_GATE_OP> boolOpSpec, bool computeTerminalBool){
+		return boolGatingBitmap(cytoframe, boolOpSpec, computeTerminalBool).to_bool();
+	}
+	EventBitmap GatingHierarchy::boolGatingBitmap(MemCytoFrame & cytoframe, const vector<BOOL_GATE_OP> & boolOpSpec, bool computeTerminalBool){
 
-		vector<bool> ind;
+		EventBitmap ind;
 		/*
 		 * combine the indices of reference populations
 		 */
 
 
-		for(vector<BOOL_GATE_OP>::iterator it=boolOpSpec.begin();it!=boolOpSpec.end();it++)
+		for(vector<BOOL_GATE_OP>::const_iterator it=boolOpSpec.begin();it!=boolOpSpec.end();it++)
 		{
 			/*
 			 * find id of reference node
@@ -845,7 +1350,7 @@ namespace cytolib
 				gating(cytoframe, nodeID, true, computeTerminalBool);
 			}
 
-			vector<bool> curPopInd=curPop.getIndices();
+			EventBitmap curPopInd=curPop.getBitmap();
 			if(it->isNot)
 				curPopInd.flip();
 
@@ -860,10 +1365,10 @@ namespace cytolib
 				switch(it->op)
 				{
 					case '&':
-						transform (ind.begin(), ind.end(), curPopInd.begin(), ind.begin(),logical_and<bool>());
+						ind &= curPopInd;
 						break;
 					case '|':
-						transform (ind.begin(), ind.end(), curPopInd.begin(), ind.begin(),logical_or<bool>());
+						ind |= curPopInd;
 						break;
 					default:
 						throw(domain_error("not supported operator!"));
@@ -5,22 +5,71 @@
 #include <cytolib/MemCytoFrame.hpp>
 #include <cytolib/cytolibConfig.h>
 #include <boost/filesystem.hpp>
+#include <mutex>
+#include <condition_variable>
 namespace fs = boost::filesystem;
 
 
 namespace cytolib
 {
+	GatingHierarchyPtr GatingHierarchyLoader::load(const string & sample_uid) const
+	{
+		if(is_remote_path(path_))
+			PRINT("loading GatingHierarchy: " + sample_uid + " \n");
+		string gh_pb_file = (fs::path(path_) / sample_uid).string() + ".pb";
+
+		pb::GatingHierarchy gh_pb;
+		CytoVFS vfs(ctx_);
+		auto buf = vfs.read_buf(gh_pb_file);
+
+		 google::protobuf::io::ArrayInputStream raw_input(buf.data(), buf.size());
+		 //read gs message
+		 bool success = readDelimitedFrom(raw_input, gh_pb);
+
+		if (!success) {
+			throw(domain_error("Failed to parse GatingHierarchy " + sample_uid));
+		}
+
+		string uri = (fs::path(path_) / (sample_uid + cf_ext_)).string();
+		return GatingHierarchyPtr(new GatingHierarchy(ctx_, gh_pb, uri, is_skip_data_, readonly_));
+	}
+
+	GatingHierarchyPtr GatingHierarchyLoader::materialize(GatingHierarchyPtr & gh, const string & sample_uid)
+	{
+		lock_guard<mutex> guard(mutex_);
+		if(!gh)
+		{
+			//reuse the one loaded by the other copies of the GatingSet
+			gh = loaded_[sample_uid].lock();
+			if(!gh)
+			{
+				gh = load(sample_uid);
+				loaded_[sample_uid] = gh;
+			}
+		}
+		return gh;
+	}
+
+	void GatingSet::load_all() const
+	{
+		if(loader_)
+			for(auto & it : ghs_)
+				loader_->materialize(it.second, it.first);
+	}
+
 	GatingHierarchyPtr GatingSet::get_first_gh() const
 	{
 		if(size() == 0)
 			throw(range_error("Empty GatingSet!"));
-		return begin()->second;
+		return getGatingHierarchy(ghs_.begin()->first);
 	}
 	GatingSet::GatingSet(string path, bool is_skip_data
 			, bool readonly
 			, vector<string> select_samples
 			, bool print_lib_ver
-			, CytoCtx ctx):ctx_(ctx)
+			, CytoCtx ctx
+			, bool lazy
+			, int num_threads):ctx_(ctx)
 	{
 
 		string errmsg = "Not a valid GatingSet archiving folder! " + path + "\n";
@@ -155,34 +204,50 @@ namespace cytolib
 				}
 			}
 			//read gating hierarchy messages
+			auto loader = make_shared<GatingHierarchyLoader>(path, "." + fmt_to_str(fmt), ctx_, is_skip_data, readonly);
+			vector<string> samples;
 			for(int i = 0; i < nTotal; i++){
 				string sn = pbGS.samplename(i);
 
 				//conditional add gh
 				if(nSelect==0||sn_hash.find(sn)->second)
+					samples.push_back(sn);
+			}
+			int nSample = samples.size();
+			if(lazy)
+			{
+				for(const string & sn : samples)
 				{
-					if(is_remote_path(path))
-						PRINT("loading GatingHierarchy: " + sn + " \n");
-					string gh_pb_file = (fs::path(path) / sn).string() + ".pb";
-
-					pb::GatingHierarchy gh_pb;
-					auto buf = vfs.read_buf(gh_pb_file);
-
-					 google::protobuf::io::ArrayInputStream raw_input(buf.data(), buf.size());
-					 //read gs message
-					 bool success = readDelimitedFrom(raw_input, gh_pb);
-
-					if (!success) {
-						throw(domain_error("Failed to parse GatingHierarchy " + sn));
+					check_sample_guid(sn);
+					ghs_[sn] = nullptr;
+					sample_names_.push_back(sn);
+				}
+				loader_ = loader;
+			}
+			else
+			{
+				/*
+				 * the samples are loaded concurrently and then added in order,
+				 * the first error (in the order of the samples) is rethrown
+				 */
+				vector<GatingHierarchyPtr> ghs(nSample);
+				vector<exception_ptr> errors(nSample);
+				#pragma omp parallel for schedule(dynamic) num_threads(max(1, num_threads))
+				for(int i = 0; i < nSample; i++)
+				{
+					try{
+						ghs[i] = loader->load(samples[i]);
+					}
+					catch(...)
+					{
+						errors[i] = current_exception();
 					}
-
-					pb::CytoFrame fr = *gh_pb.mutable_frame();
-
-					string uri;
-					auto cf_ext = "." + fmt_to_str(fmt);
-					uri = (fs::path(path) / (sn + cf_ext)).string();
-					add_GatingHierarchy(GatingHierarchyPtr(new GatingHierarchy(ctx_, gh_pb, uri, is_skip_data, readonly)), sn);
-
+				}
+				for(int i = 0; i < nSample; i++)
+				{
+					if(errors[i])
+						rethrow_exception(errors[i]);
+					add_GatingHierarchy(ghs[i], samples[i]);
 				}
 			}
 
@@ -205,7 +270,8 @@ namespace cytolib
 	void GatingSet::serialize_pb(string path
 			, CytoFileOption cf_opt
 			, bool is_skip_data
-			, const CytoCtx & ctx)
+			, const CytoCtx & ctx
+			, int num_threads)
 	{
 
 		string errmsg = "Not a valid GatingSet archiving folder! " + path + "\n";
@@ -242,7 +308,7 @@ namespace cytolib
 					else if(ext == ".h5"||ext == ".pb")
 					{
 						string sample_uid = p.stem().string();
-						if(find(sample_uid) == end())
+						if(ghs_.find(sample_uid) == ghs_.end())
 						  throw(domain_error(errmsg + "file not matched to any sample in GatingSet: " + p.string()));
 						else
 						{
@@ -327,34 +393,48 @@ namespace cytolib
 		//write each gh as a separate message to stream due to the pb message size limit
 		//we now go one step further to save each message to individual file
 		//due to the single string buffer used by lite-message won't be enough to hold the all samples for large dataset
-		for(auto & sn : sample_names)
+		//the samples are written to their own files concurrently, the first error (in the order of the samples) is rethrown
+		int nSample = sample_names.size();
+		vector<exception_ptr> errors(nSample);
+		#pragma omp parallel for schedule(dynamic) num_threads(max(1, num_threads))
+		for(int i = 0; i < nSample; i++)
 		{
-			auto gh = getGatingHierarchy(sn);
-			auto src_uri = gh->get_cytoframe_view_ref().get_uri();
-			if(is_remote_path(path)||is_remote_path(src_uri))
-				PRINT("saving GatingHierarchy: " + sn + " \n");
-			string cf_filename = (fs::path(path) / sn).string();
-			string buf;
-			google::protobuf::io::StringOutputStream raw_output(&buf);
+			try{
+				const string & sn = sample_names[i];
+				auto gh = getGatingHierarchy(sn);
+				auto src_uri = gh->get_cytoframe_view_ref().get_uri();
+				if(is_remote_path(path)||is_remote_path(src_uri))
+					PRINT("saving GatingHierarchy: " + sn + " \n");
+				string cf_filename = (fs::path(path) / sn).string();
+				string buf;
+				google::protobuf::io::StringOutputStream raw_output(&buf);
 
 
-			pb::GatingHierarchy pb_gh;
-			gh->convertToPb(pb_gh, cf_filename, cf_opt, is_skip_data, ctx);
+				pb::GatingHierarchy pb_gh;
+				gh->convertToPb(pb_gh, cf_filename, cf_opt, is_skip_data, ctx);
 
 
-			bool success = writeDelimitedTo(pb_gh, raw_output);
-			if (!success)
+				bool success = writeDelimitedTo(pb_gh, raw_output);
+				if (!success)
+					throw(domain_error("Failed to write GatingHierarchy."));
+				//init the output stream for gs
+				string gh_pb_file = (fs::path(path) / sn).string() + ".pb";
+
+
+				vfs.write_buf(gh_pb_file, buf);
+			}
+			catch(...)
+			{
+				errors[i] = current_exception();
+			}
+		}
+		for(auto & e : errors)
+		{
+			if(e)
 			{
 				google::protobuf::ShutdownProtobufLibrary();
-				throw(domain_error("Failed to write GatingHierarchy."));
+				rethrow_exception(e);
 			}
-			//init the output stream for gs
-			string gh_pb_file = (fs::path(path) / sn).string() + ".pb";
-
-
-			vfs.write_buf(gh_pb_file, buf);
-
-
 		}
 
 				// Optional:  Delete all global objects allocated by libprotobuf.
@@ -568,6 +648,105 @@ namespace cytolib
 
 	}
 
+	void MemoryBudget::acquire(size_t nBytes){
+		unique_lock<mutex> lock(mtx_);
+		if(budget_ > 0)
+			cv_.wait(lock, [&]{return in_use_ == 0 || in_use_ + nBytes <= budget_;});
+		in_use_ += nBytes;
+		count_++;
+		peak_bytes_ = max(peak_bytes_, in_use_);
+		peak_count_ = max(peak_count_, count_);
+	}
+
+	void MemoryBudget::release(size_t nBytes){
+		{
+			lock_guard<mutex> guard(mtx_);
+			in_use_ -= nBytes;
+			count_--;
+		}
+		cv_.notify_all();
+	}
+
+	map<string, string> GatingSet::gate_all(int num_threads, size_t memory_budget, bool preprocess
+			, bool recompute, bool computeTerminalBool, bool skip_faulty_node)
+	{
+		MemoryBudget budget(memory_budget);
+		return gate_all(num_threads, budget, preprocess, recompute, computeTerminalBool, skip_faulty_node);
+	}
+
+	map<string, string> GatingSet::gate_all(int num_threads, MemoryBudget & budget, bool preprocess
+			, bool recompute, bool computeTerminalBool, bool skip_faulty_node)
+	{
+		auto samples = get_sample_uids();
+		int nSample = samples.size();
+		vector<string> errors(nSample);
+		vector<char> is_failed(nSample, false);
+		#pragma omp parallel for schedule(dynamic) num_threads(max(1, num_threads))
+		for(int i = 0; i < nSample; i++)
+		{
+			const string & sn = samples[i];
+			size_t nBytes = 0;
+			bool is_admitted = false;
+			try
+			{
+				GatingHierarchyPtr gh = getGatingHierarchy(sn);
+				CytoFrameView cfv = gh->get_cytoframe_view();
+				//the underlying frame is entirely copied into memory before the view is realized
+				auto cf_ptr = cfv.get_cytoframe_ptr();
+				nBytes = size_t(cf_ptr->n_rows()) * cf_ptr->n_cols() * sizeof(EVENT_DATA_TYPE);
+				//the subset is then realized as another copy, and the in-memory frame is still held along with its copy
+				if(cfv.is_row_indexed() || cfv.is_col_indexed() || cf_ptr->get_backend_type() == FileFormat::MEM)
+					nBytes *= 2;
+				budget.acquire(nBytes);
+				is_admitted = true;
+				if(g_loglevel>=GATING_HIERARCHY_LEVEL)
+					PRINT("\n... load flow data: "+sn+"... \n");
+				auto fr = cfv.get_realized_memcytoframe();
+				if(preprocess)
+				{
+					if(g_loglevel>=GATING_HIERARCHY_LEVEL)
+						PRINT("\n... compensate: "+sn+"... \n");
+					gh->compensate(*fr);
+					if(g_loglevel>=GATING_HIERARCHY_LEVEL)
+						PRINT("\n... transform_data: "+sn+"... \n");
+					gh->transform_data(*fr);
+				}
+				if(g_loglevel>=GATING_HIERARCHY_LEVEL)
+					PRINT("\n... gating: "+sn+"... \n");
+				gh->gating(*fr, 0, recompute, computeTerminalBool, skip_faulty_node);
+				if(preprocess)
+				{
+					if(g_loglevel>=GATING_HIERARCHY_LEVEL)
+						PRINT("\n... save flow data: "+sn+"... \n");
+					cfv.set_params(fr->get_params());
+					cfv.set_keywords(fr->get_keywords());
+					cfv.set_data(fr->get_data());
+				}
+			}
+			catch(const exception & e)
+			{
+				is_failed[i] = true;
+				errors[i] = e.what();
+			}
+			catch(...)
+			{
+				is_failed[i] = true;
+				errors[i] = "unknown error";
+			}
+			if(is_admitted)
+				budget.release(nBytes);
+		}
+		map<string, string> res;
+		for(int i = 0; i < nSample; i++)
+			if(is_failed[i])
+			{
+				if(g_loglevel>=GATING_HIERARCHY_LEVEL)
+					PRINT("\n... failed to gate " + samples[i] + ": " + errors[i] + "\n");
+				res[samples[i]] = errors[i];
+			}
+		return res;
+	}
+
 	/**
 	 * assign the flow data from the source gs
 	 * @param gs typically it is a root-only GatingSet that only carries cytoFrames
@@ -581,7 +760,7 @@ namespace cytolib
 			const auto & it = gs.find(sn);
 			if(it==gs.end())
 				throw(domain_error("Sample '"  + sn + "' is missing from the data to be assigned!"));
-			GatingHierarchy & gh = *ghs_[sn];
+			GatingHierarchy & gh = *getGatingHierarchy(sn);
 			gh.set_cytoframe_view(it->second->get_cytoframe_view_ref());
 		}
 	};
@@ -633,7 +812,7 @@ namespace cytolib
 	GatingHierarchyPtr GatingSet::getGatingHierarchy(string sample_uid) const
 	{
 
-		const_iterator it=ghs_.find(sample_uid);
+		const_iterator it=find(sample_uid);
 		if(it==ghs_.end())
 			throw(domain_error(sample_uid + " not found!"));
 		else
@@ -649,6 +828,7 @@ namespace cytolib
 	{
 
 		//update gh
+		load_all();
 		for(auto & it : ghs_){
 
 				if(g_loglevel>=GATING_HIERARCHY_LEVEL)
@@ -683,8 +863,9 @@ namespace cytolib
 		//validity check
 		for(const auto & uid : sample_uids)
 		{
-			const auto & it = find(uid);
-			if(it==end())
+			//the samples not loaded yet are carried over as they are (through the shared loader)
+			const auto & it = ghs_.find(uid);
+			if(it==ghs_.end())
 				throw(domain_error("The data to be assigned is missing sample: " + uid));
 			else
 				ghs_new[uid] = it->second;
@@ -701,7 +882,7 @@ namespace cytolib
 	 */
 	void GatingSet::cols_(vector<string> colnames, ColType col_type)
 	{
-
+		load_all();
 		for(auto & it : ghs_)
 		{
 			if(!it.second->is_cytoFrame_only())
@@ -736,7 +917,7 @@ namespace cytolib
 		if(find(sample_uid) == end())
 			throw(domain_error("Can't update the cytoframe since it doesn't exists: " + sample_uid));
 		auto res = channel_consistency_check<GatingSet, CytoFrameView>(*this, frame_view, sample_uid);
-		ghs_[sample_uid]->set_cytoframe_view(res);
+		getGatingHierarchy(sample_uid)->set_cytoframe_view(res);
 	}
 
 
@@ -4,42 +4,236 @@
 
 namespace cytolib
 {
-	EVENT_DATA_VEC H5CytoFrame::read_data(uvec col_idx) const
+	/**
+	 * collapse the sorted unique indices into the runs of consecutive indices
+	 * @return the (start, length) pairs
+	 */
+	static vector<pair<hsize_t, hsize_t>> index_runs(const uvec & sorted_idx)
 	{
-		H5File file(filename_, h5_flags(), FileCreatPropList::DEFAULT, access_plist_);
-		auto dataset = file.openDataSet(DATASET_NAME);
-		auto dataspace = dataset.getSpace();
+		vector<pair<hsize_t, hsize_t>> runs;
+		for(unsigned i = 0; i < sorted_idx.size(); i++)
+		{
+			if(runs.size() > 0 && runs.back().first + runs.back().second == sorted_idx[i])
+				runs.back().second++;
+			else
+				runs.push_back(make_pair(sorted_idx[i], 1));
+		}
+		return runs;
+	}
+	/**
+	 * the union of many irregular hyperslabs is expensive to build in h5 (quadratic to the number of blocks),
+	 * thus the runs separated by the smallest gaps are merged (and the extra rows read are dropped in memory)
+	 * until there are no more than max_runs left
+	 */
+	static vector<pair<hsize_t, hsize_t>> merge_runs(const vector<pair<hsize_t, hsize_t>> & runs, unsigned max_runs)
+	{
+		unsigned n = runs.size();
+		if(n <= max_runs)
+			return runs;
+		//split at the max_runs-1 largest gaps
+		vector<unsigned> gap_idx(n - 1);
+		for(unsigned i = 0; i < n - 1; i++)
+			gap_idx[i] = i;
+		auto gap = [&runs](unsigned i){return runs[i+1].first - runs[i].first - runs[i].second;};
+		nth_element(gap_idx.begin(), gap_idx.begin() + max_runs - 1, gap_idx.end(), [&gap](unsigned i, unsigned j){return gap(i) > gap(j);});
+		vector<bool> is_split(n - 1, false);
+		for(unsigned i = 0; i < max_runs - 1; i++)
+			is_split[gap_idx[i]] = true;
+		vector<pair<hsize_t, hsize_t>> merged(1, runs[0]);
+		for(unsigned i = 1; i < n; i++)
+		{
+			if(is_split[i-1])
+				merged.push_back(runs[i]);
+			else
+				merged.back().second = runs[i].first + runs[i].second - merged.back().first;
+		}
+		return merged;
+	}
+	/**
+	 * the positions of idx within the sorted unique sorted_idx
+	 */
+	static uvec index_positions(const uvec & idx, const uvec & sorted_idx)
+	{
+		uvec pos(idx.size());
+		for(unsigned i = 0; i < idx.size(); i++)
+			pos[i] = lower_bound(sorted_idx.begin(), sorted_idx.end(), idx[i]) - sorted_idx.begin();
+		return pos;
+	}
 
+	const unsigned H5_MAX_SELECTION_BLOCKS = 1024;
+	const hsize_t H5_MIN_BLOCK_ELEMENTS = 1024;
+
+	EVENT_DATA_VEC H5CytoFrame::read_data(uvec col_idx, const uvec & row_idx, bool is_row_indexed) const
+	{
 		unsigned nrow = n_rows();
-		unsigned ncol = col_idx.size();
+		if(col_idx.size() > 0 && col_idx.max() >= n_cols())
+			throw(range_error("column index out of bound!"));
+		if(is_row_indexed && row_idx.size() > 0 && row_idx.max() >= nrow)
+			throw(range_error("row index out of bound!"));
 		/*
-		 * Define the memory dataspace.
+		 * the file selection is the union of the (column runs x row runs) blocks,
+		 * which h5 visits in the ascending order, i.e. the same order as the
+		 * (sorted unique rows x sorted unique cols) matrix that it is read into.
+		 * Thus the scattered selection takes a single h5 read and each chunk (and its decompression) is touched only once.
+		 * The requested order (and duplicates) is restored in memory afterwards
 		 */
-		hsize_t dimsm[] = {ncol, nrow};
-		DataSpace memspace(2,dimsm);
-		hsize_t      offset_mem[2];
-		hsize_t      count_mem[2];
-		EVENT_DATA_VEC data(nrow, ncol);
-		//reach one col at a time
-		for(unsigned i = 0; i < ncol; i++)
+		uvec ucol = unique(col_idx);
+		auto col_runs = index_runs(ucol);
+		vector<pair<hsize_t, hsize_t>> row_runs;
+		uvec urow;//the rows actually read
+		if(is_row_indexed)
 		{
-			//select slab for h5 data space
-			unsigned idx = col_idx[i];
-			hsize_t      offset[] = {idx, 0};   // hyperslab offset in the file
-			hsize_t      count[] = {1, nrow};    // size of the hyperslab in the file
-			dataspace.selectHyperslab( H5S_SELECT_SET, count, offset );
+			row_runs = merge_runs(index_runs(unique(row_idx)), max<unsigned>(1, H5_MAX_SELECTION_BLOCKS / max<unsigned>(1, col_runs.size())));
+			hsize_t n = 0;
+			for(const auto & r : row_runs)
+				n += r.second;
+			urow.set_size(n);
+			n = 0;
+			for(const auto & r : row_runs)
+				for(hsize_t j = 0; j < r.second; j++)
+					urow[n++] = r.first + j;
+		}
+		else if(nrow > 0)
+			row_runs.push_back(make_pair(0, nrow));
+		hsize_t nrow_read = is_row_indexed ? urow.size() : nrow;
 
-			//select slab for mem
-			offset_mem[0] = i;
-			offset_mem[1] = 0;
-			count_mem[0]  = 1;
-			count_mem[1]  = nrow;
-			memspace.selectHyperslab( H5S_SELECT_SET, count_mem, offset_mem );
+		EVENT_DATA_VEC data(nrow_read, ucol.size());
+		if(data.n_elem > 0)
+		{
+			auto h5 = open_h5();
+			lock_guard<recursive_mutex> guard(h5_mutex());
+			auto & dataset = h5.dataset();
+			auto dataspace = dataset.getSpace();
+			hsize_t dimsm[] = {ucol.size(), nrow_read};
+			DataSpace memspace(2,dimsm);
+			/*
+			 * h5 maps an irregular union selection onto the memory buffer element by element,
+			 * which only pays off when the blocks are small (e.g. the scattered rows of a view).
+			 * Otherwise each block is read into its own rectangle of the buffer,
+			 * which keeps h5 on its fast path for the same-shaped selections
+			 */
+			hsize_t nblocks = col_runs.size() * row_runs.size();
+			if(nblocks > 1 && data.n_elem / nblocks < H5_MIN_BLOCK_ELEMENTS)
+			{
+				dataspace.selectNone();
+				for(const auto & c : col_runs)
+					for(const auto & r : row_runs)
+					{
+						hsize_t      offset[] = {c.first, r.first};   // hyperslab offset in the file
+						hsize_t      count[] = {c.second, r.second};    // size of the hyperslab in the file
+						dataspace.selectHyperslab( H5S_SELECT_OR, count, offset );
+					}
+				dataset.read(data.memptr(), h5_datatype_data(DataTypeLocation::MEM) ,memspace, dataspace);
+			}
+			else
+			{
+				hsize_t cpos = 0;
+				for(const auto & c : col_runs)
+				{
+					hsize_t rpos = 0;
+					for(const auto & r : row_runs)
+					{
+						hsize_t      offset[] = {c.first, r.first};
+						hsize_t      count[] = {c.second, r.second};
+						dataspace.selectHyperslab( H5S_SELECT_SET, count, offset );
+						hsize_t      offset_mem[] = {cpos, rpos};
+						memspace.selectHyperslab( H5S_SELECT_SET, count, offset_mem );
+						dataset.read(data.memptr(), h5_datatype_data(DataTypeLocation::MEM) ,memspace, dataspace);
+						rpos += r.second;
+					}
+					cpos += c.second;
+				}
+			}
+		}
+		//map back to the requested order (and duplicates)
+		bool is_col_sorted = ucol.size() == col_idx.size() && all(ucol == col_idx);
+		bool is_row_sorted = !is_row_indexed || (urow.size() == row_idx.size() && all(urow == row_idx));
+		if(is_col_sorted && is_row_sorted)
+			return data;
+		else if(is_row_sorted)
+			return data.cols(index_positions(col_idx, ucol));
+		else if(is_col_sorted)
+			return data.rows(index_positions(row_idx, urow));
+		else
+			return data.submat(index_positions(row_idx, urow), index_positions(col_idx, ucol));
+	}
 
-			dataset.read(data.memptr(), h5_datatype_data(DataTypeLocation::MEM) ,memspace, dataspace);
+	void H5CytoFrame::write_h5_subset(const string & h5_filename, const uvec & row_idx, bool is_row_indexed, const uvec & col_idx) const
+	{
+		unsigned nrow = n_rows();
+		if(col_idx.size() > 0 && col_idx.max() >= n_cols())
+			throw(range_error("column index out of bound!"));
+		if(is_row_indexed && row_idx.size() > 0 && row_idx.max() >= nrow)
+			throw(range_error("row index out of bound!"));
+		hsize_t nrow_new = is_row_indexed ? row_idx.size() : nrow;
+		hsize_t ncol_new = col_idx.size();
+		//the cached meta data (which may not be flushed yet) of the subset
+		H5CytoFrame meta(*this);
+		meta.subset_parameters(col_idx);
+		meta.dims[0] = ncol_new;
+		meta.dims[1] = nrow_new;
+		vector<string> rn = get_rownames();
+
+		//h5 is only locked for each call so that the other threads can interleave their IO with the copy
+		unique_lock<recursive_mutex> lock(h5_mutex());
+		//the file can't be truncated while it is still opened by the cache
+		H5FileCache::instance().release(h5_filename);
+		H5File file( h5_filename, H5F_ACC_TRUNC );
+		meta.write_h5_params(file);
+		meta.write_h5_keys(file);
+		meta.write_h5_pheno_data(file);
+
+		hsize_t dimsf[2] = {ncol_new, nrow_new};
+		hsize_t dim_max[] = {H5S_UNLIMITED, H5S_UNLIMITED};
+		DataSpace dataspace( 2, dimsf, dim_max);
+		DataSet dataset = file.createDataSet( DATASET_NAME, h5_datatype_data(DataTypeLocation::H5), dataspace, layout_.get_plist(dimsf[0], dimsf[1]));
+		layout_.save(dataset);
+		/*
+		 * the rows are copied by the multiples of the chunk rows (in the same layout as the source)
+		 * so that each write covers the complete chunks of the new data set,
+		 * unless a single chunk already exceeds the budget (e.g. the entire column chunk), which is then written partially
+		 */
+		hsize_t	chunk_dims[2];
+		layout_.get_chunk_dims(dimsf[0], dimsf[1], chunk_dims);
+		hsize_t nBudgetRow = max<hsize_t>(1, g_h5_copy_max_elements / max<hsize_t>(1, ncol_new));
+		hsize_t nChunkRow = chunk_dims[1] <= nBudgetRow ? nBudgetRow / chunk_dims[1] * chunk_dims[1] : nBudgetRow;
+		for(hsize_t r = 0; r < nrow_new && ncol_new > 0; r += nChunkRow)
+		{
+			hsize_t n = min(nChunkRow, nrow_new - r);
+			uvec rows;
+			if(is_row_indexed)
+				rows = row_idx.subvec(r, r + n - 1);
+			else
+				rows = regspace<uvec>(r, r + n - 1);
+			EVENT_DATA_VEC chunk;
+			lock.unlock();
+			try{
+				chunk = read_data(col_idx, rows, true);
+			}catch(...){
+				//the h5 objects are closed under the lock
+				lock.lock();
+				throw;
+			}
+			lock.lock();
+
+			hsize_t offset[] = {0, r};
+			hsize_t count[] = {ncol_new, n};
+			dataspace.selectHyperslab( H5S_SELECT_SET, count, offset );
+			DataSpace memspace(2, count);
+			dataset.write(chunk.memptr(), h5_datatype_data(DataTypeLocation::MEM), memspace, dataspace);
 		}
 
-		return data;
+		if(rn.size() > 0)
+		{
+			if(is_row_indexed)
+			{
+				vector<string> tmp(nrow_new);
+				for(unsigned i = 0; i < nrow_new; i++)
+					tmp[i] = rn[row_idx[i]];
+				rn.swap(tmp);
+			}
+			meta.write_h5_rownames(file, rn);
+		}
 	}
 
 
@@ -63,8 +257,9 @@ namespace cytolib
 	}
 	void H5CytoFrame::flush_params()
 	{
-		check_write_permission();
-		H5File file(filename_, h5_flags(), FileCreatPropList::DEFAULT, access_plist_);
+		auto h5 = open_h5_rw();
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		H5File & file = h5.file();
 
 		CompType param_type = get_h5_datatype_params(DataTypeLocation::MEM);
 		DataSet ds = file.openDataSet("params");
@@ -79,8 +274,9 @@ namespace cytolib
 
 	void H5CytoFrame::flush_keys()
 	{
-		check_write_permission();
-		H5File file(filename_, h5_flags(), FileCreatPropList::DEFAULT, access_plist_);
+		auto h5 = open_h5_rw();
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		H5File & file = h5.file();
 		CompType key_type = get_h5_datatype_keys();
 		DataSet ds = file.openDataSet("keywords");
 		auto keyVec = to_kw_vec<KEY_WORDS>(keys_);
@@ -94,8 +290,9 @@ namespace cytolib
 	}
 	void H5CytoFrame::flush_pheno_data()
 	{
-		check_write_permission();
-		H5File file(filename_, h5_flags(), FileCreatPropList::DEFAULT, access_plist_);
+		auto h5 = open_h5_rw();
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		H5File & file = h5.file();
 		CompType key_type = get_h5_datatype_keys();
 		DataSet ds = file.openDataSet("pdata");
 
@@ -115,7 +312,9 @@ namespace cytolib
 	 * abandon the changes to the meta data in cache by reloading them from disk
 	 */
 	void H5CytoFrame::load_meta(){
-		H5File file(filename_, h5_flags(), FileCreatPropList::DEFAULT, access_plist_);
+		auto h5 = open_h5();
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		H5File & file = h5.file();
 		DataSet ds_param = file.openDataSet("params");
 	//	DataType param_type = ds_param.getDataType();
 
@@ -240,15 +439,15 @@ namespace cytolib
 	 */
 	void H5CytoFrame::set_data(const EVENT_DATA_VEC & _data)
 	{
-		H5File file(filename_, h5_flags(), FileCreatPropList::DEFAULT, access_plist_);
-		check_write_permission();
+		auto h5 = open_h5_rw();
+		lock_guard<recursive_mutex> guard(h5_mutex());
 		hsize_t dims_data[2] = {_data.n_cols, _data.n_rows};
 
 		// For the case that the data matrix has been re-sized
 		dims[0] = _data.n_cols;
 		dims[1] = _data.n_rows;
 
-		auto dataset = file.openDataSet(DATASET_NAME);
+		auto & dataset = h5.dataset();
 
 		dataset.extend(dims_data);
 		//refresh data space and dims
@@ -260,6 +459,91 @@ namespace cytolib
 
 	}
 
+	void H5CytoFrame::compensate(const compensation & comp)
+	{
+		uvec marker_idx, detector_idx;
+		get_compensation_idx(comp, marker_idx, detector_idx);
+		//the columns involved and their positions within the block
+		uvec cols = unique(join_cols(marker_idx, detector_idx));
+		uvec marker_pos = index_positions(marker_idx, cols);
+		uvec detector_pos = index_positions(detector_idx, cols);
+		hsize_t nrow = n_rows();
+		hsize_t nBlockRow = max<hsize_t>(1, g_h5_copy_max_elements / max<hsize_t>(1, cols.size()));
+		auto h5 = open_h5_rw();
+		for(hsize_t r = 0; r < nrow && cols.size() > 0; r += nBlockRow)
+		{
+			hsize_t n = min(nBlockRow, nrow - r);
+			EVENT_DATA_VEC block = read_data(cols, regspace<uvec>(r, r + n - 1), true);
+			comp.apply(block, marker_pos, detector_pos, g_comp_num_threads);
+
+			lock_guard<recursive_mutex> guard(h5_mutex());
+			auto & dataset = h5.dataset();
+			auto dataspace = dataset.getSpace();
+			hsize_t count[] = {1, n};
+			DataSpace memspace(2, count);
+			for(unsigned j = 0; j < marker_idx.size(); j++)
+			{
+				hsize_t offset[] = {marker_idx[j], r};
+				dataspace.selectHyperslab( H5S_SELECT_SET, count, offset );
+				dataset.write(block.colptr(marker_pos[j]), h5_datatype_data(DataTypeLocation::MEM), memspace, dataspace);
+			}
+		}
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		h5.dataset().flush(H5F_SCOPE_LOCAL);
+	}
+
+	void H5CytoFrame::append_data_columns(const EVENT_DATA_VEC & new_cols)
+	{
+		auto h5 = open_h5_rw();
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		if(new_cols.n_rows != dims[1])
+			throw(domain_error("New columns must have same number of rows as existing columns."));
+		hsize_t nCol = dims[0];
+		hsize_t dims_data[2] = {nCol + new_cols.n_cols, dims[1]};
+
+		auto & dataset = h5.dataset();
+		//the data set is created with the unlimited max dims, so it can grow without rewriting the existing columns
+		dataset.extend(dims_data);
+		auto dataspace = dataset.getSpace();
+		dataspace.getSimpleExtentDims(dims);
+		if(new_cols.n_elem > 0)
+		{
+			hsize_t offset[] = {nCol, 0};
+			hsize_t count[] = {new_cols.n_cols, new_cols.n_rows};
+			dataspace.selectHyperslab( H5S_SELECT_SET, count, offset );
+			DataSpace memspace(2, count);
+			dataset.write(new_cols.memptr(), h5_datatype_data(DataTypeLocation::MEM), memspace, dataspace);
+		}
+		dataset.flush(H5F_SCOPE_LOCAL);
+	}
+
+	void H5CytoFrame::append_data_rows(const EVENT_DATA_VEC & new_events)
+	{
+		auto h5 = open_h5_rw();
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		if(h5.file().exists(DATASET_ROWNAME))
+			throw(domain_error("Can't append events to the frame that has rownames!"));
+		if(new_events.n_cols != dims[0])
+			throw(domain_error("New events must have same number of columns as the existing events."));
+		hsize_t nRow = dims[1];
+		hsize_t dims_data[2] = {dims[0], nRow + new_events.n_rows};
+
+		auto & dataset = h5.dataset();
+		//the chunks of the existing rows are untouched except for the last (partially filled) one
+		dataset.extend(dims_data);
+		auto dataspace = dataset.getSpace();
+		dataspace.getSimpleExtentDims(dims);
+		if(new_events.n_elem > 0)
+		{
+			hsize_t offset[] = {0, nRow};
+			hsize_t count[] = {new_events.n_cols, new_events.n_rows};
+			dataspace.selectHyperslab( H5S_SELECT_SET, count, offset );
+			DataSpace memspace(2, count);
+			dataset.write(new_events.memptr(), h5_datatype_data(DataTypeLocation::MEM), memspace, dataspace);
+		}
+		dataset.flush(H5F_SCOPE_LOCAL);
+	}
+
 
 
 };
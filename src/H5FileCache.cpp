@@ -0,0 +1,242 @@
+// Copyright 2019 Fred Hutchinson Cancer Research Center
+// See the included LICENSE file for details on the licence that is granted to the user of this software.
+#include <cytolib/H5FileCache.hpp>
+#include <cytolib/CytoFrame.hpp>
+#include <sys/stat.h>
+
+namespace cytolib
+{
+	H5_FILE_STAT::H5_FILE_STAT(const string & path):H5_FILE_STAT()
+	{
+		struct stat st;
+		if(::stat(path.c_str(), &st) != 0)
+			return;
+		is_valid = true;
+		dev = st.st_dev;
+		ino = st.st_ino;
+		size = st.st_size;
+#if defined(__linux__)
+		mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+		mtime = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+		mtime = st.st_mtime * 1000000000LL;
+#endif
+	}
+
+	bool H5_FILE_STAT::operator==(const H5_FILE_STAT & other) const
+	{
+		return is_valid == other.is_valid && dev == other.dev && ino == other.ino && size == other.size && mtime == other.mtime;
+	}
+
+	H5_FILE_ENTRY::H5_FILE_ENTRY(const string & _key, const string & _path, unsigned _flags, const FileAccPropList & _fapl)
+	:file(_path, _flags, FileCreatPropList::DEFAULT, _fapl), key(_key), path(_path), flags(_flags), is_dataset_open(false), stat(_path)
+	{
+		fapl.copy(_fapl);
+	}
+
+	H5FileHandle::H5FileHandle(H5FileEntryPtr entry):entry_(entry)
+	{
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		entry_->holders.push_back(std::this_thread::get_id());
+	}
+
+	H5FileHandle::~H5FileHandle(){
+		if(entry_)
+		{
+			//the file is closed here when it is no longer cached
+			lock_guard<recursive_mutex> guard(h5_mutex());
+			H5FileCache::instance().on_release(entry_);
+		}
+	}
+
+	DataSet & H5FileHandle::dataset(){
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		if(!entry_->is_dataset_open)
+		{
+			entry_->dataset = entry_->file.openDataSet(DATASET_NAME);
+			entry_->is_dataset_open = true;
+		}
+		return entry_->dataset;
+	}
+
+	H5FileCache & H5FileCache::instance(){
+		static H5FileCache cache;
+		return cache;
+	}
+
+	string H5FileCache::get_key(const string & path)
+	{
+		boost::system::error_code ec;
+		auto p = fs::canonical(path, ec);
+		return ec ? path : p.string();
+	}
+
+	H5FileHandle H5FileCache::open(const string & path, unsigned flags, const FileAccPropList & fapl)
+	{
+		unique_lock<recursive_mutex> lock(h5_mutex());
+		string key = get_key(path);
+		bool is_write = flags != H5F_ACC_RDONLY;
+		while(true)
+		{
+			H5FileEntryPtr entry;
+			auto it = live_.find(key);
+			if(it != live_.end())
+			{
+				entry = it->second.lock();
+				if(!entry)
+					live_.erase(it);
+			}
+			if(!entry)
+				break;
+			bool is_entry_write = entry->flags != H5F_ACC_RDONLY;
+			//the file written through the read-write handle is not expected to match the stat taken at opening
+			if(!is_entry_write && !(entry->stat == H5_FILE_STAT(path)))
+			{
+				//the file has been replaced or modified on disk, the stale handle is left to its current users
+				evict(key);
+				live_.erase(key);
+				break;
+			}
+			if(H5Pequal(entry->fapl.getId(), fapl.getId()) > 0 && (is_entry_write || !is_write))
+			{
+				touch(entry);
+				return H5FileHandle(entry);
+			}
+			//the file can only be open in one mode, so close the handle before reopening it
+			evict(key);
+			if(entry->holders.empty())
+			{
+				entry.reset();
+				live_.erase(key);
+				break;
+			}
+			if(find(entry->holders.begin(), entry->holders.end(), std::this_thread::get_id()) != entry->holders.end())
+				throw(domain_error("Can't reopen the h5 file that is still in use by the current thread: " + path));
+			//wait for the other threads to finish with it
+			entry.reset();
+			released_.wait(lock);
+		}
+
+		H5FileEntryPtr entry(new H5_FILE_ENTRY(key, path, flags, fapl));
+		open_count_++;
+		live_[key] = entry;
+		if(capacity_ > 0)
+		{
+			lru_.push_front(make_pair(key, entry));
+			entries_[key] = lru_.begin();
+			while(lru_.size() > capacity_)
+				evict(lru_.back().first);
+		}
+		return H5FileHandle(entry);
+	}
+
+	void H5FileCache::evict(const string & key)
+	{
+		auto it = entries_.find(key);
+		if(it != entries_.end())
+		{
+			lru_.erase(it->second);
+			entries_.erase(it);
+		}
+	}
+
+	void H5FileCache::touch(H5FileEntryPtr entry)
+	{
+		auto it = entries_.find(entry->key);
+		if(it != entries_.end())
+		{
+			if(it->second->second == entry)
+				lru_.splice(lru_.begin(), lru_, it->second);//move to front
+		}
+		else if(capacity_ > 0)
+		{
+			//the file still in use after being evicted goes back to the cache
+			lru_.push_front(make_pair(entry->key, entry));
+			entries_[entry->key] = lru_.begin();
+			while(lru_.size() > capacity_)
+				evict(lru_.back().first);
+		}
+	}
+
+	void H5FileCache::on_release(H5FileEntryPtr & entry)
+	{
+		auto & holders = entry->holders;
+		auto it = find(holders.begin(), holders.end(), std::this_thread::get_id());
+		if(it != holders.end())
+			holders.erase(it);
+		else if(!holders.empty())
+			holders.pop_back();
+		if(holders.empty() && entry->flags != H5F_ACC_RDONLY)
+		{
+			//make the writes visible to the others (e.g. the direct readers) and remember the file as we left it
+			try{
+				entry->file.flush(H5F_SCOPE_LOCAL);
+			}catch(const H5::Exception & ex){
+				PRINT("failed to flush " + entry->path + ": " + ex.getDetailMsg() + "\n");
+			}
+			entry->stat = H5_FILE_STAT(entry->path);
+		}
+		string key = entry->key;
+		entry.reset();
+		auto lit = live_.find(key);
+		if(lit != live_.end() && lit->second.expired())
+			live_.erase(lit);
+		released_.notify_all();
+	}
+
+	void H5FileCache::release(const string & path)
+	{
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		evict(get_key(path));
+	}
+
+	void H5FileCache::release_dir(const string & path)
+	{
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		string dir = get_key(path);
+		evict(dir);
+		vector<string> keys;
+		for(auto & e : lru_)
+		{
+			const string & key = e.first;
+			if(key.size() > dir.size() && key.compare(0, dir.size(), dir) == 0 && (key[dir.size()] == '/' || key[dir.size()] == '\\'))
+				keys.push_back(key);
+		}
+		for(auto & key : keys)
+			evict(key);
+	}
+
+	void H5FileCache::clear()
+	{
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		entries_.clear();
+		lru_.clear();
+	}
+
+	void H5FileCache::set_capacity(size_t n)
+	{
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		capacity_ = n;
+		while(lru_.size() > capacity_)
+			evict(lru_.back().first);
+	}
+
+	size_t H5FileCache::get_capacity() const
+	{
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		return capacity_;
+	}
+
+	size_t H5FileCache::size() const
+	{
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		return lru_.size();
+	}
+
+	size_t H5FileCache::get_open_count() const
+	{
+		lock_guard<recursive_mutex> guard(h5_mutex());
+		return open_count_;
+	}
+};
@@ -1,13 +1,17 @@
 // Copyright 2019 Fred Hutchinson Cancer Research Center
 // See the included LICENSE file for details on the licence that is granted to the user of this software.
 #include <cytolib/MemCytoFrame.hpp>
+#include <cytolib/H5FileCache.hpp>
 #include <cytolib/cytolibConfig.h>
 #include <boost/lexical_cast.hpp>
 #include <unordered_map>
 #include <queue>
 #include <cytolib/global.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 namespace fs = boost::filesystem;
+namespace bip = boost::interprocess;
 
 namespace cytolib
 {
@@ -280,16 +284,13 @@ namespace cytolib
 	}
 
 	/**
-	 * parse the data segment of FCS
+	 * resolve how the data section is to be decoded from the keywords
 	 *
-	 * @param in (input) file stream object opened from FCS file
 	 * @param config (input) the parsing arguments for data
 	 */
-	void MemCytoFrame::read_fcs_data(ifstream &in, const FCS_READ_DATA_PARAM & config)
+	FCS_DATA_PLAN MemCytoFrame::plan_fcs_data(const FCS_READ_DATA_PARAM & config)
 	{
-		if(g_loglevel>=GATING_HIERARCHY_LEVEL)
-			PRINT("Parsing FCS data section \n");
-
+		FCS_DATA_PLAN plan;
 		//## transform or scale data?
 		  bool fcsPnGtransform = false, isTransformation = false, scale = false;
 		  if(config.transform == TransformType::linearize)
@@ -355,24 +356,6 @@ namespace cytolib
 		if(dattype!="I"&&multiSize)
 			throw(domain_error("Sorry, Numeric data type expects the same bitwidth for all parameters!"));
 
-//		bool splitInt;
-//		if(dattype=="I"){
-//
-//		  if(multiSize)
-//			splitInt = false;
-//		  else
-//			  splitInt = params[0].PnB == 32;
-//
-//
-//		}
-//		else
-//		{
-//		  splitInt = false;
-//
-//		}
-
-
-
 		if(!multiSize){
 		  if(params[0].PnB ==10){
 			  string sys = keys_["$SYS"];
@@ -387,101 +370,16 @@ namespace cytolib
 		  }
 		}
 
-//		bool isSigned;
-//		if(multiSize){
-//
-//		  isSigned = false; // #dummy. not used in mutliSize logic.
-//		}else{
-//
-//
-//		  //# since signed = FALSE is not supported by readBin when size > 2
-//		  //# we set it to TRUE automatically then to avoid warning flooded by readBin
-//		  //# It shouldn't cause data clipping since we haven't found any use case where datatype is unsigned integer with size > 16bits
-//		 isSigned = !(params[0].PnB == 8 ||params[0].PnB == 16);
-//		}
-//
-
-
-	  in.seekg(header_.datastart);
-
-	  auto nBytes = header_.dataend - header_.datastart + 1;
-
-
-	//	vector<BYTE>bytes(nBytes);
-	//	in.read((char *)&bytes[0], nBytes);
-	//
-	//	if(dattype != "i")
-	//	  throw(domain_error("we don't support different bitwdiths for numeric data type!"));
 		//total bits for each row
-	  	size_t nRowSize = accumulate(params.begin(), params.end(), 0, [](size_t i, cytoParam p){return i + p.PnB;});
-
-	  	auto nrow = nBytes * 8/nRowSize;
-
-	  	auto which_lines = config.which_lines;
-	  	auto nSelected = which_lines.size();
-	  	//randomly sample the data if the given lines are of size 1
-	  	if(nSelected == 1)
-	  	{
-	  		nSelected = which_lines[0];
-	  		which_lines.resize(nSelected);
-	  		std::default_random_engine generator(config.seed);
-	  		std::uniform_int_distribution<int64_t> distribution(0, nrow - 1);
-	  		for(uint64_t i = 0; i < nSelected; i++)
-	  		{
-	  			which_lines[i] = distribution(generator);
-	  		}
-	  	}
-	  	if(nSelected>0){
-	  		if(nSelected >= nrow)
-	  			throw(domain_error("total number of which.lines exceeds the total number of events: " + to_string(nrow)));
-
-	  		sort(which_lines.begin(), which_lines.end());
-	  		nrow = nSelected;
-	  		nBytes = nrow * nRowSize/8;
-	  	}
-	  	unique_ptr<char []> buf(new char[nBytes]);//we need to rearrange dat from row-major to col-major thus need a separate buf anyway (even for float)
-	  	char * bufPtr = buf.get();
-	  	if(nSelected>0)
-	  	{
-	  		char * thisBufPtr = bufPtr;
-	  		auto nRowSizeBytes = nRowSize/8;
-	  		for(auto i : which_lines)
-	  		{
-	  			int64_t pos =  header_.datastart + i * nRowSizeBytes;
-	  			if(pos > header_.dataend || pos < header_.datastart)
-	  				throw(domain_error("the index of which.lines exceeds the data boundary: " + to_string(i)));
-	  			in.seekg(pos);
-	  			in.read(thisBufPtr, nRowSizeBytes);
-	  			thisBufPtr += nRowSizeBytes;
-	  		}
-	  	}
-	  	else
-	  	{
-	  		//load entire data section with one disk IO
+		plan.nRowSize = accumulate(params.begin(), params.end(), 0, [](size_t i, cytoParam p){return i + p.PnB;});
+		plan.nBytes = header_.dataend - header_.datastart + 1;
+		plan.nrow = plan.nBytes * 8/plan.nRowSize;
 
-			in.read(bufPtr, nBytes); //load the bytes from file
-			uint64_t events_read = (in.gcount() * 8 / nRowSize);
-			uint64_t events_expected = boost::lexical_cast<uint64_t>(keys_["$TOT"]);
-			if(events_read != events_expected)//can't use nBytes derived from FCS header as the check point since it may have extra bytes than needed
-			{
-				throw(domain_error("file " + filename_+ " seems to be corrupted. \n The actual number of cells in data section ("
-		                 + to_string(events_read) + ") is not consistent with keyword '$TOT' (" + to_string(events_expected) + ")"));
-			}
-
-	  	}
-	//	nEvents = nrow;
-		//how many element to return
-	  	auto nElement = nrow * nCol;
-
-	  	data_.resize(nrow, nCol);
-
-	//	char *p = buf.get();//pointer to the current beginning byte location of the processing data element in the byte stream
-		float decade = pow(10, config.decades);
 		/*
 		 * mixed endian parsing could be more efficiently
 		 * integrated into the subsequent main loop of data parsing
 		 * but since it is a rare case (legacy data), we do the separate simple
-		 * preprocessing here to avoid adding extra overhead into the main loop
+		 * preprocessing on the raw bytes to avoid adding extra overhead into the main loop
 		 */
 		if(endian == endianType::mixed)
 		{
@@ -495,33 +393,13 @@ namespace cytolib
 			  if(params[0].PnB/8 != elementSize)
 				throw(domain_error("Byte order is not consistent with bidwidths!"));
 
-			  vector<int> iByteOrd(elementSize);
+			  plan.iByteOrd.resize(elementSize);
 			  for(auto i = 0; i < elementSize; i++)
 			  {
-				  iByteOrd[i] = boost::lexical_cast<int>(byteOrd[i])-1;
+				  plan.iByteOrd[i] = boost::lexical_cast<int>(byteOrd[i])-1;
 			  }
-			  char * tmp = new char[elementSize];
-			  for(size_t ind = 0; ind < nElement; ind++){
-
-				  memcpy(tmp, bufPtr + ind * elementSize, elementSize);
-
-			     for(auto i = 0; i < elementSize; i++){
-			       auto j = iByteOrd[i];
-
-//			       auto pos_old = ind * elementSize + i;
-			       auto pos_new = ind * elementSize + j;
-			 //       if(ind<=10)
-			 //         Rcpp::Rcout << pos_old <<":" << pos_new << std::endl;
-
-
-			       bufPtr[pos_new] = tmp[i];
-
-			     }
-
-			   }
-			  	delete [] tmp;
 
-			    endian = endianType::small;
+			  endian = endianType::small;
 		}
 
 		bool isbyteswap = false;
@@ -530,155 +408,92 @@ namespace cytolib
 			isbyteswap = true;
 
 		/**
-		 * cp raw bytes(row-major) to a 2d mat (col-major) represented as 1d array(with different byte width for each elements)
+		 * resolve the decoding of each parameter up front so that the main loop is free of
+		 * the per-element datatype/bitwidth/endian/transformation branching
 		 */
-	//	double start = omp_get_wtime();//clock();
-	#ifdef _OPENMP
-		omp_set_num_threads(config.num_threads);
-	#endif
-
-	    #pragma omp parallel for
+		float decade = pow(10, config.decades);
+		bool isInteger = dattype == "I";
+		plan.decoders.resize(nCol);
+		size_t bits_offset = 0;
 		for(auto c = 0; c < nCol; c++)
-		 {
-			string pid = to_string(c+1);
-			EVENT_DATA_TYPE realMin = numeric_limits<EVENT_DATA_TYPE>::max();
-//			size_t element_offset = nrow * c;
-			size_t bits_offset = accumulate(params.begin(), params.begin() + c, 0, [](size_t i, cytoParam p){return i + p.PnB;});
+		{
 			cytoParam & param = params[c];
-			int usedBits = ceil(log2(param.max));
-		    uint64_t base = static_cast<uint64_t>(1)<<usedBits;
-//		    auto thisSize = params[c-1].PnB;
-			for(size_t r = 0; r < nrow; r++)
-		    {
-		      //convert each element
-				  auto thisSize = param.PnB;
-//				  size_t idx = element_offset + r;
-				  EVENT_DATA_TYPE & outElement = data_.at(r, c);
-				  size_t idx_bits = r * nRowSize + bits_offset;
-				  char *p = bufPtr + idx_bits/8;
-				  thisSize/=8;
-				  if(isbyteswap)
-					  std::reverse(p, p + thisSize);
-
-				  if(dattype == "I")
-				  {
-					  switch(thisSize)
-					  {
-					  case sizeof(BYTE)://1 byte
-						{
-						  outElement = static_cast<EVENT_DATA_TYPE>(*p);
-						}
-
-						  break;
-					  case sizeof(unsigned short): //2 bytes
-						{
-
-						  outElement = static_cast<EVENT_DATA_TYPE>(*reinterpret_cast<unsigned short *>(p));
-						}
-
-						break;
-					  case sizeof(unsigned)://4 bytes
-						{
-						  outElement = static_cast<EVENT_DATA_TYPE>(*reinterpret_cast<unsigned *>(p));
-						}
-
-						break;
-					  case sizeof(uint64_t)://8 bytes
-						{
-						  outElement = static_cast<EVENT_DATA_TYPE>(*reinterpret_cast<uint64_t *>(p));
-						}
-
-					  break;
-					  default:
-						  {
-							  std::string serror = "unsupported byte width :";
-							  serror.append(std::to_string(thisSize));
-							  throw std::range_error(serror.c_str());
-						  }
-					  }
-					  // apply bitmask for integer data
-
-					 if(param.max > 0)
-					 {
-
-					   if(usedBits < param.PnB)
-						   outElement = static_cast<uint64_t>(outElement) % base;
-					}
-
-
-				}
-				else
-				{
-				  switch(thisSize)
-				  {
-				  case sizeof(float):
-					{
-					  outElement = *reinterpret_cast<float *>(p);
-					}
-
-					break;
-				  case sizeof(double):
-					{
-					  outElement = static_cast<EVENT_DATA_TYPE>(*reinterpret_cast<double *>(p));
-					}
-
-					break;
-				  default:
-					std::string serror ="Unsupported bitwidths for numerical data type:";
-					serror.append(std::to_string(thisSize));
-					throw std::range_error(serror.c_str());
-				  }
-				}
-
-			  // truncate data at range
-				if(!transDefinedinKeys)
-				{
-					if(config.truncate_max_range&&outElement > param.max)
-						outElement = param.max;
-
-					if(config.truncate_min_val&&outElement < config.min_limit)
-						outElement = config.min_limit;
-				}
-
-
-
-	//				## Transform or scale if necessary
-	//				# J.Spidlen, Nov 13, 2013: added the flowCore_fcsPnGtransform keyword, which is
-	//				# set to "linearize-with-PnG-scaling" when transformation="linearize-with-PnG-scaling"
-	//				# in read.FCS(). This does linearization for log-stored parameters and also division by
-	//				# gain ($PnG value) for linearly stored parameters. This is how the channel-to-scale
-	//				# transformation should be done according to the FCS specification (and according to
-	//				# Gating-ML 2.0), but lots of software tools are ignoring the $PnG division. I added it
-	//				# so that it is only done when specifically asked for so that read.FCS remains backwards
-	//				# compatible with previous versions.
-
-
-				if(isTransformation)
-				{
+			FCS_COLUMN_DECODER & decoder = plan.decoders[c];
+			int thisSize = param.PnB/8;
+			decoder.decode = isbyteswap?get_fcs_decode_func<true>(isInteger, thisSize):get_fcs_decode_func<false>(isInteger, thisSize);
+			decoder.offset = bits_offset/8;
+			bits_offset += param.PnB;
 
+			int usedBits = ceil(log2(param.max));
+			decoder.isMask = isInteger && param.max > 0 && usedBits < param.PnB;
+			decoder.base = static_cast<uint64_t>(1)<<usedBits;
+			decoder.max = param.max;
+			if(!transDefinedinKeys)
+			{
+				decoder.truncate_max = config.truncate_max_range;
+				decoder.truncate_min = config.truncate_min_val;
+				decoder.min_limit = config.min_limit;
+			}
+			/*
+			 *	## Transform or scale if necessary
+			 *	# J.Spidlen, Nov 13, 2013: added the flowCore_fcsPnGtransform keyword, which is
+			 *	# set to "linearize-with-PnG-scaling" when transformation="linearize-with-PnG-scaling"
+			 *	# in read.FCS(). This does linearization for log-stored parameters and also division by
+			 *	# gain ($PnG value) for linearly stored parameters. This is how the channel-to-scale
+			 *	# transformation should be done according to the FCS specification (and according to
+			 *	# Gating-ML 2.0), but lots of software tools are ignoring the $PnG division. I added it
+			 *	# so that it is only done when specifically asked for so that read.FCS remains backwards
+			 *	# compatible with previous versions.
+			 */
+			if(isTransformation)
+			{
+				decoder.isLog = param.PnE[0] > 0;
+				decoder.isGain = !decoder.isLog && fcsPnGtransform && param.PnG != 1;
+			}
+			decoder.PnE[0] = param.PnE[0];
+			decoder.PnE[1] = param.PnE[1];
+			decoder.PnG = param.PnG;
+			if(scale)
+				decoder.scale = param.PnE[0] > 0 ? 1 : 2;
+			decoder.decade = decade;
+		}
+		plan.isTransformation = isTransformation;
+		plan.scale = scale;
+		plan.fcsPnGtransform = fcsPnGtransform;
+		plan.decade = decade;
+		plan.num_threads = config.num_threads;
+		return plan;
+	}
 
-				  if(param.PnE[0] > 0)
-				  {
-					 outElement = pow(10,outElement/param.max * param.PnE[0]) * param.PnE[1];
-				  }
-				  else if (fcsPnGtransform && param.PnG != 1) {
-					  outElement = outElement / param.PnG;
-				  }
-				}
-				if(scale)
-				{
-					if(param.PnE[0] > 0)
-					{
-						outElement = decade*((outElement-1)/(param.max-1));
-					}
-					else
-					{
-						outElement = decade*((outElement)/(param.max));
-					}
-				}
-				realMin = realMin > outElement?outElement:realMin;
+	/**
+	 * check the number of events available in the data section against $TOT
+	 * @param nBytesRead the number of bytes actually present in the file for the data section
+	 */
+	void MemCytoFrame::check_fcs_event_count(const FCS_DATA_PLAN & plan, uint64_t nBytesRead)
+	{
+		uint64_t events_read = (nBytesRead * 8 / plan.nRowSize);
+		uint64_t events_expected = boost::lexical_cast<uint64_t>(keys_["$TOT"]);
+		if(events_read != events_expected)//can't use nBytes derived from FCS header as the check point since it may have extra bytes than needed
+		{
+			throw(domain_error("file " + filename_+ " seems to be corrupted. \n The actual number of cells in data section ("
+					 + to_string(events_read) + ") is not consistent with keyword '$TOT' (" + to_string(events_expected) + ")"));
+		}
+	}
 
-		    }
+	/**
+	 * update params and keywords once all the events have been decoded
+	 * @param realMin the minimum decoded value of each parameter
+	 */
+	void MemCytoFrame::finish_fcs_data(const FCS_DATA_PLAN & plan, const FCS_READ_DATA_PARAM & config, const vector<EVENT_DATA_TYPE> & realMin)
+	{
+		bool isTransformation = plan.isTransformation;
+		bool scale = plan.scale;
+		bool fcsPnGtransform = plan.fcsPnGtransform;
+		float decade = plan.decade;
+		for(unsigned c = 0; c < params.size(); c++)
+		{
+			string pid = to_string(c+1);
+			cytoParam & param = params[c];
 
 			if(keys_.find("transformation")!=keys_.end() &&  keys_["transformation"] == "custom")
 				param.min = boost::lexical_cast<EVENT_DATA_TYPE>(keys_["flowCore_$P" + pid + "Rmin"]);
@@ -686,13 +501,11 @@ namespace cytolib
 			{
 
 				auto zeroVals = param.PnE[1];
-				param.min = min(zeroVals, max(config.min_limit, realMin));
+				param.min = min(zeroVals, max(config.min_limit, realMin[c]));
 
 			}
 
 		 }
-	//	 cout << (std::clock() - start) / (double)(CLOCKS_PER_SEC / 1000) << endl;
-	//	 cout << (omp_get_wtime() - start) / (double)(CLOCKS_PER_SEC / 1000) << endl;
 
 		//update params
 		for(auto &p : params)
@@ -763,9 +576,212 @@ namespace cytolib
 		}
 
 		keys_["GUID"] = fs::path(filename_).filename().string();
+	}
+
+	/**
+	 * parse the data segment of FCS
+	 *
+	 * @param in (input) file stream object opened from FCS file
+	 * @param config (input) the parsing arguments for data
+	 */
+	void MemCytoFrame::read_fcs_data(ifstream &in, const FCS_READ_DATA_PARAM & config)
+	{
+		if(g_loglevel>=GATING_HIERARCHY_LEVEL)
+			PRINT("Parsing FCS data section \n");
+
+		FCS_DATA_PLAN plan = plan_fcs_data(config);
+		int nCol = params.size();
+		auto nRowSize = plan.nRowSize;
+		auto nBytes = plan.nBytes;
+	  	auto nrow = plan.nrow;
+
+	  	auto which_lines = config.which_lines;
+	  	auto nSelected = which_lines.size();
+	  	//randomly sample the data if the given lines are of size 1
+	  	if(nSelected == 1)
+	  	{
+	  		nSelected = which_lines[0];
+	  		which_lines.resize(nSelected);
+	  		std::default_random_engine generator(config.seed);
+	  		std::uniform_int_distribution<int64_t> distribution(0, nrow - 1);
+	  		for(uint64_t i = 0; i < nSelected; i++)
+	  		{
+	  			which_lines[i] = distribution(generator);
+	  		}
+	  	}
+	  	if(nSelected>0){
+	  		if(nSelected >= nrow)
+	  			throw(domain_error("total number of which.lines exceeds the total number of events: " + to_string(nrow)));
+
+	  		sort(which_lines.begin(), which_lines.end());
+	  		nrow = nSelected;
+	  		nBytes = nrow * nRowSize/8;
+	  	}
+	  	auto nRowSizeBytes = nRowSize/8;
+	  	/*
+	  	 * the entire data section is decoded straight from a read-only mapping of the file
+	  	 * so that the events are not held in memory twice (raw bytes + data_) while parsing.
+	  	 * Subsetting by which_lines and the legacy mixed endian both need the rearranged bytes
+	  	 * in a scratch buffer anyway, so they still go through ifstream
+	  	 */
+	  	bool use_mmap = config.use_mmap && nSelected == 0 && plan.iByteOrd.empty() && nBytes > 0;
+	  	if(use_mmap)
+	  	{
+	  		//the header may claim more bytes than the file actually has, leave it to the buffered path to report
+	  		boost::system::error_code ec;
+	  		auto fsize = fs::file_size(filename_, ec);
+	  		use_mmap = !ec && fsize >= static_cast<uintmax_t>(header_.datastart + nBytes);
+	  	}
+	  	unique_ptr<char []> buf;
+	  	bip::mapped_region region;
+	  	char * bufPtr;
+	  	if(use_mmap)
+	  	{
+	  		bip::file_mapping fm(filename_.c_str(), bip::read_only);
+	  		region = bip::mapped_region(fm, bip::read_only, header_.datastart, nBytes);
+	  		region.advise(bip::mapped_region::advice_sequential);
+	  		bufPtr = static_cast<char *>(region.get_address());//read-only pages, the decoding below must not write to it
+	  	}
+	  	else
+	  	{
+	  		buf.reset(new char[nBytes]);//we need to rearrange dat from row-major to col-major thus need a separate buf anyway (even for float)
+	  		bufPtr = buf.get();
+	  	}
+	  	if(nSelected>0)
+	  	{
+	  		char * thisBufPtr = bufPtr;
+	  		for(auto i : which_lines)
+	  		{
+	  			int64_t pos =  header_.datastart + i * nRowSizeBytes;
+	  			if(pos > header_.dataend || pos < header_.datastart)
+	  				throw(domain_error("the index of which.lines exceeds the data boundary: " + to_string(i)));
+	  			in.seekg(pos);
+	  			in.read(thisBufPtr, nRowSizeBytes);
+	  			thisBufPtr += nRowSizeBytes;
+	  		}
+	  	}
+	  	else if(use_mmap)
+	  		check_fcs_event_count(plan, nBytes);//the mapping has already been checked against the file size
+	  	else
+	  	{
+	  		//load entire data section with one disk IO
+	  		in.seekg(header_.datastart);
+			in.read(bufPtr, nBytes); //load the bytes from file
+			check_fcs_event_count(plan, in.gcount());
+	  	}
+
+	  	data_.resize(nrow, nCol);
+
+		plan.fix_mixed_endian(bufPtr, nrow);
+
+		vector<EVENT_DATA_TYPE> realMin(nCol);
+		plan.decode(bufPtr, nrow, data_.memptr(), nrow, realMin);
+
+		finish_fcs_data(plan, config, realMin);
 
 	}
 
+	void MemCytoFrame::stream_fcs_to_h5(const string & h5_filename)
+	{
+		const FCS_READ_DATA_PARAM & config = config_.data;
+		open_fcs_file();
+		read_fcs_header(in_, config_.header);
+		keys_["$CYTOLIB_VERSION"] = CYTOLIB_VERSION;
+		const H5_LAYOUT_PARAM & layout = config_.h5_layout;
+		/*
+		 * subsetted events are held in memory anyway,
+		 * and so are the compressed chunks of the entire column, which would otherwise be decompressed and recompressed by each partial write
+		 */
+		bool is_filtered = layout.deflate > 0 || layout.shuffle;
+		if(config.which_lines.size() > 0 || (layout.chunk_rows == 0 && is_filtered))
+		{
+			read_fcs_data(in_, config);
+			in_.close();
+			lock_guard<recursive_mutex> guard(h5_mutex());
+			write_h5(h5_filename, layout);
+			return;
+		}
+		if(g_loglevel>=GATING_HIERARCHY_LEVEL)
+			PRINT("Streaming FCS data section to " + h5_filename + "\n");
+
+		FCS_DATA_PLAN plan = plan_fcs_data(config);
+		unsigned nCol = params.size();
+		auto nRowSizeBytes = plan.nRowSize/8;
+		uint64_t nrow = plan.nrow;
+
+		in_.seekg(0, in_.end);
+		int64_t fsize = in_.tellg();
+		check_fcs_event_count(plan, max<int64_t>(0, min<int64_t>(plan.nBytes, fsize - header_.datastart)));
+
+		/*
+		 * the data is written in the same layout as write_h5
+		 * and decoded by the multiples of the chunk rows so that each write covers the complete chunks,
+		 * except for the (uncompressed) chunks of the entire column (chunk_rows = 0),
+		 * which are written partially by stream_chunk_size events to keep the memory bounded.
+		 * The h5 file stays open across the chunks, but h5_mutex is only held for the h5 calls
+		 * so that multiple files can be decoded concurrently while their h5 IO is serialized
+		 */
+		hsize_t dimsf[2] = {nCol, nrow};
+		hsize_t	chunk_dims[2];
+		layout.get_chunk_dims(dimsf[0], dimsf[1], chunk_dims);
+		uint64_t nChunkRow = layout.chunk_rows == 0 ? config.stream_chunk_size : max<uint64_t>(1, config.stream_chunk_size / chunk_dims[1]) * chunk_dims[1];
+		nChunkRow = max<uint64_t>(1, min<uint64_t>(nChunkRow, nrow));
+
+		unique_lock<recursive_mutex> lock(h5_mutex());
+		H5FileCache::instance().release(h5_filename);
+		H5File file( h5_filename, H5F_ACC_TRUNC );
+		hsize_t dim_max[] = {H5S_UNLIMITED, H5S_UNLIMITED};
+		DataSpace dataspace( 2, dimsf, dim_max);
+		DataSet dataset = file.createDataSet( DATASET_NAME, h5_datatype_data(DataTypeLocation::H5), dataspace, layout.get_plist(dimsf[0], dimsf[1]));
+		layout.save(dataset);
+		lock.unlock();
+
+		unique_ptr<char []> buf(new char[nChunkRow * nRowSizeBytes]);
+		EVENT_DATA_VEC chunk(nChunkRow, nCol);
+		vector<EVENT_DATA_TYPE> realMin(nCol, numeric_limits<EVENT_DATA_TYPE>::max());
+		vector<EVENT_DATA_TYPE> chunkMin(nCol);
+		try{
+			in_.seekg(header_.datastart);
+			for(uint64_t r = 0; r < nrow; r += nChunkRow)
+			{
+				uint64_t n = min(nChunkRow, nrow - r);
+				in_.read(buf.get(), n * nRowSizeBytes);
+				plan.fix_mixed_endian(buf.get(), n);
+				plan.decode(buf.get(), n, chunk.memptr(), nChunkRow, chunkMin);
+				for(unsigned c = 0; c < nCol; c++)
+					realMin[c] = min(realMin[c], chunkMin[c]);
+
+				lock.lock();
+				{
+					hsize_t offset[] = {0, r};
+					hsize_t count[] = {nCol, n};
+					dataspace.selectHyperslab( H5S_SELECT_SET, count, offset );
+					hsize_t dimsm[] = {nCol, nChunkRow};
+					DataSpace memspace(2,dimsm);
+					hsize_t offset_mem[] = {0, 0};
+					memspace.selectHyperslab( H5S_SELECT_SET, count, offset_mem );
+					dataset.write(chunk.memptr(), h5_datatype_data(DataTypeLocation::MEM), memspace, dataspace);
+				}
+				lock.unlock();
+			}
+			in_.close();
+
+			finish_fcs_data(plan, config, realMin);
+		}catch(...){
+			//the h5 objects are closed under the lock
+			if(!lock.owns_lock())
+				lock.lock();
+			throw;
+		}
+
+		lock.lock();
+		write_h5_params(file);
+
+		write_h5_keys(file);
+
+		write_h5_pheno_data(file);
+	}
+
 	void MemCytoFrame::read_fcs_header()
 	{
 		open_fcs_file();
@@ -1040,6 +1056,13 @@ namespace cytolib
 		data_.insert_cols(data_.n_cols, new_cols);
 	}
 
+	void MemCytoFrame::append_data_rows(const EVENT_DATA_VEC & new_events)
+	{
+		if(rownames_.size() > 0)
+			throw(domain_error("Can't append events to the frame that has rownames!"));
+		data_.insert_rows(data_.n_rows, new_events);
+	}
+
 
 	/**
 	 * return the pointer of a particular data column
@@ -1057,6 +1080,12 @@ namespace cytolib
 		return data_.colptr(idx);
 	}
 
+	void MemCytoFrame::compensate(const compensation & comp){
+		arma::uvec marker_idx, detector_idx;
+		get_compensation_idx(comp, marker_idx, detector_idx);
+		comp.apply(data_, marker_idx, detector_idx, g_comp_num_threads);
+	}
+
 	void MemCytoFrame::transform_data(const trans_local & trans) {
 		if(g_loglevel>=GATING_HIERARCHY_LEVEL)
 			PRINT("start transforming cytoframe data \n");
@@ -36,47 +36,88 @@ void unpackFromBytes(vector <bool> & x, const vector<unsigned char>& x_bytes){
 }
 
 
-	BOOLINDICES::BOOLINDICES(vector <unsigned> _ind, unsigned _nEvent){
-		nEvents = _nEvent;
-		x.resize(nEvents);
-		for(auto i : _ind)
-			x[i] = true;
-	}
-	BOOLINDICES::BOOLINDICES(vector <bool> _ind){
-		x=_ind;
-		nEvents=_ind.size();
-
+	EventBitmap::EventBitmap(unsigned nBits, bool value):words_((nBits + 63) / 64, value ? ~uint64_t(0) : 0), nBits_(nBits){
+		clear_tail();
 	}
-	vector<unsigned> BOOLINDICES::getIndices_u(){
-		vector<unsigned> res;
-
-		for(unsigned i = 0; i < x.size(); i++){
+	EventBitmap::EventBitmap(const vector<bool> & x):EventBitmap(x.size()){
+		for(unsigned i = 0; i < nBits_; i++)
 			if(x[i])
-				res.push_back(i);
-		}
+				set(i);
+	}
+	EventBitmap::EventBitmap(const vector<unsigned> & ind, unsigned nBits):EventBitmap(nBits){
+		for(auto i : ind)
+			set(i);
+	}
+	void EventBitmap::clear_tail(){
+		unsigned nTail = nBits_ % 64;
+		if(nTail > 0)
+			words_.back() &= (uint64_t(1) << nTail) - 1;
+	}
+	unsigned EventBitmap::count() const{
+		unsigned res = 0;
+		for(auto w : words_)
+			res += __builtin_popcountll(w);
+		return res;
+	}
+	EventBitmap & EventBitmap::operator&=(const EventBitmap & y){
+		if(nBits_ != y.nBits_)
+			throw(domain_error("can't combine the event indices of different lengths!"));
+		for(unsigned i = 0; i < words_.size(); i++)
+			words_[i] &= y.words_[i];
+		return *this;
+	}
+	EventBitmap & EventBitmap::operator|=(const EventBitmap & y){
+		if(nBits_ != y.nBits_)
+			throw(domain_error("can't combine the event indices of different lengths!"));
+		for(unsigned i = 0; i < words_.size(); i++)
+			words_[i] |= y.words_[i];
+		return *this;
+	}
+	void EventBitmap::flip(){
+		for(auto & w : words_)
+			w = ~w;
+		clear_tail();
+	}
+	vector<unsigned> EventBitmap::to_indices() const{
+		vector<unsigned> res;
+		res.reserve(count());
+		for_each([&res](unsigned i){res.push_back(i);});
+		return res;
+	}
+	vector<bool> EventBitmap::to_bool() const{
+		vector<bool> res(nBits_, false);
+		for_each([&res](unsigned i){res[i] = true;});
+		return res;
+	}
+	string EventBitmap::to_bytes() const{
+		unsigned nBytes = (nBits_ + 7) / 8;
+		string res(nBytes, 0);
+		//byte order is fixed regardless of the endianness of the host
+		for(unsigned i = 0; i < nBytes; i++)
+			res[i] = (words_[i / 8] >> (8 * (i % 8))) & 0xff;
+		return res;
+	}
+	EventBitmap EventBitmap::from_bytes(const string & bytes, unsigned nBits){
+		EventBitmap res(nBits);
+		unsigned nBytes = min<size_t>((nBits + 7) / 8, bytes.size());
+		for(unsigned i = 0; i < nBytes; i++)
+			res.words_[i / 8] |= uint64_t((unsigned char)bytes[i]) << (8 * (i % 8));
+		res.clear_tail();
 		return res;
 	}
 
+	BOOLINDICES::BOOLINDICES(vector <unsigned> _ind, unsigned _nEvent):POPINDICES(_nEvent),x(_ind, _nEvent){}
+	BOOLINDICES::BOOLINDICES(vector <bool> _ind):POPINDICES(_ind.size()),x(_ind){}
+
 	void BOOLINDICES::convertToPb(pb::POPINDICES & ind_pb){
 		ind_pb.set_indtype(pb::BOOL);
-		unsigned nBits=x.size();
-		unsigned nBytes=ceil(float(nBits)/8);
-		vector<unsigned char> bytes(nBytes,0);
-		packToBytes(x, bytes);
-		string * byte_pb = ind_pb.mutable_bind();
-		for(unsigned i = 0; i < bytes.size(); i++){
-			unsigned char byte = bytes[i];
-			byte_pb->append(string(1, byte));
-		}
+		ind_pb.set_bind(x.to_bytes());
 		ind_pb.set_nevents(nEvents);
 	}
 	BOOLINDICES::BOOLINDICES(const pb::POPINDICES & ind_pb){
 		nEvents = ind_pb.nevents();
 		//fetch byte stream from pb
-		vector<unsigned char> bytes(ind_pb.bind().begin(),ind_pb.bind().end());
-		//convert it to bit vector
-		x.resize(nEvents,false);
-		unpackFromBytes(x, bytes);
+		x = EventBitmap::from_bytes(ind_pb.bind(), nEvents);
 	}
 
 	INTINDICES::INTINDICES(vector <bool> _ind){
@@ -11,9 +11,11 @@ namespace cytolib
 	vector<double> calibrationTable::getY(){return y;};
 	void calibrationTable::setY(vector<double> _y){
 			y=_y;
+			spline_idx = SPLINE_INDEX();
 			};
 	void calibrationTable::setX(vector<double> _x){
 				x=_x;
+				spline_idx = SPLINE_INDEX();
 				};
 	vector<double> calibrationTable::getB(){return b;};
 	vector<double> calibrationTable::getC(){return c;};
@@ -49,6 +51,7 @@ namespace cytolib
 			d.resize(x.size());
 			natural_spline(x, y, b, c, d);
 			flag=true;
+			build_index();
 		}
 
 
@@ -74,12 +77,17 @@ namespace cytolib
 
 		return res;
 	}
-	void calibrationTable::transforming(double * input, int nSize){
+	void calibrationTable::build_index(){
+		spline_idx = spline_index(x, y, b, c, d);
+	}
+	void calibrationTable::transforming(EVENT_DATA_TYPE * input, int nSize){
 
 
 		int imeth=2;
-
-		spline_eval(imeth,input, nSize, x, y, b, c, d);
+		if(spline_idx.empty())
+			spline_eval(imeth,input, nSize, x, y, b, c, d);
+		else
+			spline_eval(spline_idx, input, nSize);
 
 	}
 
@@ -116,6 +124,8 @@ namespace cytolib
 		spline_method = cal_pb.spline_method();
 		caltype = cal_pb.caltype();
 		flag = cal_pb.flag();
+		if(flag)
+			build_index();
 	}
 
 };
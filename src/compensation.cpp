@@ -47,6 +47,82 @@ namespace cytolib
 		mat B(spillOver.data(), nDetector, nMarker);
 		return B.t();
 	}
+	/*
+	 * the number of rows compensated together, which keeps the tile of all detectors and markers in L2 cache
+	 */
+	const unsigned COMP_TILE_ROWS = 1024;
+
+	shared_ptr<const COMP_INVERSE> compensation::get_inverse_ptr() const
+	{
+		shared_ptr<const COMP_INVERSE> inv = atomic_load(&inverse_);
+		unsigned nMarker = marker.size();
+		if(inv && inv->nMarker == nMarker && inv->spillOver == spillOver)
+			return inv;
+		shared_ptr<COMP_INVERSE> res(new COMP_INVERSE());
+		res->spillOver = spillOver;
+		res->nMarker = nMarker;
+		//B is detector by marker
+		mat B = get_spillover_mat().t();
+		mat Q;
+		mat R;
+		qr_econ(Q, R, B);
+		// the least squares solution of B * t(X) = t(D) is t(X) = solve(R, t(Q) * t(D)),
+		// i.e. X = D * t(solve(R, t(Q)))
+		// Note: trimatu to tell Armadillo that R is upper-triangular
+		// so it goes straight to back-substitution
+		res->K = solve(trimatu(R), Q.t()).t();
+		inv = res;
+		atomic_store(&inverse_, inv);
+		return inv;
+	}
+
+	void compensation::apply(arma::Mat<EVENT_DATA_TYPE> & data, const arma::uvec & marker_idx, const arma::uvec & detector_idx, int num_threads) const
+	{
+		unsigned nMarker = marker_idx.size();
+		unsigned nDetector = detector_idx.size();
+		if(nMarker != marker.size() || nDetector != detector.size())
+			throw(domain_error("The number of columns to compensate does not match the spillover matrix!"));
+		if(nMarker == 0)
+			return;
+		// the (small) inverse is computed in double and then applied in the precision of the events
+		arma::Mat<EVENT_DATA_TYPE> K = conv_to<arma::Mat<EVENT_DATA_TYPE>>::from(get_inverse_ptr()->K);
+		size_t nRow = data.n_rows;
+		vector<const EVENT_DATA_TYPE *> det_cols(nDetector);
+		vector<EVENT_DATA_TYPE *> marker_cols(nMarker);
+		for(unsigned i = 0; i < nDetector; i++)
+			det_cols[i] = data.colptr(detector_idx[i]);
+		for(unsigned i = 0; i < nMarker; i++)
+			marker_cols[i] = data.colptr(marker_idx[i]);
+
+		long nTile = (nRow + COMP_TILE_ROWS - 1) / COMP_TILE_ROWS;
+		#pragma omp parallel num_threads(max(1, num_threads))
+		{
+			//the markers may overlap with the detectors, thus are buffered until the entire tile is done
+			vector<EVENT_DATA_TYPE> out(COMP_TILE_ROWS * nMarker);
+			#pragma omp for schedule(static)
+			for(long t = 0; t < nTile; t++)
+			{
+				size_t start = t * COMP_TILE_ROWS;
+				unsigned len = min<size_t>(COMP_TILE_ROWS, nRow - start);
+				for(unsigned j = 0; j < nMarker; j++)
+				{
+					EVENT_DATA_TYPE * o = out.data() + j * COMP_TILE_ROWS;
+					fill_n(o, len, 0);
+					for(unsigned i = 0; i < nDetector; i++)
+					{
+						//the zero coefficients are not skipped so that NaN/Inf propagate as in the matrix product
+						const EVENT_DATA_TYPE k = K(i, j);
+						const EVENT_DATA_TYPE * x = det_cols[i] + start;
+						for(unsigned r = 0; r < len; r++)
+							o[r] += k * x[r];
+					}
+				}
+				for(unsigned j = 0; j < nMarker; j++)
+					copy_n(out.data() + j * COMP_TILE_ROWS, len, marker_cols[j] + start);
+			}
+		}
+	}
+
 	void compensation::update_channels(const CHANNEL_MAP & chnl_map){
 
 		for(vector<string>::iterator it = marker.begin(); it != marker.end(); it++)
@@ -4,6 +4,7 @@
 #include <cytolib/global.hpp>
 
 #include <cytolib/ellipse2points.hpp>
+#include <cytolib/gate_kernels.hpp>
 #include <boost/foreach.hpp>
 
 
@@ -151,63 +152,16 @@ namespace cytolib
 	INDICE_TYPE MultiRangeGate::gating(MemCytoFrame& fdata,
                                     INDICE_TYPE& parentInd) {
 	  INDICE_TYPE res;
-	  int nEvents = parentInd.size();
-	  res.reserve(nEvents);
-	  
 	  const EVENT_DATA_TYPE* data_1d =
 	    fdata.get_data_memptr(name_, ColType::channel);
 	  // the ranges should be already sorted and merged, but if we're inserting
 	  // gates to an already constructed multirange gate
 	  // we need to sort and merge again.
 	  SortAndMergeRanges();
-	  int num_regions = ranges_.size();
-	  // compare computation cost and decide how to perform gating
-	  if (num_regions > 2 * log(nEvents)) {
-	    // The implementation with pre-sorting data, complexity O(2*n*logn+n)
-	    int region_idx = 0;
-	    int vec_idx = 0;
-	    std::vector<EVENT_DATA_TYPE> data_1d_vec(data_1d, data_1d + nEvents);
-	    std::vector<int> p(nEvents);
-	    std::iota(p.begin(), p.end(), 0);
-	    std::sort(p.begin(), p.end(), [&data_1d_vec](int i1, int i2) {
-	      return data_1d_vec[i1] < data_1d_vec[i2];
-	    });
-	    std::sort(data_1d_vec.begin(), data_1d_vec.end());
-	    while (region_idx < num_regions && vec_idx < nEvents) {
-	      auto region = ranges_[region_idx];
-	      EVENT_DATA_TYPE ev = data_1d_vec[vec_idx];
-	      if (ev > region.second) {
-	        region_idx++;
-	      } else {
-	        if ((neg && ev < region.first) || (!neg && ev >= region.first)) {
-	          res.push_back(vec_idx);
-	        }
-	        vec_idx++;
-	      }
-	    }
-	    INDICE_TYPE res_permuted(res.size());
-	    std::transform(res.begin(), res.end(), res_permuted.begin(),
-                    [&p](int i) { return p[i]; });
-	    return res_permuted;
-	  } else {
-	    // The implementation without pre-sorting data, complexity O(n*m)
-	    
-	    for (auto i : parentInd) {
-	      bool isIn = false;
-	      auto data_value = data_1d[i];
-	      for (const auto& region : ranges_) {
-	        isIn = data_value <= region.second && data_value >= region.first;
-	        if (isIn) {
-	          break;  // early termination of the loop if cell already included in
-	          // one interval
-	        }
-	      }
-	      if (isIn != neg) {
-	        res.push_back(i);
-	      }
-	    }
-	    return res;
-	  }
+	  // each event is located among the regions by the binary search, complexity O(n*log(m))
+	  bool is_dense = is_dense_indices(parentInd, fdata.n_rows());
+	  in_ranges(data_1d, ranges_, parentInd, is_dense, neg, res, g_gate_num_threads);
+	  return res;
 	}
 	
 	// MultiRangeGate transforming
@@ -267,14 +221,9 @@ namespace cytolib
 
 		EVENT_DATA_TYPE * data_1d = fdata.get_data_memptr(param.getName(), ColType::channel);
 
-		int nEvents=parentInd.size();
 		INDICE_TYPE res;
-		res.reserve(nEvents);
-		for(auto i : parentInd){
-			bool isIn = data_1d[i]<=param.getMax()&&data_1d[i]>=param.getMin();
-			if(isIn != neg)
-			res.push_back(i);
-		}
+		bool is_dense = is_dense_indices(parentInd, fdata.n_rows());
+		in_range(data_1d, param.getMin(), param.getMax(), parentInd, is_dense, neg, res, g_gate_num_threads);
 
 		return res;
 	}
@@ -477,7 +426,7 @@ namespace cytolib
 		vector<cytolib::CYTO_POINT> points(nVert);
 		for(unsigned i = 0; i < nVert; i++)
 			points[i] = vertices[i];
-		cytolib::in_polygon(xdata, ydata, points, parentInd, neg, res);
+		cytolib::in_polygon(xdata, ydata, points, parentInd, neg, res, g_gate_num_threads);
 		return res;
 	}
 
@@ -559,6 +508,44 @@ namespace cytolib
 		polygonGate::convertToPb(gate_pb);
 			gate_pb.set_type(pb::RECT_GATE);
 	}
+	INDICE_TYPE rectGate::gating(MemCytoFrame & fdata, INDICE_TYPE & parentInd)
+	{
+		vector<coordinate> vertices=param.getVertices();
+		unsigned nVertex=vertices.size();
+		if(nVertex!=2)
+			throw(domain_error("invalid number of vertices for rectgate!"));
+		EVENT_DATA_TYPE * xdata = fdata.get_data_memptr(param.xName(), ColType::channel);
+		EVENT_DATA_TYPE * ydata = fdata.get_data_memptr(param.yName(), ColType::channel);
+
+		INDICE_TYPE res;
+		if(parentInd.size() == 0)
+			return res;
+		RECT_BOUNDS b = {vertices[0].x, vertices[1].x, vertices[0].y, vertices[1].y, false, false, false, false};
+		if(b.xmin>b.xmax||b.ymin>b.ymax)
+			throw(domain_error("invalid vertices for rectgate!"));
+		if(is_quad)
+		{
+			//avoid the edge cells counted multiple times
+			switch(quadrant)
+			{
+				case Q1:
+					b.ymin_open = true;
+					break;
+				case Q2:
+					b.xmin_open = true;
+					break;
+				case Q3:
+					b.ymax_open = true;
+					break;
+				case Q4:
+					b.xmax_open = true;
+					break;
+			}
+		}
+		bool is_dense = is_dense_indices(parentInd, fdata.n_rows());
+		in_rect(xdata, ydata, b, parentInd, is_dense, neg, res, g_gate_num_threads);
+		return res;
+	}
 	vector<coordinate> ellipseGate::getCovarianceMat() const{
 		if(!Transformed())
 			throw(domain_error("EllipseGate has not been transformed so covariance matrix is unavailable!"));
@@ -820,19 +807,17 @@ namespace cytolib
 		cc = -c/det;
 		dd = a/det;
 
-		// if inside of the ellipse
-		int nEvents=parentInd.size();
+		// if inside of the ellipse, i.e. x * x * aa + x* y * (bb + cc) + y * y * dd <= dist^2 for the centered data
+		ELLIPSE_QUADRATIC_FORM q;
+		q.mux = mu.x;
+		q.muy = mu.y;
+		q.qxx = aa;
+		q.qxy = bb + cc;
+		q.qyy = dd;
+		q.bound = dist * dist;
 		INDICE_TYPE res;
-		res.reserve(nEvents);
-		for(auto i : parentInd){
-			//center the data
-
-			EVENT_DATA_TYPE x = xdata[i] - mu.x;
-			EVENT_DATA_TYPE y = ydata[i] - mu.y;
-			bool isIn = (x * x * aa + x* y * cc + x* y * bb + y * y * dd) <= pow(dist, 2);
-			if(isIn != neg)
-			res.push_back(i);
-		}
+		bool is_dense = is_dense_indices(parentInd, fdata.n_rows());
+		in_ellipse(xdata, ydata, q, parentInd, is_dense, neg, res, g_gate_num_threads);
 
 		return res;
 	}
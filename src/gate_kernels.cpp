@@ -0,0 +1,245 @@
+// Copyright 2019 Fred Hutchinson Cancer Research Center
+// See the included LICENSE file for details on the licence that is granted to the user of this software.
+#include <cytolib/gate_kernels.hpp>
+#include <limits>
+namespace cytolib
+{
+/*
+ * the number of events evaluated together into the mask
+ */
+const size_t GATE_BLOCK_SIZE = 1024;
+/*
+ * parentInd is not split into more chunks than this to keep the threading overhead negligible
+ */
+const size_t GATE_MIN_EVENTS_PER_THREAD = 1 << 16;
+
+/*
+ * kernel(ind, len, is_dense, isIn) evaluates the predicate of the events ind[0..len) into isIn (0/1)
+ * (when is_dense, they are the contiguous events starting from ind[0])
+ * the mask is kept in the same floating type as the event data so that the kernels are vectorized (even with plain SSE2)
+ */
+template<class KERNEL> static void gating_chunk(const KERNEL & kernel, const unsigned * ind, size_t n, bool is_dense, bool is_negated, INDICE_TYPE & res)
+{
+	EVENT_DATA_TYPE isIn[GATE_BLOCK_SIZE];
+	EVENT_DATA_TYPE flip = is_negated;
+	size_t offset = res.size();
+	res.resize(offset + n);//shrunk to the selected ones at the end
+	unsigned * out = res.data() + offset;
+	size_t nOut = 0;
+	for(size_t start = 0; start < n; start += GATE_BLOCK_SIZE)
+	{
+		size_t len = min(GATE_BLOCK_SIZE, n - start);
+		const unsigned * block_ind = ind + start;
+		kernel(block_ind, len, is_dense, isIn);
+		//branch-free compaction: every index is written but only the selected ones advance the output
+		if(is_dense)
+		{
+			unsigned first = block_ind[0];
+			for(unsigned j = 0; j < len; j++)
+			{
+				out[nOut] = first + j;
+				nOut += isIn[j] != flip;
+			}
+		}
+		else
+			for(size_t j = 0; j < len; j++)
+			{
+				out[nOut] = block_ind[j];
+				nOut += isIn[j] != flip;
+			}
+	}
+	res.resize(offset + nOut);
+}
+
+template<class KERNEL> static void gating(const KERNEL & kernel, const INDICE_TYPE & parentInd, bool is_dense, bool is_negated, INDICE_TYPE & res, int num_threads)
+{
+	size_t n = parentInd.size();
+	size_t nChunk = min<size_t>(max(1, num_threads), n / GATE_MIN_EVENTS_PER_THREAD);
+	if(nChunk <= 1)
+	{
+		gating_chunk(kernel, parentInd.data(), n, is_dense, is_negated, res);
+		return;
+	}
+	//each chunk is gated into its own buffer, which are then concatenated in order
+	size_t chunk_size = (n + nChunk - 1) / nChunk;
+	vector<INDICE_TYPE> chunk_res(nChunk);
+	#pragma omp parallel for schedule(static) num_threads(nChunk)
+	for(unsigned k = 0; k < nChunk; k++)
+	{
+		size_t start = k * chunk_size;
+		size_t len = min(chunk_size, n - start);
+		gating_chunk(kernel, parentInd.data() + start, len, is_dense, is_negated, chunk_res[k]);
+	}
+	for(auto & r : chunk_res)
+		res.insert(res.end(), r.begin(), r.end());
+}
+
+struct RangeKernel
+{
+	const EVENT_DATA_TYPE * data;
+	EVENT_DATA_TYPE min, max;
+	void operator()(const unsigned * ind, size_t len, bool is_dense, EVENT_DATA_TYPE * isIn) const
+	{
+		const EVENT_DATA_TYPE lo = min, hi = max;
+		if(is_dense)
+		{
+			const EVENT_DATA_TYPE * x = data + ind[0];
+			#pragma omp simd
+			for(size_t j = 0; j < len; j++)
+				isIn[j] = (x[j] >= lo) & (x[j] <= hi) ? 1 : 0;
+		}
+		else
+		{
+			#pragma omp simd
+			for(size_t j = 0; j < len; j++)
+			{
+				EVENT_DATA_TYPE x = data[ind[j]];
+				isIn[j] = (x >= lo) & (x <= hi) ? 1 : 0;
+			}
+		}
+	}
+};
+
+struct RectKernel
+{
+	const EVENT_DATA_TYPE * xdata;
+	const EVENT_DATA_TYPE * ydata;
+	RECT_BOUNDS b;
+	void operator()(const unsigned * ind, size_t len, bool is_dense, EVENT_DATA_TYPE * isIn) const
+	{
+		//the closed bound also takes the events that are equal to it
+		const EVENT_DATA_TYPE xlo = b.xmin, xhi = b.xmax, ylo = b.ymin, yhi = b.ymax;
+		const bool xlo_eq = !b.xmin_open, xhi_eq = !b.xmax_open, ylo_eq = !b.ymin_open, yhi_eq = !b.ymax_open;
+		if(is_dense)
+		{
+			const EVENT_DATA_TYPE * xd = xdata + ind[0];
+			const EVENT_DATA_TYPE * yd = ydata + ind[0];
+			#pragma omp simd
+			for(size_t j = 0; j < len; j++)
+			{
+				EVENT_DATA_TYPE x = xd[j], y = yd[j];
+				bool inX = ((x > xlo) | ((x == xlo) & xlo_eq)) & ((x < xhi) | ((x == xhi) & xhi_eq));
+				bool inY = ((y > ylo) | ((y == ylo) & ylo_eq)) & ((y < yhi) | ((y == yhi) & yhi_eq));
+				isIn[j] = inX & inY ? 1 : 0;
+			}
+		}
+		else
+		{
+			#pragma omp simd
+			for(size_t j = 0; j < len; j++)
+			{
+				unsigned i = ind[j];
+				EVENT_DATA_TYPE x = xdata[i], y = ydata[i];
+				bool inX = ((x > xlo) | ((x == xlo) & xlo_eq)) & ((x < xhi) | ((x == xhi) & xhi_eq));
+				bool inY = ((y > ylo) | ((y == ylo) & ylo_eq)) & ((y < yhi) | ((y == yhi) & yhi_eq));
+				isIn[j] = inX & inY ? 1 : 0;
+			}
+		}
+	}
+};
+
+struct MultiRangeKernel
+{
+	const EVENT_DATA_TYPE * data;
+	const EVENT_DATA_TYPE * lower;
+	const EVENT_DATA_TYPE * upper;//upper[i + 1] is the upper bound of range i, upper[0] is NaN (for the events below all the ranges)
+	unsigned nRange;
+	void operator()(const unsigned * ind, size_t len, bool is_dense, EVENT_DATA_TYPE * isIn) const
+	{
+		if(nRange == 0)
+		{
+			fill_n(isIn, len, 0);
+			return;
+		}
+		for(size_t j = 0; j < len; j++)
+		{
+			EVENT_DATA_TYPE x = is_dense ? data[ind[0] + j] : data[ind[j]];
+			//the number of the lower bounds <= x
+			const EVENT_DATA_TYPE * base = lower;
+			unsigned n = nRange;
+			while(n > 1)
+			{
+				unsigned half = n / 2;
+				base = base[half] <= x ? base + half : base;
+				n -= half;
+			}
+			unsigned cnt = (base - lower) + (*base <= x);
+			isIn[j] = x <= upper[cnt] ? 1 : 0;
+		}
+	}
+};
+
+struct EllipseKernel
+{
+	const EVENT_DATA_TYPE * xdata;
+	const EVENT_DATA_TYPE * ydata;
+	ELLIPSE_QUADRATIC_FORM q;
+	void operator()(const unsigned * ind, size_t len, bool is_dense, EVENT_DATA_TYPE * isIn) const
+	{
+		const EVENT_DATA_TYPE mux = q.mux, muy = q.muy, qxx = q.qxx, qxy = q.qxy, qyy = q.qyy, bound = q.bound;
+		if(is_dense)
+		{
+			const EVENT_DATA_TYPE * xd = xdata + ind[0];
+			const EVENT_DATA_TYPE * yd = ydata + ind[0];
+			#pragma omp simd
+			for(size_t j = 0; j < len; j++)
+			{
+				EVENT_DATA_TYPE x = xd[j] - mux;
+				EVENT_DATA_TYPE y = yd[j] - muy;
+				isIn[j] = x * (qxx * x + qxy * y) + qyy * y * y <= bound ? 1 : 0;
+			}
+		}
+		else
+		{
+			#pragma omp simd
+			for(size_t j = 0; j < len; j++)
+			{
+				unsigned i = ind[j];
+				EVENT_DATA_TYPE x = xdata[i] - mux;
+				EVENT_DATA_TYPE y = ydata[i] - muy;
+				isIn[j] = x * (qxx * x + qxy * y) + qyy * y * y <= bound ? 1 : 0;
+			}
+		}
+	}
+};
+
+bool is_dense_indices(const INDICE_TYPE & parentInd, unsigned nEvents)
+{
+	if(parentInd.size() != nEvents)
+		return false;
+	unsigned nMismatch = 0;
+	#pragma omp simd reduction(+:nMismatch)
+	for(unsigned i = 0; i < nEvents; i++)
+		nMismatch += parentInd[i] != i;
+	return nMismatch == 0;
+}
+
+void in_range(const EVENT_DATA_TYPE * data, EVENT_DATA_TYPE min, EVENT_DATA_TYPE max, const INDICE_TYPE & parentInd, bool is_dense, bool is_negated, INDICE_TYPE & res, int num_threads)
+{
+	gating(RangeKernel{data, min, max}, parentInd, is_dense, is_negated, res, num_threads);
+}
+
+void in_rect(const EVENT_DATA_TYPE * xdata, const EVENT_DATA_TYPE * ydata, const RECT_BOUNDS & b, const INDICE_TYPE & parentInd, bool is_dense, bool is_negated, INDICE_TYPE & res, int num_threads)
+{
+	gating(RectKernel{xdata, ydata, b}, parentInd, is_dense, is_negated, res, num_threads);
+}
+
+void in_ranges(const EVENT_DATA_TYPE * data, const vector<pair<float, float>> & ranges, const INDICE_TYPE & parentInd, bool is_dense, bool is_negated, INDICE_TYPE & res, int num_threads)
+{
+	unsigned nRange = ranges.size();
+	vector<EVENT_DATA_TYPE> lower(nRange), upper(nRange + 1);
+	upper[0] = numeric_limits<EVENT_DATA_TYPE>::quiet_NaN();
+	for(unsigned i = 0; i < nRange; i++)
+	{
+		lower[i] = ranges[i].first;
+		upper[i + 1] = ranges[i].second;
+	}
+	gating(MultiRangeKernel{data, lower.data(), upper.data(), nRange}, parentInd, is_dense, is_negated, res, num_threads);
+}
+
+void in_ellipse(const EVENT_DATA_TYPE * xdata, const EVENT_DATA_TYPE * ydata, const ELLIPSE_QUADRATIC_FORM & q, const INDICE_TYPE & parentInd, bool is_dense, bool is_negated, INDICE_TYPE & res, int num_threads)
+{
+	gating(EllipseKernel{xdata, ydata, q}, parentInd, is_dense, is_negated, res, num_threads);
+}
+
+}
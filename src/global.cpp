@@ -1,9 +1,11 @@
 // Copyright 2019 Fred Hutchinson Cancer Research Center
 // See the included LICENSE file for details on the licence that is granted to the user of this software.
 #include <cytolib/global.hpp>
+#include <cytolib/H5FileCache.hpp>
 #ifdef ROUT
 #include <R_ext/Print.h>
 #endif
+#include <thread>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/uuid/uuid_generators.hpp>
@@ -15,24 +17,40 @@ namespace fs = boost::filesystem;
 
 namespace cytolib
 {
+	//the library's own setting of CYTOLIB_FLOAT_EVENTS (see datatype.hpp)
+	extern const int CYTOLIB_EVENT_DATA_MODE = sizeof(EVENT_DATA_TYPE);
 	bool my_throw_on_error = true;
 	unsigned short g_loglevel = 0;
+	int g_gate_num_threads = 1;
+	int g_comp_num_threads = 1;
+	int g_trans_num_threads = 1;
+	size_t g_h5_copy_max_elements = 1 << 22;
 	vector<string> spillover_keys = {"SPILL", "spillover", "$SPILLOVER"};
 	void PRINT(string a){
-	#ifdef ROUT
-	 Rprintf(a.c_str());
-	#else
-	 cout << a;
-	#endif
-
+		PRINT(a.c_str());
 	}
+	/*
+	 * the thread that loads the library (i.e. R's main thread)
+	 * omp_get_thread_num() can't tell it since a worker running a nested (or inactive) parallel region is the thread 0 of that region
+	 */
+	static const std::thread::id main_thread_id = std::this_thread::get_id();
 	void PRINT(const char * a){
 	#ifdef ROUT
+	 //R API can only be called from the main thread, drop the messages from the other worker threads
+	 if(std::this_thread::get_id() != main_thread_id)
+		 return;
 	 Rprintf(a);
 	#else
+	 //keep the messages of the concurrent workers from interleaving
+	 static std::mutex m;
+	 lock_guard<std::mutex> guard(m);
 	 cout << a;
 	#endif
 
+	}
+	std::recursive_mutex & h5_mutex(){
+		static std::recursive_mutex m;
+		return m;
 	}
 	string s3_to_http(string uri)
 	{
@@ -86,6 +104,8 @@ namespace cytolib
 	    throw std::runtime_error(dst.generic_string() + " exists");
 	  }
 
+	  //the cached handles of the source files are closed so that they are copied in their final state
+	  H5FileCache::instance().release_dir(src.string());
 	  if (fs::is_directory(src)) {
 	    fs::create_directories(dst);
 	    for (fs::directory_entry& item : fs::directory_iterator(src)) {
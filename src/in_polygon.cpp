@@ -1,79 +1,193 @@
 // Copyright 2019 Fred Hutchinson Cancer Research Center
 // See the included LICENSE file for details on the licence that is granted to the user of this software.
 #include <cytolib/in_polygon.hpp>
+#include <limits>
 namespace cytolib
 {
+/*
+ * the number of events tested together against each edge
+ */
+const size_t POLYGON_BATCH_SIZE = 512;
+/*
+ * parentInd is not split into more chunks than this to keep the threading overhead negligible
+ */
+const size_t POLYGON_MIN_EVENTS_PER_THREAD = 1 << 16;
 
-void in_polygon(EVENT_DATA_TYPE * xdata, EVENT_DATA_TYPE * ydata, const vector<cytolib::CYTO_POINT> & vertices, INDICE_TYPE & parentInd, bool is_negated, INDICE_TYPE &res)
+PolygonGatingEngine::PolygonGatingEngine(const vector<CYTO_POINT> & vertices)
 {
-	unsigned counter;
-	EVENT_DATA_TYPE xinters;
-	 //find max py
-	double p_y_max = max_element(vertices.begin(), vertices.end(),[](const cytolib::CYTO_POINT & v1, const cytolib::CYTO_POINT & v2){return v1.y < v2.y;})->y;
-	//TODO: potentially we can speed up by caching pre-calculated p_bottom,top,left,right here to avoid repeated computation within the loop
-	for(auto i : parentInd)
-	{//iterate over points
-		vector<cytolib::CYTO_POINT>::const_iterator p1;
-		vector<cytolib::CYTO_POINT>::const_iterator p2;
-		counter=0;
-		for(p1  = vertices.begin(), p2 = p1 + 1; p1 < vertices.end(); p1++,p2++)
-		{// iterate over vertices
+	unsigned nVert = vertices.size();
+	if(nVert == 0)
+	{//empty bounding box
+		x_max_ = y_max_ = -numeric_limits<EVENT_DATA_TYPE>::infinity();
+		y_min_ = numeric_limits<EVENT_DATA_TYPE>::infinity();
+		return;
+	}
+	edges_.resize(nVert);
+	x_max_ = vertices[0].x;
+	y_max_ = y_min_ = vertices[0].y;
+	for(unsigned i = 0; i < nVert; i++)
+	{
+		//the last vertice must "loop around"
+		const CYTO_POINT & p1 = vertices[i];
+		const CYTO_POINT & p2 = vertices[i + 1 == nVert ? 0 : i + 1];
 
-			if (p2 == vertices.end())
-			{//the last vertice must "loop around"
-				p2 = vertices.begin();
-			}
+		const CYTO_POINT * p_bottom = &p1;
+		const CYTO_POINT * p_top = &p2;
+		if(p_bottom->y > p_top->y)
+			swap(p_bottom, p_top);
 
-		  /*if horizontal ray is in y range of vertex find the x coordinate where
-			ray and vertex intersect*/
-			const cytolib::CYTO_POINT *  p_bottom = &(*p1);
-			const cytolib::CYTO_POINT *  p_top = &(*p2);
-			if(p_bottom->y > p_top->y)
-				swap(p_bottom, p_top);
+		POLYGON_EDGE & e = edges_[i];
+		e.p1x = p1.x;
+		e.p1y = p1.y;
+		e.dx = p2.x - p1.x;
+		e.is_horizontal = p2.y == p1.y;
+		e.dy = p2.y - p1.y;
+		e.bottom = p_bottom->y;
+		e.top = p_top->y;
+		e.left = min(p1.x, p2.x);
+		e.right = max(p1.x, p2.x);
+		e.top_x = p_top->x;
 
-			const cytolib::CYTO_POINT *  p_left = p_bottom;
-			const cytolib::CYTO_POINT *  p_right = p_top;
-			if(p_left->x > p_right->x)
-				swap(p_left, p_right);
+		x_max_ = max(x_max_, p1.x);
+		y_max_ = max(y_max_, p1.y);
+		y_min_ = min(y_min_, p1.y);
+		if(!e.is_horizontal)
+			cross_edges_.push_back(e);
+	}
+}
 
-			if(ydata[i] >= p_bottom->y && ydata[i] < p_top->y &&xdata[i] <= p_right->x && p2->y != p1->y)
+bool PolygonGatingEngine::is_in(EVENT_DATA_TYPE x, EVENT_DATA_TYPE y) const
+{
+	unsigned counter = 0;
+	for(const POLYGON_EDGE & e : edges_)
+	{
+		/*if horizontal ray is in y range of vertex find the x coordinate where
+		ray and vertex intersect*/
+		if(y >= e.bottom && y < e.top && x <= e.right && !e.is_horizontal)
+		{
+			EVENT_DATA_TYPE xinters = (y - e.p1y) * e.dx / e.dy + e.p1x;
+			/*if intersection x coordinate == point x coordinate it lies on the
+			  boundary of the polygon, which means "in"*/
+			if(xinters == x)
 			{
-				xinters = (ydata[i]-p1->y)*(p2->x-p1->x)/(p2->y-p1->y)+p1->x;
-			  /*if intersection x coordinate == point x coordinate it lies on the
-				  boundary of the polygon, which means "in"*/
-				if(xinters==xdata[i])
-				{
-				  counter=1;
-				  break;
-				}
-				/*count how many vertices are passed by the ray*/
-				if (xinters > xdata[i])counter++;
-			 }
-			 else if(ydata[i] == p_y_max)//handle cell that is at the same y-level as the top vertex/edge
-			 {
-				if(p_top->y == ydata[i])//one end of edge reach the same y as top
-				{
-				  if(p_bottom->y == ydata[i])//horizontal top edge
-				  {
-					  counter = xdata[i] >= p_left->x && xdata[i] <= p_right->x;//whether on the edge
-
-				  }
-				  else//check if on the top vertex
-					  counter = xdata[i] == p_top->x;
-				}
+				counter = 1;
 				break;
-			  }
-
 			}
-			/*uneven number of vertices passed means "in"*/
-
-			 bool isIn =((counter % 2) != 0);
-			 if(isIn != is_negated)
-				res.push_back(i);
+			/*count how many vertices are passed by the ray*/
+			if(xinters > x)
+				counter++;
+		}
+		else if(y == y_max_)//handle cell that is at the same y-level as the top vertex/edge
+		{
+			if(e.top == y)//one end of edge reach the same y as top
+			{
+				if(e.is_horizontal)//horizontal top edge
+					counter = x >= e.left && x <= e.right;//whether on the edge
+				else//check if on the top vertex
+					counter = x == e.top_x;
+			}
+			break;
+		}
 	}
+	/*uneven number of vertices passed means "in"*/
+	return (counter % 2) != 0;
+}
 
+void PolygonGatingEngine::gating_chunk(const EVENT_DATA_TYPE * xdata, const EVENT_DATA_TYPE * ydata, const unsigned * ind, size_t n, bool is_negated, INDICE_TYPE & res) const
+{
+	EVENT_DATA_TYPE xb[POLYGON_BATCH_SIZE], yb[POLYGON_BATCH_SIZE];
+	unsigned pos[POLYGON_BATCH_SIZE];//the position of the candidate within the batch
+	//the counters are kept in the same floating type as the event data so that the loop is vectorized(even with plain SSE2)
+	EVENT_DATA_TYPE counter[POLYGON_BATCH_SIZE];
+	EVENT_DATA_TYPE on_edge[POLYGON_BATCH_SIZE];
+	unsigned char isIn[POLYGON_BATCH_SIZE];
+	for(size_t start = 0; start < n; start += POLYGON_BATCH_SIZE)
+	{
+		size_t nBatch = min(POLYGON_BATCH_SIZE, n - start);
+		const unsigned * batch_ind = ind + start;
+		/*
+		 * bounding box pre-filter
+		 * the events that are below/above or to the right of the polygon can never cross any edge
+		 * (nor hit the top vertex/edge), so they are "out" for sure.
+		 * The left side is not filtered since the ray casting of those events is subject to the rounding of xinters
+		 */
+		unsigned nCand = 0;
+		for(size_t j = 0; j < nBatch; j++)
+		{
+			unsigned i = batch_ind[j];
+			EVENT_DATA_TYPE x = xdata[i];
+			EVENT_DATA_TYPE y = ydata[i];
+			isIn[j] = 0;
+			if(y < y_min_ || y > y_max_ || x > x_max_)
+				continue;
+			if(y == y_max_)//the top level events stop at the first non-crossing edge, which depends on the edge order
+				isIn[j] = is_in(x, y);
+			else
+			{
+				xb[nCand] = x;
+				yb[nCand] = y;
+				pos[nCand++] = j;
+			}
+		}
+		if(nCand > 0)
+		{
+			/*
+			 * for the rest of events, the result no longer depends on the edge order:
+			 * it is "in" either when it lies on any edge or when the ray crosses uneven number of edges.
+			 * So the events are accumulated edge by edge in a branch-free(vectorizable) loop
+			 */
+			fill_n(counter, nCand, 0);
+			fill_n(on_edge, nCand, 0);
+			for(const POLYGON_EDGE & e : cross_edges_)
+			{
+				const EVENT_DATA_TYPE bottom = e.bottom, top = e.top, right = e.right;
+				const EVENT_DATA_TYPE p1x = e.p1x, p1y = e.p1y, dx = e.dx, dy = e.dy;
+				for(unsigned j = 0; j < nCand; j++)
+				{
+					EVENT_DATA_TYPE x = xb[j];
+					EVENT_DATA_TYPE y = yb[j];
+					bool is_cross = (y >= bottom) & (y < top) & (x <= right);
+					EVENT_DATA_TYPE xinters = (y - p1y) * dx / dy + p1x;
+					on_edge[j] += (is_cross & (xinters == x)) ? 1 : 0;
+					counter[j] += (is_cross & (xinters > x)) ? 1 : 0;
+				}
+			}
+			for(unsigned j = 0; j < nCand; j++)
+				isIn[pos[j]] = on_edge[j] > 0 || (unsigned(counter[j]) % 2) != 0;
+		}
+		for(size_t j = 0; j < nBatch; j++)
+			if(bool(isIn[j]) != is_negated)
+				res.push_back(batch_ind[j]);
+	}
+}
 
+void PolygonGatingEngine::gating(const EVENT_DATA_TYPE * xdata, const EVENT_DATA_TYPE * ydata, const INDICE_TYPE & parentInd, bool is_negated, INDICE_TYPE &res, int num_threads) const
+{
+	size_t n = parentInd.size();
+	size_t nChunk = min<size_t>(max(1, num_threads), n / POLYGON_MIN_EVENTS_PER_THREAD);
+	if(nChunk <= 1)
+	{
+		gating_chunk(xdata, ydata, parentInd.data(), n, is_negated, res);
+		return;
+	}
+	//each chunk is gated into its own buffer, which are then concatenated in order
+	size_t chunk_size = (n + nChunk - 1) / nChunk;
+	vector<INDICE_TYPE> chunk_res(nChunk);
+	#pragma omp parallel for schedule(static) num_threads(nChunk)
+	for(unsigned k = 0; k < nChunk; k++)
+	{
+		size_t start = k * chunk_size;
+		size_t len = min(chunk_size, n - start);
+		chunk_res[k].reserve(len);
+		gating_chunk(xdata, ydata, parentInd.data() + start, len, is_negated, chunk_res[k]);
+	}
+	for(auto & r : chunk_res)
+		res.insert(res.end(), r.begin(), r.end());
 }
 
+void in_polygon(EVENT_DATA_TYPE * xdata, EVENT_DATA_TYPE * ydata, const vector<cytolib::CYTO_POINT> & vertices, INDICE_TYPE & parentInd, bool is_negated, INDICE_TYPE &res, int num_threads)
+{
+	PolygonGatingEngine(vertices).gating(xdata, ydata, parentInd, is_negated, res, num_threads);
 }
 
+}
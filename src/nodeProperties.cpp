@@ -11,7 +11,7 @@ namespace cytolib
 	 * convert pb object to internal structure
 	 * @param np_pb
 	 */
-	nodeProperties::nodeProperties(const pb::nodeProperties & np_pb):thisGate(NULL),hidden(false){
+	nodeProperties::nodeProperties(const pb::nodeProperties & np_pb):thisGate(NULL),hidden(false),dirty(false){
 		thisName = np_pb.thisname();
 		if(g_loglevel>=POPULATION_LEVEL)
 				PRINT("loading node: "+thisName+"\n");;
@@ -149,6 +149,7 @@ namespace cytolib
 		fjStats=np.fjStats;
 		fcStats=np.fcStats;
 		hidden=np.hidden;
+		dirty=np.dirty;
 
 
 	}
@@ -160,6 +161,7 @@ namespace cytolib
 		std::swap(fjStats, np.fjStats);
 		std::swap(fcStats, np.fcStats);
 		std::swap(hidden, np.hidden);
+		std::swap(dirty, np.dirty);
 
 		return *this;
 
@@ -214,13 +216,21 @@ namespace cytolib
 				throw(domain_error("trying to get Indices for unGated node!"));
 			return indices->getIndices_u();
 			}
+	EventBitmap nodeProperties::getBitmap(){
+			if(!this->isGated())
+				throw(domain_error("trying to get Indices for unGated node!"));
+			return indices->getBitmap();
+			}
 
 	/**
 	 * update the node with the new indices
 	 *
 	 */
 	void nodeProperties::setIndices(vector<bool> _ind){
-		unsigned nEvents=count(_ind.begin(),_ind.end(),true);
+		setIndices(EventBitmap(_ind));
+	}
+	void nodeProperties::setIndices(const EventBitmap & _ind){
+		unsigned nEvents=_ind.count();
 		unsigned nSizeInt=sizeof(unsigned)*nEvents;
 		unsigned nSizeBool=_ind.size()/8;
 
@@ -1,7 +1,9 @@
 // Copyright 2019 Fred Hutchinson Cancer Research Center
 // See the included LICENSE file for details on the licence that is granted to the user of this software.
 #include <cytolib/spline.hpp>
+#include <cytolib/trans_kernels.hpp>
 #include <cmath>
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
 #include <cstring>
@@ -210,7 +212,7 @@ void natural_spline(vector<double>x, vector<double> y, vector<double>& b,vector<
 
 }
 
-void spline_eval(int method, double* u,int nSize,
+void spline_eval(int method, EVENT_DATA_TYPE* u,int nSize,
 		  const vector<double> & x, const vector<double> & y, const vector<double> & b, const vector<double> & c, const vector<double> & d)
 {
 /* Evaluate  v[l] := spline(u[l], ...),	    l = 1,..,nu, i.e. 0:(nu-1)
@@ -220,7 +222,7 @@ void spline_eval(int method, double* u,int nSize,
 
 	int n=x.size();
 	int nu=nSize;
-	double * v = u;//new double[nSize];
+	EVENT_DATA_TYPE * v = u;//new double[nSize];
     const int n_1 = n - 1;
     int i, j, k, l;
     double ul, dx, tmp;
@@ -265,4 +267,98 @@ void spline_eval(int method, double* u,int nSize,
 //    memcpy(u, v, sizeof(double)*nSize);
 //    delete v;
 }
+
+/*
+ * the buckets are sized by the smallest gap between the knots (so that most of the buckets hold at most one knot),
+ * but no more than this many per knot to bound the memory for the highly skewed knots (e.g. biexp)
+ */
+const int SPLINE_MAX_BUCKETS_PER_KNOT = 16;
+
+SPLINE_INDEX spline_index(const vector<double> & x, const vector<double> & y, const vector<double> & b, const vector<double> & c, const vector<double> & d)
+{
+	SPLINE_INDEX index;
+	int n = x.size();
+	if(n < 2 || y.size() != x.size() || b.size() != x.size() || c.size() != x.size() || d.size() != x.size())
+		return index;
+	double min_gap = numeric_limits<double>::infinity();
+	for(int i = 0; i < n; i++)
+	{
+		if(!isfinite(x[i]))
+			return index;
+		if(i > 0)
+		{
+			double gap = x[i] - x[i-1];
+			if(gap < 0)//not sorted
+				return index;
+			if(gap > 0)
+				min_gap = min(min_gap, gap);
+		}
+	}
+	double range = x[n-1] - x[0];
+	if(!(range > 0))
+		return index;
+	int nBucket = max<double>(n, min<double>(range / min_gap, double(SPLINE_MAX_BUCKETS_PER_KNOT) * n));
+	index.x0 = x[0];
+	index.inv_width = nBucket / range;
+	double width = range / nBucket;
+	index.bucket.resize(nBucket + 1);
+	for(int k = 0; k <= nBucket; k++)
+		index.bucket[k] = lower_bound(x.begin(), x.end(), x[0] + k * width) - x.begin();
+	index.bucket[nBucket] = n;
+	index.knots.resize(n + 1);
+	for(int i = 0; i < n; i++)
+		index.knots[i] = {x[i], y[i], b[i], c[i], d[i]};
+	index.knots[n] = {x[0], y[0], b[0], c[0], 0.0};
+	return index;
+}
+
+void spline_eval(const SPLINE_INDEX & index, EVENT_DATA_TYPE* u, int nSize)
+{
+	const SPLINE_KNOT * knots = index.knots.data();
+	const int * bucket = index.bucket.data();
+	int n = index.knots.size() - 1;
+	int nBucket = index.bucket.size() - 1;
+	double x0 = index.x0;
+	double inv_width = index.inv_width;
+	transform_blocks(u, nSize, [=](EVENT_DATA_TYPE * v, int len){
+		int ind[TRANS_BLOCK_SIZE];
+		double buf[TRANS_BLOCK_SIZE];
+		//locate the intervals
+		for(int l = 0; l < len; l++)
+		{
+			double ul = v[l];
+			if(!isfinite(ul))
+			{
+				ind[l] = 0;
+				continue;
+			}
+			double pos = (ul - x0) * inv_width;
+			int k = pos <= 0 ? 0 : (pos >= nBucket ? nBucket - 1 : int(pos));
+			int lo = bucket[k];
+			int hi = bucket[k + 1];
+			//the number of the knots <= ul, which is guaranteed within [lo, hi] unless the bucket is off by the rounding of pos
+			int cnt;
+			if((lo == 0 || knots[lo - 1].x <= ul) && (hi == n || ul < knots[hi].x))
+			{
+				cnt = lo;
+				while(cnt < hi && knots[cnt].x <= ul)
+					cnt++;
+			}
+			else
+				cnt = upper_bound(knots, knots + n, ul, [](double a, const SPLINE_KNOT & b){return a < b.x;}) - knots;
+			ind[l] = cnt == 0 ? n : cnt - 1;
+		}
+		//evaluate the cubic polynomials
+		#pragma omp simd
+		for(int l = 0; l < len; l++)
+		{
+			const SPLINE_KNOT & knot = knots[ind[l]];
+			double dx = v[l] - knot.x;
+			buf[l] = knot.y + dx * (knot.b + dx * (knot.c + dx * knot.d));
+		}
+		for(int l = 0; l < len; l++)
+			if(isfinite(v[l]))
+				v[l] = buf[l];
+	});
+}
 };
@@ -0,0 +1,170 @@
+// Copyright 2019 Fred Hutchinson Cancer Research Center
+// See the included LICENSE file for details on the licence that is granted to the user of this software.
+#include <cytolib/trans_kernels.hpp>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+
+namespace cytolib
+{
+	static inline double bits_to_double(uint64_t b){
+		double d;
+		memcpy(&d, &b, sizeof(d));
+		return d;
+	}
+	static inline uint64_t double_to_bits(double d){
+		uint64_t b;
+		memcpy(&b, &d, sizeof(b));
+		return b;
+	}
+	//ln2 split so that k * LN2_HI is exact for the exponents of double
+	const double LN2_HI = 6.93147180369123816490e-01;
+	const double LN2_LO = 1.90821492927058770002e-10;
+	const double INV_LN2 = 1.44269504088896338700e+00;
+	const double TWO52 = 4503599627370496.0;
+	const double ROUND_MAGIC = 6755399441055744.0;//1.5 * 2^52, adding which rounds to integer
+	const double EXP_MAX_ARG = 708;
+
+	/*
+	 * ln(x) for the normal positive x
+	 * x = 2^e * m (m in [sqrt(2)/2, sqrt(2))), ln(m) = 2 * atanh(s), s = (m - 1) / (m + 1)
+	 * The selections are written as arithmetic so that the loops calling it are vectorized
+	 */
+	static inline double kernel_log(double x)
+	{
+		uint64_t bits = double_to_bits(x);
+		//the exponent is converted to double through the magic number instead of the int conversion, which is not vectorized by SSE2
+		double e = bits_to_double((bits >> 52) | 0x4330000000000000ULL) - (TWO52 + 1023);
+		double m = bits_to_double((bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL);
+		double is_hi = m > M_SQRT2 ? 1.0 : 0.0;
+		m -= 0.5 * m * is_hi;
+		e += is_hi;
+		double f = m - 1;
+		double s = f / (m + 1);
+		double s2 = s * s;
+		//the series of atanh(s)/s - 1, |s| < 0.172
+		double p = 1.0 / 23;
+		p = p * s2 + 1.0 / 21;
+		p = p * s2 + 1.0 / 19;
+		p = p * s2 + 1.0 / 17;
+		p = p * s2 + 1.0 / 15;
+		p = p * s2 + 1.0 / 13;
+		p = p * s2 + 1.0 / 11;
+		p = p * s2 + 1.0 / 9;
+		p = p * s2 + 1.0 / 7;
+		p = p * s2 + 1.0 / 5;
+		p = p * s2 + 1.0 / 3;
+		//ln(1 + f) = f - (f^2/2 - s * (f^2/2 + R)), which keeps the leading f exact
+		double hfsq = 0.5 * f * f;
+		double R = 2 * s2 * p;
+		double logm = f - (hfsq - s * (hfsq + R));
+		return e * LN2_HI + (logm + e * LN2_LO);
+	}
+	/*
+	 * exp(x) for |x| <= EXP_MAX_ARG
+	 * x = k * ln2 + r (|r| <= ln2/2), exp(x) = 2^k * exp(r)
+	 */
+	static inline double kernel_exp(double x)
+	{
+		double t = x * INV_LN2 + ROUND_MAGIC;
+		//k is in the low bits of t
+		uint64_t k_bits = double_to_bits(t);
+		double k = t - ROUND_MAGIC;
+		double r = (x - k * LN2_HI) - k * LN2_LO;
+		//taylor series up to r^13
+		double p = 1.0 / 6227020800;
+		p = p * r + 1.0 / 479001600;
+		p = p * r + 1.0 / 39916800;
+		p = p * r + 1.0 / 3628800;
+		p = p * r + 1.0 / 362880;
+		p = p * r + 1.0 / 40320;
+		p = p * r + 1.0 / 5040;
+		p = p * r + 1.0 / 720;
+		p = p * r + 1.0 / 120;
+		p = p * r + 1.0 / 24;
+		p = p * r + 1.0 / 6;
+		p = p * r + 0.5;
+		p = p * r + 1;
+		p = p * r + 1;
+		return p * bits_to_double((k_bits + 1023) << 52);
+	}
+
+	void batch_affine(EVENT_DATA_TYPE * x, int n, double a, double b)
+	{
+		transform_blocks(x, n, [a, b](EVENT_DATA_TYPE * xb, int len){
+			#pragma omp simd
+			for(int i = 0; i < len; i++)
+				xb[i] = a * xb[i] + b;
+		});
+	}
+
+	void batch_log_affine(EVENT_DATA_TYPE * x, int n, double a, double b, EVENT_DATA_TYPE non_positive)
+	{
+		transform_blocks(x, n, [a, b, non_positive](EVENT_DATA_TYPE * xb, int len){
+			double buf[TRANS_BLOCK_SIZE];
+			//the approximation is evaluated for all the events (it is harmless for the invalid ones)
+			#pragma omp simd
+			for(int i = 0; i < len; i++)
+				buf[i] = a * kernel_log(xb[i]) + b;
+			for(int i = 0; i < len; i++)
+			{
+				double v = xb[i];
+				if(v >= DBL_MIN && v <= DBL_MAX)
+					xb[i] = buf[i];
+				else
+					xb[i] = v > 0 ? a * log(v) + b : non_positive;
+			}
+		});
+	}
+
+	void batch_exp_affine(EVENT_DATA_TYPE * x, int n, double a, double b)
+	{
+		transform_blocks(x, n, [a, b](EVENT_DATA_TYPE * xb, int len){
+			double buf[TRANS_BLOCK_SIZE];
+			#pragma omp simd
+			for(int i = 0; i < len; i++)
+				buf[i] = kernel_exp(a * xb[i] + b);
+			for(int i = 0; i < len; i++)
+			{
+				double y = a * xb[i] + b;
+				xb[i] = std::abs(y) <= EXP_MAX_ARG ? buf[i] : exp(y);
+			}
+		});
+	}
+
+	void batch_sinh_affine(EVENT_DATA_TYPE * x, int n, double a, double b, double c)
+	{
+		transform_blocks(x, n, [a, b, c](EVENT_DATA_TYPE * xb, int len){
+			double buf[TRANS_BLOCK_SIZE];
+			#pragma omp simd
+			for(int i = 0; i < len; i++)
+			{
+				double y = a * xb[i] + b;
+				double E = kernel_exp(y);
+				//E - 1/E cancels near zero, where the Taylor series (up to y^19) is used instead
+				double y2 = y * y;
+				double series = y * (1 + y2 / 6 * (1 + y2 / 20 * (1 + y2 / 42 * (1 + y2 / 72 * (1 + y2 / 110
+								* (1 + y2 / 156 * (1 + y2 / 210 * (1 + y2 / 272 * (1 + y2 / 342)))))))));
+				buf[i] = c * (std::abs(y) < 1 ? series : 0.5 * (E - 1 / E));
+			}
+			for(int i = 0; i < len; i++)
+			{
+				double y = a * xb[i] + b;
+				xb[i] = std::abs(y) <= EXP_MAX_ARG ? buf[i] : c * sinh(y);
+			}
+		});
+	}
+
+	void batch_asinh_affine(EVENT_DATA_TYPE * x, int n, double s, double a, double b)
+	{
+		/*
+		 * std::asinh is kept since the sqrt it needs is not vectorized without -fno-math-errno,
+		 * so this kernel only benefits from the hoisting and the threads
+		 */
+		transform_blocks(x, n, [s, a, b](EVENT_DATA_TYPE * xb, int len){
+			for(int i = 0; i < len; i++)
+				xb[i] = a * asinh(s * xb[i]) + b;
+		});
+	}
+};
@@ -2,6 +2,8 @@
 // See the included LICENSE file for details on the licence that is granted to the user of this software.
 #include <cytolib/transformation.hpp>
 #include <cytolib/global.hpp>
+#include <cytolib/trans_kernels.hpp>
+#include <cstring>
 
 namespace cytolib
 {
@@ -230,14 +232,14 @@ namespace cytolib
 		 * directly translated from java routine from tree star
 		 */
 
-		EVENT_DATA_TYPE ln10 = log(10.0);
-		EVENT_DATA_TYPE decades = pos;
-		EVENT_DATA_TYPE lowScale = widthBasis;
-		EVENT_DATA_TYPE width = log10(-lowScale);
+		double ln10 = log(10.0);
+		double decades = pos;
+		double lowScale = widthBasis;
+		double width = log10(-lowScale);
 
 		if (width < 0.5 || width > 3) width = 0.5;
 		decades -= width / 2;
-		EVENT_DATA_TYPE extra = neg;
+		double extra = neg;
 		if (extra < 0) extra = 0;
 		extra += width / 2;
 
@@ -247,16 +249,16 @@ namespace cytolib
 		if (zeroChan > 0) decades = extra * channelRange / zeroChan;
 		width /= 2 * decades;        // 1.1
 
-		EVENT_DATA_TYPE maximum = maxValue;
-		EVENT_DATA_TYPE positiveRange = ln10 * decades;
-		EVENT_DATA_TYPE minimum = maximum / exp(positiveRange);
-		EVENT_DATA_TYPE negativeRange = logRoot(positiveRange, width);
+		double maximum = maxValue;
+		double positiveRange = ln10 * decades;
+		double minimum = maximum / exp(positiveRange);
+		double negativeRange = logRoot(positiveRange, width);
 
-		EVENT_DATA_TYPE maxChannlVal = channelRange + 1;
+		double maxChannlVal = channelRange + 1;
 		int nPoints = maxChannlVal;//4097;//fix the number of points so that it won't lost the precision when scale is set to 256 (i.e. channelRange = 256)
 
-		vector<EVENT_DATA_TYPE> positive(nPoints), negative(nPoints), vals(nPoints);
-		EVENT_DATA_TYPE step = (maxChannlVal-1)/(EVENT_DATA_TYPE)(nPoints -1);
+		vector<double> positive(nPoints), negative(nPoints), vals(nPoints);
+		double step = (maxChannlVal-1)/(double)(nPoints -1);
 		for (int j = 0; j < nPoints; j++)
 		{
 			vals[j] = j * step;
@@ -266,7 +268,7 @@ namespace cytolib
 
 
 
-		EVENT_DATA_TYPE s = exp((positiveRange + negativeRange) * (width + extra / decades));
+		double s = exp((positiveRange + negativeRange) * (width + extra / decades));
 		for(int j = 0; j < nPoints; j++)
 			negative[j] *= s;
 
@@ -345,9 +347,9 @@ namespace cytolib
 	void fasinhTrans::transforming(EVENT_DATA_TYPE * input, int nSize){
 
 
-		for(int i=0;i<nSize;i++){
-			input[i] = length * (asinh(input[i] * sinh(M * log(10)) / T) + A * log(10)) / ((M + A) * log(10));
-		}
+		//length * (asinh(x * sinh(M * log(10)) / T) + A * log(10)) / ((M + A) * log(10))
+		double ln10 = log(10.);
+		batch_asinh_affine(input, nSize, sinh(M * ln10) / T, length / ((M + A) * ln10), length * A / (M + A));
 	//		EVENT_DATA_TYPE myB = (M + A) * log(10);
 	//		EVENT_DATA_TYPE myC = A * log(10);
 	//		EVENT_DATA_TYPE myA = T / sinh(myB - myC);
@@ -404,8 +406,9 @@ namespace cytolib
 			, EVENT_DATA_TYPE _A, EVENT_DATA_TYPE _M):fasinhTrans(_maxRange, _length, _T, _A, _M){}
 
 	void  fsinhTrans::transforming(EVENT_DATA_TYPE * input, int nSize){
-		for(int i=0;i<nSize;i++)
-			input[i] = sinh(((M + A) * log(10)) * input[i]/length - A * log(10)) * T / sinh(M * log(10));
+		//sinh(((M + A) * log(10)) * x/length - A * log(10)) * T / sinh(M * log(10))
+		double ln10 = log(10.);
+		batch_sinh_affine(input, nSize, (M + A) * ln10 / length, -A * ln10, T / sinh(M * ln10));
 
 	}
 	TransPtr fsinhTrans::getInverseTransformation(){throw(domain_error("inverse function not defined!"));};
@@ -438,11 +441,8 @@ namespace cytolib
 
 	void logTrans::transforming(EVENT_DATA_TYPE * input, int nSize){
 
-			for(int i=0;i<nSize;i++){
-				auto & x = input[i];
-
-				x = x>0?((log10(x)-log10(offset))/decade)* scale:0;
-			}
+			//x>0?((log10(x)-log10(offset))/decade)* scale:0
+			batch_log_affine(input, nSize, scale / (decade * log(10.)), -log10(offset) / decade * scale, 0);
 
 	}
 	TransPtr logTrans::clone() const{return TransPtr(new logTrans(*this));};
@@ -469,9 +469,8 @@ namespace cytolib
 	logInverseTrans::logInverseTrans(EVENT_DATA_TYPE _offset,EVENT_DATA_TYPE _decade, unsigned _scale, unsigned _T):logTrans(_offset, _decade, _scale, _T){};
 	void logInverseTrans::transforming(EVENT_DATA_TYPE * input, int nSize){
 
-			for(int i=0;i<nSize;i++){
-				input[i]= pow(10, (input[i]* decade/scale + log10(offset)));
-			}
+			//10^(x * decade/scale + log10(offset))
+			batch_exp_affine(input, nSize, log(10.) * decade / scale, log(offset));
 
 	}
 
@@ -504,13 +503,11 @@ namespace cytolib
 		    throw(domain_error("All data values are negative. Cannot impute minimum value for GML2 log transform."));
 		}
 			
-		for(int i=0;i<nSize;i++){
-			auto & x = input[i];
-			// Non GML2-standard imputation logic
-			// Bring any negative values up to the smallest
-			// positive value
-			x = x>0.0?((log10(x)-log10(T))/M)+1:min;
-		}
+		// x>0.0?((log10(x)-log10(T))/M)+1:min
+		// Non GML2-standard imputation logic
+		// Bring any negative values up to the smallest
+		// positive value
+		batch_log_affine(input, nSize, 1 / (M * log(10.)), 1 - log10(T) / M, min);
 	}
 
 	TransPtr logGML2Trans::clone() const{return TransPtr(new logGML2Trans(*this));};
@@ -533,10 +530,8 @@ namespace cytolib
 	logGML2InverseTrans::logGML2InverseTrans(EVENT_DATA_TYPE _T,EVENT_DATA_TYPE _M):logGML2Trans(_T, _M){};
 	void logGML2InverseTrans::transforming(EVENT_DATA_TYPE * input, int nSize){
 
-			for(int i=0;i<nSize;i++){
-				// T*10^(M(x-1))
-				input[i]= pow(10, (input[i]*M - M + log10(T)));
-			}
+			// T*10^(M(x-1))
+			batch_exp_affine(input, nSize, M * log(10.), log(T) - M * log(10.));
 
 	}
 
@@ -548,8 +543,7 @@ namespace cytolib
 	        calTbl.setInterpolated(true);
 	}
 	void linTrans::transforming(EVENT_DATA_TYPE * input, int nSize){
-	for(int i=0;i<nSize;i++)
-				input[i]*=64;
+		batch_affine(input, nSize, 64, 0);
 	}
 
 	TransPtr linTrans::clone() const{return TransPtr(new linTrans(*this));};
@@ -579,8 +573,7 @@ namespace cytolib
 	scaleTrans::scaleTrans(EVENT_DATA_TYPE _scale_factor):transformation(true, SCALE),t_scale(1), r_scale(1), scale_factor(_scale_factor){calTbl.setInterpolated(true);}
 
 	void scaleTrans::transforming(EVENT_DATA_TYPE * input, int nSize){
-		for(int i=0;i<nSize;i++)
-			input[i]*=scale_factor;
+		batch_affine(input, nSize, scale_factor, 0);
 	}
 
 	TransPtr scaleTrans::clone() const{return TransPtr(new scaleTrans(*this));};
@@ -630,9 +623,9 @@ namespace cytolib
 
 	void flinTrans::transforming(EVENT_DATA_TYPE * input, int nSize){
 
-		for(int i=0;i<nSize;i++){
-			input[i]=flin(input[i]);
-		}
+		//flin(x), i.e. (x+min)/(max+min)
+		double range = max + min;
+		batch_affine(input, nSize, 1 / range, min / range);
 
 	}
 
@@ -989,14 +982,191 @@ namespace cytolib
 			return inverse;
 	}
 
+	/*
+	 * the cubic Hermite coefficients (in t) of the segment from the values and the derivatives (w.r.t. t) at both ends
+	 */
+	static void hermite_coefs(double y0, double y1, double d0, double d1, double * c)
+	{
+		c[0] = y0;
+		c[1] = d0;
+		c[2] = 3 * (y1 - y0) - 2 * d0 - d1;
+		c[3] = 2 * (y0 - y1) + d0 + d1;
+	}
+	static inline double eval_cubic(const double * c, double t)
+	{
+		return c[0] + t * (c[1] + t * (c[2] + t * c[3]));
+	}
+	//the interior points where the approximation error is checked
+	static const double LOGICLE_CHECK_POINTS[] = {0.125, 0.25, 0.5, 0.75, 0.875};
+
+	void logicleTrans::set_fast(bool is_fast, double tol)
+	{
+		if(!is_fast)
+		{
+			table_.reset();
+			return;
+		}
+		if(!(tol > 0))
+			throw(domain_error("The tolerance of fast logicle must be positive!"));
+		shared_ptr<LOGICLE_TABLE> tb(new LOGICLE_TABLE());
+		tb->tol = tol;
+		tb->e_max = ilogb(p.T) + 3;
+		tb->e_min = tb->e_max - 60;
+		/*
+		 * the reference values of the tables
+		 * the small values are evaluated by the linear term of the taylor series, which is exact (up to the round-off) below v_lin
+		 * (taylor[1] is zero, so its error is about taylor[2] * dx^3 / taylor[0]),
+		 * since scale() doesn't always converge there (e.g. W = 0, where it starts from the logarithmic guess)
+		 */
+		double v_lin = p.taylor[2] == 0 ? 0 : p.taylor[0] * cbrt(EPSILON * p.taylor[0] / std::abs(p.taylor[2]));
+		auto scale_ref = [this, v_lin](double v){
+			if(v < v_lin)
+				return p.x1 + v / p.taylor[0];
+			try{
+				return scale(v);
+			}
+			catch(const char * e)
+			{
+				throw(domain_error(string("Can't build the tables of fast logicle: ") + e));
+			}
+		};
+		//below the table scale is linear (up to the round-off)
+		double v_min = ldexp(1., tb->e_min);
+		if(std::abs(scale_ref(v_min) - (p.x1 + v_min / p.taylor[0])) > tol)
+			throw(domain_error("The tolerance of fast logicle is too small!"));
+
+		/*
+		 * forward
+		 */
+		int nExp = tb->e_max - tb->e_min + 1;
+		bool is_ok = false;
+		for(tb->log2K = 3; tb->log2K <= 12 && !is_ok; tb->log2K++)
+		{
+			unsigned K = 1 << tb->log2K;
+			unsigned nSeg = nExp * K;
+			//the knots and slopes
+			vector<double> y(nSeg + 1), d(nSeg + 1);
+			for(unsigned k = 0; k <= nSeg; k++)
+			{
+				double v = ldexp(1 + double(k % K) / K, tb->e_min + k / K);
+				y[k] = scale_ref(v);
+				//dx/dv = 1/slope, which is then scaled to dx/dt by the width of the segment, i.e. 2^e/K
+				d[k] = ldexp(1. / K, tb->e_min + k / K) / slope(y[k]);
+			}
+			tb->fwd.resize(4 * nSeg);
+			double err = 0;
+			for(unsigned k = 0; k < nSeg; k++)
+			{
+				//the derivative at the right end is measured by the width of this segment, which halves at the boundary of the exponents
+				double d1 = (k + 1) % K == 0 ? d[k + 1] / 2 : d[k + 1];
+				double * c = &tb->fwd[4 * k];
+				hermite_coefs(y[k], y[k + 1], d[k], d1, c);
+				double v0 = ldexp(1 + double(k % K) / K, tb->e_min + k / K);
+				double h = ldexp(1. / K, tb->e_min + k / K);
+				for(double t : LOGICLE_CHECK_POINTS)
+					err = max(err, std::abs(eval_cubic(c, t) - scale_ref(v0 + t * h)));
+			}
+			is_ok = err <= tol;
+		}
+		if(!is_ok)
+			throw(domain_error("The tolerance of fast logicle is too small!"));
+		tb->log2K--;
+
+		/*
+		 * inverse
+		 */
+		double x_top = scale_ref(ldexp(1., tb->e_max + 1));
+		is_ok = false;
+		for(tb->h = 1. / 64; tb->h >= 1. / 65536 && !is_ok; tb->h /= 2)
+		{
+			unsigned nSeg = ceil((x_top - p.x1) / tb->h);
+			tb->nSeg = nSeg;
+			vector<double> y(nSeg + 1), d(nSeg + 1);
+			for(unsigned k = 0; k <= nSeg; k++)
+			{
+				double x = p.x1 + k * tb->h;
+				y[k] = inverse(x);
+				d[k] = slope(x) * tb->h;
+			}
+			tb->inv.resize(4 * nSeg);
+			double err = 0;
+			for(unsigned k = 0; k < nSeg; k++)
+			{
+				double * c = &tb->inv[4 * k];
+				hermite_coefs(y[k], y[k + 1], d[k], d[k + 1], c);
+				for(double t : LOGICLE_CHECK_POINTS)
+					err = max(err, std::abs(eval_cubic(c, t) - inverse(p.x1 + (k + t) * tb->h)));
+			}
+			is_ok = err <= tol;
+		}
+		if(!is_ok)
+			throw(domain_error("The tolerance of fast logicle is too small!"));
+		tb->h *= 2;
+		table_ = tb;
+	}
+
+	double logicleTrans::scale_fast(double value) const
+	{
+		const LOGICLE_TABLE & tb = *table_;
+		bool negative = value < 0;
+		double v = std::abs(value);
+		uint64_t bits;
+		memcpy(&bits, &v, sizeof(v));
+		int e = int(bits >> 52) - 1023;
+		double x;
+		if(e < tb.e_min)//including zero
+			x = p.x1 + v / p.taylor[0];
+		else if(e > tb.e_max)//including inf and nan
+			return scale(value);
+		else
+		{
+			//the segment is indexed by the exponent and the leading mantissa bits, and the rest of bits is the position within it
+			unsigned shift = 52 - tb.log2K;
+			size_t seg = (size_t(e - tb.e_min) << tb.log2K) | ((bits >> shift) & ((1u << tb.log2K) - 1));
+			double t = ldexp(double(bits & ((uint64_t(1) << shift) - 1)), -int(shift));
+			x = eval_cubic(&tb.fwd[4 * seg], t);
+		}
+		return negative ? 2 * p.x1 - x : x;
+	}
+
+	double logicleTrans::inverse_fast(double scale) const
+	{
+		const LOGICLE_TABLE & tb = *table_;
+		bool negative = scale < p.x1;
+		double x = negative ? 2 * p.x1 - scale : scale;
+		double u = (x - p.x1) / tb.h;
+		if(!(u < tb.nSeg))//including nan
+			return inverse(scale);
+		unsigned k = u;
+		double v = eval_cubic(&tb.inv[4 * k], u - k);
+		return negative ? -v : v;
+	}
+
 	void logicleTrans::transforming(EVENT_DATA_TYPE * input, int nSize){
 		float m = isGml2?1:p.M;//set scale to (0,1) for Gml2 version
-		if(p.isInverse)
-			for(int i=0;i<nSize;i++)
-				input[i] = inverse(input[i]/m);
+		if(table_)
+		{
+			if(p.isInverse)
+				transform_blocks(input, nSize, [this, m](EVENT_DATA_TYPE * x, int len){
+					for(int i=0;i<len;i++)
+						x[i] = inverse_fast(x[i]/m);
+				});
+			else
+				transform_blocks(input, nSize, [this, m](EVENT_DATA_TYPE * x, int len){
+					for(int i=0;i<len;i++)
+						x[i] = scale_fast(x[i]) * m;
+				});
+		}
+		else if(p.isInverse)
+			transform_blocks(input, nSize, [this, m](EVENT_DATA_TYPE * x, int len){
+				for(int i=0;i<len;i++)
+					x[i] = inverse(x[i]/m);
+			});
 		else
-			for(int i=0;i<nSize;i++)
-				input[i] = scale(input[i]) * m;
+			transform_blocks(input, nSize, [this, m](EVENT_DATA_TYPE * x, int len){
+				for(int i=0;i<len;i++)
+					x[i] = scale(x[i]) * m;
+			});
 
 		}
 
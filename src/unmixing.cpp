@@ -0,0 +1,157 @@
+// Copyright 2019 Fred Hutchinson Cancer Research Center
+// See the included LICENSE file for details on the licence that is granted to the user of this software.
+#include <cytolib/unmixing.hpp>
+#include <chrono>
+
+namespace cytolib
+{
+	/*
+	 * the number of events unmixed together by each thread
+	 */
+	const unsigned UNMIX_TILE_ROWS = 1024;
+
+	SpectralUnmixer::SpectralUnmixer(const compensation & comp, const UNMIX_PARAM & param):comp_(comp), param_(param)
+	{
+		if(param_.method == UnmixMethod::WLS && !(param_.background_variance > 0))
+			throw(domain_error("background_variance must be positive for WLS unmixing!"));
+		if(comp_.empty())
+			return;
+		M_ = comp_.get_spillover_mat();
+		if(M_.n_rows > M_.n_cols)
+			throw(domain_error("Spectral unmixing requires at least as many detectors as markers!"));
+		//factorize once (and share it with the copies of comp_)
+		K_ = comp_.get_inverse();
+	}
+
+	UNMIX_STATS SpectralUnmixer::unmix(EVENT_DATA_VEC & data, const arma::uvec & marker_idx, const arma::uvec & detector_idx) const
+	{
+		auto start = chrono::steady_clock::now();
+		UNMIX_STATS stats;
+		stats.nEvents = data.n_rows;
+		stats.nMarker = marker_idx.size();
+		stats.nDetector = detector_idx.size();
+		if(param_.method == UnmixMethod::OLS)
+			comp_.apply(data, marker_idx, detector_idx, param_.num_threads);
+		else
+		{
+			unsigned nMarker = M_.n_rows;
+			unsigned nDetector = M_.n_cols;
+			if(marker_idx.size() != nMarker || detector_idx.size() != nDetector)
+				throw(domain_error("The number of columns to unmix does not match the spillover matrix!"));
+			size_t nRow = data.n_rows;
+			vector<const EVENT_DATA_TYPE *> det_cols(nDetector);
+			vector<EVENT_DATA_TYPE *> marker_cols(nMarker);
+			for(unsigned i = 0; i < nDetector; i++)
+				det_cols[i] = data.colptr(detector_idx[i]);
+			for(unsigned i = 0; i < nMarker; i++)
+				marker_cols[i] = data.colptr(marker_idx[i]);
+			const double bg = param_.background_variance;
+			long nTile = (nRow + UNMIX_TILE_ROWS - 1) / UNMIX_TILE_ROWS;
+			#pragma omp parallel num_threads(max(1, param_.num_threads))
+			{
+				//the markers may overlap with the detectors, thus are buffered until the entire tile is done
+				vector<double> out(UNMIX_TILE_ROWS * nMarker);
+				vector<double> A(nMarker * nMarker), b(nMarker), y(nDetector);
+				#pragma omp for schedule(static)
+				for(long t = 0; t < nTile; t++)
+				{
+					size_t start = t * UNMIX_TILE_ROWS;
+					unsigned len = min<size_t>(UNMIX_TILE_ROWS, nRow - start);
+					for(unsigned r = 0; r < len; r++)
+					{
+						for(unsigned d = 0; d < nDetector; d++)
+							y[d] = det_cols[d][start + r];
+						/*
+						 * the normal equations (M W t(M)) x = M W y,
+						 * only the lower triangle of A (col-major) is accumulated
+						 */
+						std::fill(A.begin(), A.end(), 0);
+						std::fill(b.begin(), b.end(), 0);
+						for(unsigned d = 0; d < nDetector; d++)
+						{
+							double w = 1 / (max(y[d], 0.0) + bg);
+							const double * m = M_.colptr(d);
+							for(unsigned j = 0; j < nMarker; j++)
+							{
+								double wm = w * m[j];
+								b[j] += wm * y[d];
+								double * a = A.data() + j * nMarker;
+								for(unsigned i = j; i < nMarker; i++)
+									a[i] += wm * m[i];
+							}
+						}
+						//in-place Cholesky (A = L t(L)) and the forward/backward substitutions
+						bool is_pd = true;
+						for(unsigned j = 0; j < nMarker && is_pd; j++)
+						{
+							double * aj = A.data() + j * nMarker;
+							for(unsigned k = 0; k < j; k++)
+							{
+								const double * ak = A.data() + k * nMarker;
+								double l = ak[j];
+								for(unsigned i = j; i < nMarker; i++)
+									aj[i] -= l * ak[i];
+							}
+							if(!(aj[j] > 0))
+								is_pd = false;
+							else
+							{
+								double piv = sqrt(aj[j]);
+								for(unsigned i = j; i < nMarker; i++)
+									aj[i] /= piv;
+							}
+						}
+						if(is_pd)
+						{
+							for(unsigned j = 0; j < nMarker; j++)
+							{
+								const double * aj = A.data() + j * nMarker;
+								b[j] /= aj[j];
+								for(unsigned i = j + 1; i < nMarker; i++)
+									b[i] -= aj[i] * b[j];
+							}
+							for(unsigned j = nMarker; j-- > 0;)
+							{
+								const double * aj = A.data() + j * nMarker;
+								for(unsigned i = j + 1; i < nMarker; i++)
+									b[j] -= aj[i] * b[i];
+								b[j] /= aj[j];
+							}
+						}
+						else
+						{
+							for(unsigned j = 0; j < nMarker; j++)
+							{
+								b[j] = 0;
+								for(unsigned d = 0; d < nDetector; d++)
+									b[j] += y[d] * K_(d, j);
+							}
+						}
+						for(unsigned j = 0; j < nMarker; j++)
+							out[j * UNMIX_TILE_ROWS + r] = b[j];
+					}
+					for(unsigned j = 0; j < nMarker; j++)
+						for(unsigned r = 0; r < len; r++)
+							marker_cols[j][start + r] = out[j * UNMIX_TILE_ROWS + r];
+				}
+			}
+		}
+		stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		if(g_loglevel>=GATING_HIERARCHY_LEVEL)
+			PRINT("unmixed " + to_string(stats.nEvents) + " events at " + to_string(stats.events_per_sec()) + " events/s\n");
+		return stats;
+	}
+
+	UNMIX_STATS SpectralUnmixer::unmix(CytoFrame & cytoframe) const
+	{
+		arma::uvec marker_idx, detector_idx;
+		cytoframe.get_compensation_idx(comp_, marker_idx, detector_idx);
+		MemCytoFrame * fr = dynamic_cast<MemCytoFrame *>(&cytoframe);
+		if(fr)
+			return unmix(fr->get_data_ref(), marker_idx, detector_idx);
+		EVENT_DATA_VEC dat = cytoframe.get_data();
+		auto stats = unmix(dat, marker_idx, detector_idx);
+		cytoframe.set_data(dat);
+		return stats;
+	}
+};